@@ -0,0 +1,247 @@
+/* Benchmarks for expr_set() and expr_eval(); run with `make bench`.
+ *
+ * Prints one tab separated line per benchmark and phase:
+ *   name  phase  ns_per_call  allocs_per_call  calls_per_sec  bytes_per_sec
+ * bytes_per_sec is the rate at which source text is consumed by expr_set()
+ * and 0 for the other phases.
+ *
+ * Before timing, each benchmark checks that expr_eval() with expr_jit() gives
+ * the same results as the interpreter, bit for bit. `make check` (or
+ * qc_bench check) only runs these checks. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "expr.h"
+
+/* Minimum time spent on each measurement. */
+#define MIN_NS 100000000.0
+
+/* Allocations are counted by linking with -Wl,--wrap=malloc etc. */
+static size_t n_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	n_allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+	n_allocs++;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	n_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+typedef enum {
+	PhaseSet,
+	PhaseEval,
+	PhaseEvalJit,
+} Phase;
+
+static const char *phase_names[] = {
+	[PhaseSet]     = "set",
+	[PhaseEval]    = "eval",
+	[PhaseEvalJit] = "eval_jit",
+};
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Values the variables are set to by check_jit(). */
+static const double check_vals[] = {0.5, -1.5, 0.0, 3.25, -0.0, 1e3, 1e-300, -7.0};
+
+static void die(const char *name, const char *what, ExprError err) {
+	fprintf(stderr, "bench %s: %s: %s\n", name, what, err.err);
+	exit(EXIT_FAILURE);
+}
+
+static Expr *new_expr() {
+	Expr *e = expr_new();
+	const char *vars = "abcdefghijklmnopqrstuvwxyz";
+	for (const char *v = vars; *v; v++) {
+		char name[] = {*v, 0};
+		expr_set_var(e, name, 0.5 + (*v - 'a') * 0.01);
+	}
+	const char *long_vars[] = {"alpha", "beta", "gamma", "delta", "epsilon", "abcdefgh"};
+	for (size_t i = 0; i < sizeof(long_vars) / sizeof(long_vars[0]); i++)
+		expr_set_var(e, long_vars[i], 1.0 + i * 0.1);
+	return e;
+}
+
+/* Sets every variable from new_expr() to a value picked by k. */
+static void set_vars(Expr *e, size_t k) {
+	const char *vars = "abcdefghijklmnopqrstuvwxyz";
+	size_t n_vals = sizeof(check_vals) / sizeof(check_vals[0]);
+	for (const char *v = vars; *v; v++) {
+		char name[] = {*v, 0};
+		expr_set_var(e, name, check_vals[(k + (*v - 'a')) % n_vals]);
+	}
+	const char *long_vars[] = {"alpha", "beta", "gamma", "delta", "epsilon", "abcdefgh"};
+	for (size_t i = 0; i < sizeof(long_vars) / sizeof(long_vars[0]); i++)
+		expr_set_var(e, long_vars[i], check_vals[(k + i) % n_vals]);
+}
+
+/* Compares expr_eval() with and without the JIT for each set_vars() k. Returns
+ * false, after printing the first difference, if they don't agree. */
+static bool check_jit(const char *name, const char *src) {
+	Expr *interp = new_expr(), *jit = new_expr();
+	bool ok = true;
+	if (!expr_jit(jit))
+		goto done;
+	ExprError err = expr_set(interp, src);
+	if (err.err != NULL)
+		die(name, "expr_set", err);
+	if ((err = expr_set(jit, src)).err != NULL)
+		die(name, "expr_set", err);
+
+	for (size_t k = 0; k < sizeof(check_vals) / sizeof(check_vals[0]) && ok; k++) {
+		set_vars(interp, k);
+		set_vars(jit, k);
+		double want = 0.0, got = 0.0;
+		ExprError want_err = expr_eval(interp, &want), got_err = expr_eval(jit, &got);
+		if ((want_err.err == NULL) != (got_err.err == NULL) || (want_err.err == NULL && memcmp(&want, &got, sizeof(want)) != 0)) {
+			fprintf(stderr, "check %s: vars %zu: interpreter %.17g (%s), jit %.17g (%s)\n",
+				name, k, want, want_err.err ? want_err.err : "ok", got, got_err.err ? got_err.err : "ok");
+			ok = false;
+		}
+	}
+
+done:
+	expr_destroy(interp);
+	expr_destroy(jit);
+	return ok;
+}
+
+static double run_phase(Expr *e, const char *name, const char *src, Phase phase, size_t n) {
+	ExprError err;
+	double res;
+	double start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		if (phase == PhaseSet) {
+			if ((err = expr_set(e, src)).err != NULL)
+				die(name, "expr_set", err);
+		} else {
+			if ((err = expr_eval(e, &res)).err != NULL)
+				die(name, "expr_eval", err);
+		}
+	}
+	return now_ns() - start;
+}
+
+static bool check_only, failed;
+
+static void bench(const char *name, const char *src) {
+	if (!check_jit(name, src))
+		failed = true;
+	if (check_only)
+		return;
+
+	for (Phase phase = PhaseSet; phase <= PhaseEvalJit; phase++) {
+		Expr *e = new_expr();
+		if (phase == PhaseEvalJit && !expr_jit(e)) {
+			expr_destroy(e);
+			continue;
+		}
+		ExprError err = expr_set(e, src);
+		if (err.err != NULL)
+			die(name, "expr_set", err);
+
+		/* Warm up, then double the iterations until the run is long enough. */
+		size_t n = 1;
+		double ns = run_phase(e, name, src, phase, n);
+		while (ns < MIN_NS) {
+			n *= 2;
+			size_t allocs_before = n_allocs;
+			ns = run_phase(e, name, src, phase, n);
+			if (ns >= MIN_NS) {
+				double per_call = ns / n;
+				printf("%s\t%s\t%.1f\t%.3f\t%.0f\t%.0f\n",
+					name, phase_names[phase], per_call,
+					(double)(n_allocs - allocs_before) / n,
+					1e9 / per_call,
+					phase == PhaseSet ? strlen(src) * 1e9 / per_call : 0.0);
+			}
+		}
+		expr_destroy(e);
+	}
+}
+
+/* Returns src repeated n times, joined by sep and wrapped by pre and post. */
+static char *repeat(const char *pre, const char *src, const char *sep, const char *post, size_t n) {
+	size_t len = strlen(pre) + n * (strlen(src) + strlen(sep)) + strlen(post) + 1;
+	char *res = malloc(len);
+	char *p = res;
+	p += sprintf(p, "%s", pre);
+	for (size_t i = 0; i < n; i++)
+		p += sprintf(p, "%s%s", i == 0 ? "" : sep, src);
+	sprintf(p, "%s", post);
+	return res;
+}
+
+int main(int argc, char **argv) {
+	check_only = argc > 1 && strcmp(argv[1], "check") == 0;
+	if (!check_only)
+		printf("name\tphase\tns_per_call\tallocs_per_call\tcalls_per_sec\tbytes_per_sec\n");
+
+	bench("shallow", "a*x^2+b*x+c");
+	bench("numbers", "1.5+2.25*3.125-4.0625/5.5+6.75*7.875-8.5^0.5+9.25*1e3-0.125");
+	bench("idents", "alpha+beta*gamma-delta/epsilon+alpha*beta-gamma^delta+epsilon");
+
+	char *nested = malloc(2 * 200 + 2);
+	memset(nested, '(', 200);
+	nested[200] = 'x';
+	memset(nested + 201, ')', 200);
+	nested[401] = 0;
+	bench("nested_200", nested);
+	free(nested);
+
+	char *sum = repeat("", "x", "+", "", 1000);
+	bench("sum_1000", sum);
+	free(sum);
+
+	char *num_sum = repeat("", "1.25", "+", "", 1000);
+	bench("num_sum_1000", num_sum);
+	free(num_sum);
+
+	char *ident_sum = repeat("", "abcdefgh", "+", "", 1000);
+	bench("ident_sum_1000", ident_sum);
+	free(ident_sum);
+
+	char *calls = repeat("", "sin(x)", "+", "", 100);
+	bench("calls_100", calls);
+	free(calls);
+
+	/* One benchmark per builtin, with variable arguments so nothing is
+	 * folded away. */
+	for (size_t i = 0; i < expr_n_builtin_funcs; i++) {
+		const ExprBuiltinFunc *f = &expr_builtin_funcs[i];
+		char src[256];
+		char *p = src;
+		p += sprintf(p, "%s(", f->name);
+		for (size_t j = 0; j < f->n_args; j++) {
+			const char *arg = f->arg_types[j] == ExprArgTypeStr ? "q" : j == 0 ? "x" : "y";
+			p += sprintf(p, "%s%s", j == 0 ? "" : ",", arg);
+		}
+		sprintf(p, ")");
+
+		char name[64];
+		snprintf(name, sizeof(name), "builtin_%s", f->name);
+		bench(name, src);
+	}
+
+	if (check_only && !failed)
+		printf("jit agrees with the interpreter\n");
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
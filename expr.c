@@ -1,12 +1,31 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef EXPR_STATS
+#include <time.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_X86_64
+#endif
 
 #include "expr.h"
 
 #define EXPR_INCLUDE_CONFIG
 #include "expr_config.h"
+#include "builtins_hash.h"
 
 /* Builtin funcs array */
 const size_t expr_n_builtin_funcs = sizeof(_builtin_funcs) / sizeof(_builtin_funcs[0]);
@@ -18,6 +37,65 @@ ExprBuiltinVar *expr_builtin_vars = _builtin_vars;
 
 #define TRY(x) {ExprError _err = x; if (_err.err != NULL) return _err;}
 
+#ifdef EXPR_STATS
+/* Counters behind expr_get_stats(), kept per thread so counting needs no
+ * synchronization. */
+typedef struct {
+	size_t toks, ops, folds, moved, probes, resizes, allocs, evals;
+	uint64_t tokenize_ns, compile_ns, eval_ns;
+	/* Indexed by Func.builtin, so calls of other functions go to 0. */
+	size_t builtin_calls[1 + sizeof(_builtin_funcs) / sizeof(_builtin_funcs[0])];
+} Stats;
+
+static _Thread_local Stats stats;
+
+static uint64_t stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *stats_malloc(size_t size) {
+	stats.allocs++;
+	return malloc(size);
+}
+
+static void *stats_calloc(size_t n, size_t size) {
+	stats.allocs++;
+	return calloc(n, size);
+}
+
+static void *stats_realloc(void *ptr, size_t size) {
+	stats.allocs++;
+	return realloc(ptr, size);
+}
+
+static void *stats_aligned_alloc(size_t align, size_t size) {
+	stats.allocs++;
+	return aligned_alloc(align, size);
+}
+
+static char *stats_strdup(const char *s) {
+	stats.allocs++;
+	return strdup(s);
+}
+
+static char *stats_strndup(const char *s, size_t n) {
+	stats.allocs++;
+	return strndup(s, n);
+}
+
+#define malloc stats_malloc
+#define calloc stats_calloc
+#define realloc stats_realloc
+#define aligned_alloc stats_aligned_alloc
+#define strdup stats_strdup
+#define strndup stats_strndup
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
+
 typedef struct {
 	size_t start, end;
 
@@ -31,324 +109,4729 @@ typedef struct {
 	union {
 		double Num;
 		char Char;
-		char *Str;
+		/* Identifiers point into the source, which isn't NUL-terminated. */
+		struct {
+			const char *Str;
+			size_t Len;
+		};
 	};
 } Tok;
 
+/* Bump allocator for the strings of the current expression; reset, not freed,
+ * by every expr_set(). */
+typedef struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t len, cap;
+	char data[];
+} ArenaChunk;
+
+typedef struct {
+	ArenaChunk *chunks;
+	size_t total_cap;
+} Arena;
+
+/* Open addressing hash table of entries starting with their name, a char*,
+ * laid out like a Swiss table: every slot has a control byte holding 7 bits
+ * of the hash of its name, or SMAP_EMPTY or SMAP_DELETED if it has none. A
+ * lookup compares the bytes of SMAP_GROUP slots at once, then the full hashes
+ * of the matching slots, and only then their names. The bytes, hashes and
+ * entries are kept in separate arrays of one allocation. */
+typedef struct {
+	void *entries;
+	uint32_t *hashes;
+	/* cap + SMAP_GROUP bytes; the last SMAP_GROUP repeat the first ones, so
+	 * a group can be loaded starting at any slot. */
+	uint8_t *ctrl;
+	size_t len, deleted, cap;
+} SMap;
+
+typedef struct VarDeps VarDeps;
+
+/* Variable values live in slots which never move, so compiled programs and
+ * users of expr_var_handle() can refer to them directly. Slots of an ExprEnv
+ * are read and written by many threads at once. */
+struct _ExprVar {
+	_Atomic double val;
+	_Atomic bool set;
+	/* Builtin constants, which are folded into programs until changed. */
+	_Atomic bool constant;
+	/* Given out by expr_var_handle(), so the slot is never reused. */
+	bool handle;
+	/* Formulas reading or computing the variable; only for variables of an
+	 * Expr, and NULL until it is part of a formula. */
+	VarDeps *deps;
+};
+
+typedef struct VarChunk {
+	struct VarChunk *next;
+	size_t len;
+	ExprVar slots[64];
+} VarChunk;
+
 typedef struct {
 	char *name;
-	double val;
+	ExprVar *slot;
+	/* Index into prog.vars if prog_stamp matches the current compilation. */
+	uint32_t prog_stamp;
+	uint32_t prog_idx;
+	/* The slot is that of the variable in the environment. */
+	bool shared;
 } Var;
 
+typedef struct UserFunc UserFunc;
+
 typedef struct {
 	char *name;
 	double (*func)(Expr *e, ExprArg *args);
 	ExprArgType *arg_types;
 	size_t n_args;
+	void (*vfunc)(double *res, const double **args, size_t n);
+	void (*dfunc)(double *res, ExprArg *args, double val);
+	void (*ifunc)(ExprInterval *res, const ExprInterval *args);
+	bool impure;
+	bool variadic;
+	/* 1 + the index of the builtin in _builtin_funcs, or 0. */
+	uint16_t builtin;
+	/* Set instead of func for functions defined in the expression language. */
+	UserFunc *user;
 } Func;
 
-struct _Expr {
-	Tok *toks_working;
-	size_t toks_working_len;
-	Tok *toks;
-	size_t toks_len;
-	size_t toks_cap;
+/* Variable of an environment. The name is published last, so readers which
+ * find it also see the slot. */
+typedef struct {
+	_Atomic(char*) name;
+	ExprVar *slot;
+} EnvVar;
+
+/* Hash table which variables are only ever added to, so it can be read
+ * without locks. When full, writers replace it by a bigger copy, but keep
+ * the old one around, as readers may still be looking at it. */
+typedef struct EnvTable {
+	struct EnvTable *prev;
+	size_t len, cap;
+	EnvVar vars[];
+} EnvTable;
+
+struct _ExprEnv {
+	_Atomic size_t refs;
+	/* Serializes writers. */
+	pthread_mutex_t lock;
+	_Atomic(EnvTable*) vars;
+	VarChunk *var_chunks;
+	/* Incremented whenever a builtin constant changes. */
+	_Atomic uint32_t consts_gen;
+	/* Builtin constants, at the index of their name in _builtin_vars. The
+	 * builtin functions are looked up in _builtin_funcs directly. */
+	ExprVar builtin_vars[sizeof(_builtin_vars) / sizeof(_builtin_vars[0])];
+};
+
+/* Instructions of a compiled program, which is evaluated on a stack in postfix
+ * order. */
+typedef enum {
+	OpNum,  /* push Num */
+	OpVar,  /* push the value of the slot vars[arg] */
+	OpStr,  /* push strs[arg] as a string argument */
+	OpNeg,
+	OpSqr,
+	OpAdd,
+	OpSub,
+	OpMul,
+	OpDiv,
+	OpPow,
+	OpCall, /* call funcs[arg] on its arguments on the top of the stack */
+	OpCallUser, /* run the body of the user function funcs[arg] */
+	OpArg,  /* push argument arg of the user function being run */
+	OpReduce, /* run the range reduction ranges[arg] from and to the top of the stack */
+} OpKind;
+
+typedef struct {
+	uint32_t kind;
+	uint32_t arg;
+	union {
+		double Num;
+		/* Where errors in the body of OpCallUser or OpReduce are reported. */
+		struct {
+			uint32_t start, end;
+		} Pos;
+	};
+} Op;
+
+/* Pending operator, parenthesis or function call while compiling. */
+typedef struct {
+	enum {
+		FrameOp,
+		FrameNeg,
+		FrameParen,
+		FrameCall,
+	} kind;
+	char op;
+	size_t n_args;
+	Tok *tok;
+	Func func;
+	/* Index of the ')' closing a range reduction, or 0 for other calls. */
+	size_t range_end;
+} Frame;
 
-	Var *vars;
+typedef struct {
+	ExprVar *slot;
+	const char *name;
+	size_t start, end; /* location of the first use, for error reporting */
+	bool shared;
+} ProgVar;
+
+typedef struct Range Range;
+
+typedef struct {
+	Op *ops;
+	size_t ops_len;
+	size_t ops_cap;
+
+	ProgVar *vars;
 	size_t vars_len;
 	size_t vars_cap;
 
+	char **strs;
+	size_t strs_len;
+	size_t strs_cap;
+
 	Func *funcs;
 	size_t funcs_len;
 	size_t funcs_cap;
 
-	void *userdata;
-};
+	/* Owned by the program. */
+	Range **ranges;
+	size_t ranges_len;
+	size_t ranges_cap;
+
+	/* Current and maximum evaluation stack depth. */
+	size_t stack_len;
+	size_t stack_cap;
+
+	/* Whether a function with side effects is called before the current
+	 * instruction; constants may be changed by it. */
+	bool impure_seen;
+	/* Whether constants were folded into the program, in which case it has
+	 * to be recompiled when consts_gen changes. */
+	bool folds_consts;
+	uint32_t consts_gen;
+	/* Names are resolved at compile time, so the program is recompiled if
+	 * what they refer to changed since. */
+	uint32_t names_gen;
+	/* Whether there are calls to user functions which weren't inlined or
+	 * range reductions, whose bodies are run by run_stack(). */
+	bool runs_bodies;
+	/* ops point into an ExprFile instead of being owned. */
+	bool mapped;
+
+	/* Native code generated by jit_compile(), if any. Returns 0 with the
+	 * result in stack[0], or 1 + the index of an unset variable. */
+	uint32_t (*jit)(Expr *e, ExprArg *stack);
+	void *jit_mem;
+	size_t jit_size;
+} Prog;
+
+/* Function defined by expr_define_func(). Kept until the Expr is destroyed, as
+ * programs compiled before a redefinition may still call it. */
+struct UserFunc {
+	UserFunc *next;
+	size_t n_params;
+	ExprArgType *arg_types;
+	Prog body;
+};
+
+/* Range reduction like sum(i = 1, n, i^2). The body gets the arguments of the
+ * user function it is part of, if any, followed by the index. */
+struct Range {
+	Func combine;
+	/* Divide by the number of values, for mean. */
+	bool mean;
+	/* The result for an empty range. */
+	double empty;
+	size_t n_args;
+	bool impure;
+	/* Whether the body can be run by run_block(), BATCH_BLOCK indices at a
+	 * time. */
+	bool batch;
+	Prog body;
+};
+
+typedef struct Formula Formula;
+
+struct VarDeps {
+	/* The formula computing the variable, if any. */
+	Formula *formula;
+	Formula **users;
+	size_t users_len;
+	size_t users_cap;
+};
+
+/* Variable computed from others, like y := a*x + b, which is recomputed
+ * whenever one of them changes. */
+struct Formula {
+	const char *name;
+	ExprVar *slot;
+	/* Compiled again whenever a function changes, as it may be inlined. */
+	char *src;
+	Prog prog;
+	/* The variables of the Expr read by prog, including through the user
+	 * functions it calls. */
+	ExprVar **inputs;
+	size_t inputs_len;
+	size_t inputs_cap;
+	/* Length of the longest chain of formulas ending in this one. Formulas
+	 * are recomputed in this order, so each one after its inputs. */
+	size_t depth;
+	bool queued;
+	uint32_t visit;
+};
+
+/* User functions up to this many instructions are inlined into their
+ * callers. */
+#define INLINE_MAX_OPS 32
+
+/* Layout of the files written by expr_file_writer_save(). Programs are stored
+ * as they are evaluated, except that names take the place of pointers; the
+ * bodies of user functions and range reductions are programs of their own,
+ * always in front of the programs running them. Offsets are from the start of
+ * the file and strings are NUL-terminated. Files are only read on machines
+ * like the one writing them, which byte_order and op_size make sure of. */
+#define QCB_MAGIC "qcb"
+#define QCB_VERSION 1
+#define QCB_BYTE_ORDER 0x01020304u
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t op_size;
+	uint64_t size;
+	uint32_t n_exprs, exprs; /* QcbExpr[n_exprs] */
+	uint32_t n_progs, progs; /* QcbProg[n_progs] */
+} QcbHeader;
+
+typedef struct {
+	uint32_t src;
+	uint32_t prog;
+} QcbExpr;
+
+typedef struct {
+	uint32_t n_ops, ops;       /* Op[n_ops] */
+	uint32_t n_vars, vars;     /* QcbVar[n_vars] */
+	uint32_t n_strs, strs;     /* uint32_t[n_strs], the offsets of the strings */
+	uint32_t n_funcs, funcs;   /* QcbFunc[n_funcs] */
+	uint32_t n_ranges, ranges; /* QcbRange[n_ranges] */
+	/* Arguments OpArg may refer to; 0 but for bodies. */
+	uint32_t n_params;
+} QcbProg;
+
+typedef struct {
+	uint32_t name;
+	uint32_t start, end;
+} QcbVar;
+
+typedef struct {
+	uint32_t name;
+	/* The program of a user function, or -1 for the builtin by that name. */
+	int32_t body;
+	uint32_t n_args;
+} QcbFunc;
+
+typedef struct {
+	uint32_t combine; /* Name of the builtin */
+	uint32_t body;
+} QcbRange;
+
+/* The file is built in data, with the QcbExprs and QcbProgs kept apart until
+ * all of them are known. */
+struct _ExprFileWriter {
+	char *data;
+	size_t len, cap;
+	QcbExpr *exprs;
+	size_t exprs_len, exprs_cap;
+	QcbProg *progs;
+	size_t progs_len, progs_cap;
+	/* Bodies of user functions written so far, which many programs may call,
+	 * and their index in progs. */
+	const UserFunc **users;
+	uint32_t *user_progs;
+	size_t users_len, users_cap;
+};
+
+struct _ExprFile {
+	const char *data;
+	size_t size;
+	const QcbHeader *header;
+	const QcbExpr *exprs;
+	const QcbProg *progs;
+	/* The stack depth each program needs, found when checking it. */
+	size_t *stack_caps;
+};
+
+/* Least recently used cache of compiled programs keyed by their source. */
+typedef struct CacheEntry {
+	struct CacheEntry *bucket_next;
+	struct CacheEntry *lru_prev, *lru_next;
+	uint32_t hash;
+	char *src;
+	Prog prog;
+} CacheEntry;
+
+typedef struct {
+	CacheEntry **buckets;
+	size_t n_buckets;
+	CacheEntry *lru_first, *lru_last; /* most and least recently used */
+	size_t len, cap;
+	size_t hits, misses;
+} Cache;
+
+/* Per-thread working memory for evaluating a Prog, which itself is only read
+ * during evaluation. */
+typedef struct {
+	ExprArg *stack;
+	size_t stack_cap;
+	/* Batch evaluation; BATCH_BLOCK values per stack entry. */
+	double *batch_bufs;
+	const double **batch_ptrs;
+	size_t batch_cap;
+} Scratch;
+
+/* Node of the record of an evaluation by expr_eval_grad(), with the partial
+ * derivatives of its value with respect to the nodes it was computed from. */
+typedef struct {
+	uint32_t in[2];
+	double d[2];
+} GradNode;
+
+/* Marks values which don't depend on any input, in place of a node. */
+#define GRAD_CONST UINT32_MAX
+
+/* Working memory of expr_eval_grad() and expr_eval_grad_forward(), whose
+ * stacks are parallel to the Scratch one. */
+typedef struct {
+	bool forward;
+	const Prog *top;
+	size_t n_inputs;
+	ExprArg *stack;
+	size_t stack_cap;
+	/* Reverse mode: the record, in which nodes 0 to n_inputs - 1 are the
+	 * inputs, and the node of each stack entry. */
+	GradNode *tape;
+	size_t tape_len, tape_cap;
+	double *adjoints;
+	uint32_t *nodes;
+	/* Forward mode: the derivatives of each stack entry with respect to
+	 * every input, unless it is known to have none. */
+	double *tangents;
+	size_t tangents_cap;
+	bool *zero;
+} Grad;
+
+typedef struct BatchWorker BatchWorker;
+
+typedef struct {
+	Expr *e;
+	const double **var_columns;
+	double *out;
+	size_t n;
+	BatchWorker *workers;
+	size_t n_workers;
+} BatchJob;
+
+struct BatchWorker {
+	/* Blocks [lo, hi) still to be evaluated by this worker, packed as
+	 * lo | hi << 32 so the owner (taking from the front) and thieves (taking
+	 * from the back) can both update it with a single CAS. */
+	_Alignas(64) _Atomic uint64_t range;
+	BatchJob *job;
+	size_t id;
+	pthread_t thread;
+	Scratch scratch;
+};
+
+struct _Expr {
+	Arena arena;
+	Tok *toks;
+	size_t toks_len;
+	size_t toks_cap;
+
+	char *src;
+	size_t src_cap;
+	/* The program being evaluated; either prog, into which expressions are
+	 * compiled, one from the cache or file_prog. */
+	Prog prog;
+	Prog *cur;
+	bool use_jit;
+	Cache cache;
+	/* Don't fold constants, for programs outliving their values. */
+	bool keep_consts;
+	/* Expression file_expr of file, set by expr_set_from_file(), and the
+	 * bodies of the user functions it calls by their program in file. */
+	Prog file_prog;
+	ExprFile *file;
+	size_t file_expr;
+	UserFunc **file_funcs;
+	/* Kept apart from file, which may be closed before e is destroyed. */
+	size_t file_funcs_len;
+	Scratch scratch;
+	Grad grad;
+	/* Stack of expr_eval_interval(). */
+	ExprInterval *intervals;
+	size_t intervals_cap;
+	/* Start of the instructions computing each stack entry while compiling. */
+	size_t *op_starts;
+	size_t op_starts_cap;
+	/* Operator stack of the parser in compile(). */
+	Frame *frames;
+	size_t frames_len;
+	size_t frames_cap;
+	/* Parameters of the user function whose body is being compiled. */
+	const Tok *params;
+	size_t n_params;
+	/* Argument instructions of a call being inlined. */
+	Op *inline_args;
+	size_t inline_args_cap;
+	size_t *inline_starts;
+	size_t inline_starts_cap;
+	UserFunc *user_funcs;
+	/* Formulas by the order they were defined in, and those about to be
+	 * recomputed; the queue has room for all of them. */
+	Formula **formulas;
+	size_t formulas_len;
+	size_t formulas_cap;
+	Formula **formula_queue;
+	size_t formula_queue_len;
+	uint32_t formula_visit;
+	/* Formulas may be recomputed in the middle of an evaluation, by set(),
+	 * so they are run on a stack of their own. */
+	Scratch formula_scratch;
+
+	SMap vars; /* of Var */
+	VarChunk *var_chunks;
+	/* Slots of removed variables, which new ones reuse. */
+	ExprVar **free_slots;
+	size_t free_slots_len;
+	size_t free_slots_cap;
+	uint32_t prog_stamp;
+	/* Incremented whenever a builtin constant changes. */
+	uint32_t consts_gen;
+	/* Incremented whenever a function is (re-)defined or a variable of the
+	 * environment is shadowed. */
+	uint32_t names_gen;
+
+	/* Functions set on this Expr, which take precedence over the builtins
+	 * in env. */
+	SMap funcs; /* of Func */
+
+	ExprEnv *env;
+
+	void *userdata;
+};
+
+static void *arena_alloc(Arena *a, size_t size);
+static char *arena_strndup(Arena *a, const char *str, size_t n);
+static void arena_reset(Arena *a);
+static void arena_free(Arena *a);
+#ifndef __SSE2__
+static uint64_t smap_load8(const uint8_t *bytes);
+static uint32_t smap_movemask8(uint64_t x);
+#endif
+static uint32_t smap_match(const uint8_t *group, uint8_t b);
+static uint32_t smap_match_free(const uint8_t *group);
+static size_t smap_probe(const SMap *m, const char *key, size_t key_len, uint32_t hash, size_t type_size);
+static size_t smap_idx(const SMap *m, const char *key, size_t key_len, size_t type_size);
+static void *smap_get(const SMap *m, const char *key, size_t key_len, size_t type_size);
+static void *smap_get_for_setting(SMap *m, const char *key, size_t key_len, size_t type_size);
+static void smap_remove(SMap *m, void *entry, size_t type_size);
+static void smap_set_ctrl(SMap *m, size_t i, uint8_t b);
+static size_t smap_cap_for(size_t len);
+static size_t smap_bytes(size_t cap, size_t type_size);
+static void smap_resize(SMap *m, size_t cap, size_t type_size);
+static void smap_copy(SMap *dst, const SMap *src, size_t type_size);
+static void smap_free(SMap *m, size_t type_size);
+static ExprVar *alloc_slot(VarChunk **chunks);
+static ExprVar *new_slot(Expr *e);
+static bool name_in_use(Expr *e, const char *name);
+static bool prog_uses_name(const Prog *p, const char *name);
+static Var *get_var(Expr *e, const char *name, size_t name_len);
+static Var *get_var_for_setting(Expr *e, const char *name, size_t name_len);
+static void rebind_shadowed(Expr *e, const ExprVar *shared, ExprVar *slot);
+static bool prog_rebind_slot(Prog *p, const ExprVar *from, ExprVar *to, bool shared);
+static void rebind_unshadowed(Expr *e, Var *v, ExprVar *shared);
+static ExprVar *env_get_var(ExprEnv *env, const char *name, size_t name_len);
+static ExprVar *env_add_var(ExprEnv *env, const char *name);
+static void env_store(ExprEnv *env, ExprVar *v, double val);
+static void default_env_init();
+static uint32_t current_consts_gen(Expr *e);
+static UserFunc *clone_user_func(Expr *res, Expr *e, UserFunc *u);
+static void prog_rebind(Expr *res, Expr *e, Prog *p);
+static ExprError compile_body(Expr *e, const char *src, const Tok *params, size_t n_params, bool own_vars, Prog *res) __attribute__((warn_unused_result));
+static bool prog_impure(const Prog *p);
+static VarDeps *var_deps(ExprVar *v);
+static void formulas_add(Expr *e, Formula *f);
+static void formula_add_inputs(Formula *f, const Prog *p);
+static bool formula_reads(Formula *f, const ExprVar *v, uint32_t visit);
+static size_t formula_depth(Formula *f);
+static void formula_link(Formula *f);
+static void formula_unlink(Formula *f);
+static void formula_free(Formula *f);
+static void formula_remove(Expr *e, Formula *f);
+static void formulas_queue_users(Expr *e, ExprVar *v);
+static void formulas_run_queue(Expr *e);
+static void formulas_recompile(Expr *e);
+static bool prog_same(const Prog *a, const Prog *b);
+static void push_op(Expr *e, Op op);
+static void drop_operand(Expr *e, size_t k);
+static bool operand_is(Expr *e, size_t k, double val);
+static void emit(Expr *e, Op op);
+static size_t op_n_in(const Prog *p, Op op);
+static uint32_t prog_add_var(Expr *e, Var *v, Tok *t);
+static uint32_t prog_add_str(Expr *e, char *str);
+static uint32_t prog_add_func(Expr *e, Func f);
+static uint32_t prog_add_range(Expr *e, Range *r);
+static void push_frame(Expr *e, Frame f);
+static void compile_var(Expr *e, const char *name, size_t name_len, Tok *t);
+static void compile_global_var(Expr *e, const char *name, size_t name_len, Tok *t);
+static void compile_call(Expr *e, Func f, Tok *t);
+static void compile_combine(Expr *e, Func f, Tok *t);
+static size_t find_range_end(Expr *e, size_t i);
+static ExprError compile_range(Expr *e, size_t *i, bool *want_operand) __attribute__((warn_unused_result));
+static bool can_inline(Expr *e, const UserFunc *u);
+static ExprError compile_arg(Expr *e, size_t *i, bool *want_operand) __attribute__((warn_unused_result));
+static OpKind binary_op(char op);
+static ExprError compile_toks(Expr *e, size_t *i) __attribute__((warn_unused_result));
+static ExprError compile(Expr *e) __attribute__((warn_unused_result));
+static void scratch_reserve(Scratch *sc, const Prog *p, bool batch);
+static void scratch_free(Scratch *sc);
+static ExprError run(Expr *e, const Prog *p, Scratch *sc, double *out_res) __attribute__((warn_unused_result));
+static ExprError run_stack(Expr *e, const Prog *p, ExprArg *s, const ExprArg *args) __attribute__((warn_unused_result));
+static ExprError run_range(Expr *e, const Range *r, ExprArg *s, const ExprArg *args, double from, size_t n, double *out) __attribute__((warn_unused_result));
+static void jit_compile(Prog *p);
+static void jit_free(Prog *p);
+static ExprError eval(Expr *e, double *out_res) __attribute__((warn_unused_result));
+static ExprError eval_grad(Expr *e, double *out_res, double *grad, bool forward) __attribute__((warn_unused_result));
+static bool funcs_support(const Prog *p, bool interval);
+static int prog_input(const Prog *top, const Prog *p, uint32_t var);
+static void grad_reserve(Grad *g, const Prog *p);
+static void grad_free(Grad *g);
+static void grad_const(Grad *g, size_t slot);
+static void grad_copy(Grad *g, size_t dst, size_t src);
+static uint32_t grad_node(Grad *g, uint32_t a, uint32_t b, const double *d);
+static void grad_tangent(Grad *g, double *dst, bool *dst_zero, const double *a, bool a_zero, const double *b, bool b_zero, const double *d);
+static void grad_record(Grad *g, size_t slot, size_t n_in, const double *d);
+static ExprError run_grad(Expr *e, Grad *g, const Prog *p, size_t base, size_t args) __attribute__((warn_unused_result));
+static ExprError run_grad_range(Expr *e, Grad *g, const Range *r, size_t base, size_t args, double from, size_t n) __attribute__((warn_unused_result));
+static ExprError eval_interval(Expr *e, const ExprInterval *var_ranges, ExprInterval *out) __attribute__((warn_unused_result));
+static ExprError run_interval(Expr *e, const Prog *top, const ExprInterval *var_ranges, const Prog *p, ExprInterval *s, const ExprInterval *args) __attribute__((warn_unused_result));
+static ExprError run_interval_range(Expr *e, const Prog *top, const ExprInterval *var_ranges, const Range *r, ExprInterval *s, const ExprInterval *args, double from, size_t n) __attribute__((warn_unused_result));
+static ExprError eval_batch(Expr *e, size_t n, const double **var_columns, double *out) __attribute__((warn_unused_result));
+static ExprError eval_batch_parallel(Expr *e, size_t n, const double **var_columns, double *out, size_t n_threads) __attribute__((warn_unused_result));
+static ExprError sweep(Expr *e, const ExprSweepAxis *axes, size_t n_axes, void (*out)(void *userdata, const double **coords, const double *res, size_t n), void *userdata) __attribute__((warn_unused_result));
+static void sweep_fill(const ExprSweepAxis *axes, size_t n_axes, size_t *idx, double *coords, size_t n);
+static ExprError run_rows(Expr *e, size_t n, const double **var_columns, double *out) __attribute__((warn_unused_result));
+static bool batch_feeds_formulas(const Prog *p, const double **var_columns);
+static void run_block(Expr *e, const Prog *p, Scratch *sc, size_t row, size_t n, const double **var_columns, const double *index, double *out);
+#ifdef EXPR_STATS
+static void stats_count_calls(const Prog *p, size_t n);
+#endif
+static bool batch_parallel_ok(const Prog *p);
+static ExprError batch_check_vars(const Prog *p, const double **var_columns) __attribute__((warn_unused_result));
+static void *batch_worker(void *arg);
+static Func *set_func(Expr *e, const char *name, double (*func)(Expr *e, ExprArg *args), void (*vfunc)(double *res, const double **args, size_t n), ExprArgType *arg_types, size_t n_args, bool impure);
+static ExprError prog_refresh(Expr *e) __attribute__((warn_unused_result));
+static ExprError prog_unfold(Expr *e, const double **var_columns, bool all) __attribute__((warn_unused_result));
+static bool prog_outdated(Expr *e, const Prog *p);
+static void *memdup(const void *src, size_t size);
+static void prog_copy(Prog *dst, const Prog *src);
+static void prog_free(Prog *p);
+static void prog_free_ranges(Prog *p);
+static uint32_t qcb_add(ExprFileWriter *w, const void *data, size_t size, size_t align);
+static uint32_t qcb_add_str(ExprFileWriter *w, const char *s);
+static bool qcb_write_prog(ExprFileWriter *w, const Prog *p, uint32_t n_params, uint32_t *out_idx);
+static const void *file_at(const ExprFile *f, uint32_t off, uint32_t n, size_t size, size_t align);
+static const char *file_str(const ExprFile *f, uint32_t off);
+static bool file_check(ExprFile *f);
+static bool file_check_prog(ExprFile *f, uint32_t k);
+static void file_load_prog(Expr *e, uint32_t k, Prog *p);
+static UserFunc *file_user_func(Expr *e, uint32_t k);
+static void file_funcs_free(Expr *e);
+static void set_src(Expr *e, const char *src, size_t len);
+static void range_init(Range *r, Func f);
+static CacheEntry *cache_get(Cache *c, const char *src, uint32_t hash);
+static void cache_put(Cache *c, const char *src, uint32_t hash, const Prog *p);
+static void cache_remove(Cache *c, CacheEntry *ent);
+static uint32_t fnv1a32(const void *data, size_t n);
+static uint32_t builtin_hash(const char *s, size_t n, uint32_t seed);
+static int builtin_func_idx(const char *name, size_t name_len);
+static int builtin_var_idx(const char *name, size_t name_len);
+static Func get_func(Expr *e, const char *name, size_t name_len);
+static Func builtin_func(int i);
+static void push_tok(Expr *e, Tok t);
+static size_t parse_num(Expr *e, const char *s, size_t n, double *out);
+static ExprError tokenize(Expr *e, const char *expr, size_t len) __attribute__((warn_unused_result));
+
+const static uint8_t op_prec[256] = {
+	['('] = 0, /* A precedence of 0 is reserved for delimiters. */
+	[')'] = 0,
+	[','] = 0,
+	['+'] = 1,
+	['-'] = 1,
+	['*'] = 2,
+	['/'] = 2,
+	['^'] = 3,
+};
+#define OP_PREC(tok_char) (op_prec[(size_t)tok_char])
+
+const static enum {
+	OrderLtr,
+	OrderRtl,
+} op_order[256] = {
+	['('] = OrderLtr,
+	[')'] = OrderLtr,
+	['+'] = OrderLtr,
+	['-'] = OrderLtr,
+	['*'] = OrderLtr,
+	['/'] = OrderLtr,
+	['^'] = OrderRtl,
+};
+#define OP_ORDER(tok_char) (op_order[(size_t)tok_char])
+
+/* Slots whose control bytes SMap compares at once; that of an SSE2 register. */
+#define SMAP_GROUP 16
+#define SMAP_EMPTY 0x80
+#define SMAP_DELETED 0xfe
+
+/* Number of rows evaluated at a time by expr_eval_batch(). */
+#define BATCH_BLOCK 256
+/* Points of the grid made up and evaluated at a time by expr_sweep(). */
+#define SWEEP_CHUNK (16 * BATCH_BLOCK)
+
+#define IS_NUM(c) (c >= '0' && c <= '9')
+#define IS_ALPHA(c) ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+#define IS_SYMBOL(c) ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+
+/* Environment of Exprs created by expr_new(); lives as long as the process. */
+static ExprEnv *default_env;
+static pthread_once_t default_env_once = PTHREAD_ONCE_INIT;
+
+ExprEnv *expr_env_new() {
+	ExprEnv *env = malloc(sizeof(ExprEnv));
+	*env = (ExprEnv){0};
+	atomic_init(&env->refs, 1);
+	pthread_mutex_init(&env->lock, NULL);
+	EnvTable *t = calloc(1, sizeof(EnvTable) + sizeof(EnvVar) * 64);
+	t->cap = 64;
+	atomic_init(&env->vars, t);
+	for (size_t i = 0; i < expr_n_builtin_vars; i++)
+		env->builtin_vars[i] = (ExprVar){.val = expr_builtin_vars[i].val, .set = true, .constant = true};
+	return env;
+}
+
+ExprEnv *expr_env_ref(ExprEnv *env) {
+	atomic_fetch_add(&env->refs, 1);
+	return env;
+}
+
+void expr_env_unref(ExprEnv *env) {
+	if (atomic_fetch_sub(&env->refs, 1) != 1)
+		return;
+	EnvTable *t = atomic_load(&env->vars);
+	for (size_t i = 0; i < t->cap; i++)
+		free(atomic_load(&t->vars[i].name));
+	while (t != NULL) {
+		EnvTable *prev = t->prev;
+		free(t);
+		t = prev;
+	}
+	while (env->var_chunks != NULL) {
+		VarChunk *next = env->var_chunks->next;
+		free(env->var_chunks);
+		env->var_chunks = next;
+	}
+	pthread_mutex_destroy(&env->lock);
+	free(env);
+}
+
+void expr_env_set_var(ExprEnv *env, const char *name, double val) {
+	size_t name_len = strlen(name);
+	ExprVar *v = env_get_var(env, name, name_len);
+	if (v == NULL) {
+		pthread_mutex_lock(&env->lock);
+		/* It may have been added while we were waiting. */
+		v = env_get_var(env, name, name_len);
+		if (v == NULL)
+			v = env_add_var(env, name);
+		pthread_mutex_unlock(&env->lock);
+	}
+	env_store(env, v, val);
+}
+
+bool expr_env_get_var(ExprEnv *env, const char *name, double *out) {
+	ExprVar *v = env_get_var(env, name, strlen(name));
+	if (v == NULL || !v->set) {
+		*out = NAN;
+		return false;
+	}
+	*out = v->val;
+	return true;
+}
+
+Expr *expr_new() {
+	pthread_once(&default_env_once, default_env_init);
+	return expr_new_with_env(default_env);
+}
+
+Expr *expr_new_with_env(ExprEnv *env) {
+	Expr *res = malloc(sizeof(Expr));
+	*res = (Expr){0};
+	res->cur = &res->prog;
+	res->env = expr_env_ref(env);
+	return res;
+}
+
+ExprEnv *expr_get_env(Expr *e) {
+	return e->env;
+}
+
+Expr *expr_clone(Expr *e) {
+	Expr *res = expr_new_with_env(e->env);
+	res->use_jit = e->use_jit;
+	res->userdata = e->userdata;
+	res->prog_stamp = e->prog_stamp;
+	res->consts_gen = e->consts_gen;
+	res->names_gen = e->names_gen;
+	if (e->src != NULL) {
+		res->src_cap = strlen(e->src) + 1;
+		res->src = memdup(e->src, res->src_cap);
+	}
+
+	/* The tables are copied as they are, so every name keeps its index and
+	 * copied programs can find their variables and functions by looking the
+	 * names up in e. Variables of the environment stay shared. */
+	smap_copy(&res->vars, &e->vars, sizeof(Var));
+	for (size_t i = 0; i < res->vars.cap; i++) {
+		Var *v = &((Var*)res->vars.entries)[i];
+		if (v->name == NULL)
+			continue;
+		v->name = strdup(v->name);
+		if (!v->shared) {
+			ExprVar *slot = alloc_slot(&res->var_chunks);
+			*slot = (ExprVar){.val = v->slot->val, .set = v->slot->set, .constant = v->slot->constant};
+			v->slot = slot;
+		}
+	}
+
+	/* Keep the order of the user functions, by which clone_user_func() maps
+	 * them. */
+	UserFunc **tail = &res->user_funcs;
+	for (UserFunc *u = e->user_funcs; u != NULL; u = u->next) {
+		UserFunc *copy = malloc(sizeof(UserFunc));
+		copy->next = NULL;
+		copy->n_params = u->n_params;
+		copy->arg_types = memdup(u->arg_types, sizeof(ExprArgType) * u->n_params);
+		prog_copy(&copy->body, &u->body);
+		*tail = copy;
+		tail = &copy->next;
+	}
+
+	smap_copy(&res->funcs, &e->funcs, sizeof(Func));
+	for (size_t i = 0; i < res->funcs.cap; i++) {
+		Func *f = &((Func*)res->funcs.entries)[i];
+		if (f->name == NULL)
+			continue;
+		f->name = strdup(f->name);
+		if (f->user != NULL) {
+			f->user = clone_user_func(res, e, f->user);
+			f->arg_types = f->user->arg_types;
+		}
+	}
+
+	for (UserFunc *u = res->user_funcs; u != NULL; u = u->next)
+		prog_rebind(res, e, &u->body);
+	for (size_t i = 0; i < e->formulas_len; i++) {
+		Formula *f = e->formulas[i];
+		Formula *copy = calloc(1, sizeof(Formula));
+		Var *v = &((Var*)res->vars.entries)[smap_idx(&e->vars, f->name, strlen(f->name), sizeof(Var))];
+		copy->name = v->name;
+		copy->slot = v->slot;
+		copy->depth = f->depth;
+		copy->src = strdup(f->src);
+		prog_copy(&copy->prog, &f->prog);
+		prog_rebind(res, e, &copy->prog);
+		formula_add_inputs(copy, &copy->prog);
+		var_deps(copy->slot)->formula = copy;
+		formula_link(copy);
+		formulas_add(res, copy);
+	}
+	/* The cache isn't copied, only the current program. One from a file is
+	 * loaded from it again instead. */
+	if (e->cur == &e->file_prog) {
+		ExprError err = expr_set_from_file(res, e->file, e->file_expr);
+		(void)err;
+	} else {
+		prog_copy(&res->prog, e->cur);
+		prog_rebind(res, e, &res->prog);
+	}
+	if (e->cache.cap > 0)
+		expr_set_cache_size(res, e->cache.cap);
+	scratch_reserve(&res->scratch, res->cur, false);
+	return res;
+}
+
+void expr_destroy(Expr *e) {
+	arena_free(&e->arena);
+	free(e->toks);
+	prog_free(&e->prog);
+	prog_free(&e->file_prog);
+	file_funcs_free(e);
+	while (e->cache.lru_first != NULL)
+		cache_remove(&e->cache, e->cache.lru_first);
+	free(e->cache.buckets);
+	scratch_free(&e->scratch);
+	grad_free(&e->grad);
+	free(e->intervals);
+	free(e->op_starts);
+	free(e->frames);
+	free(e->inline_args);
+	free(e->inline_starts);
+	while (e->user_funcs != NULL) {
+		UserFunc *next = e->user_funcs->next;
+		prog_free(&e->user_funcs->body);
+		free(e->user_funcs->arg_types);
+		free(e->user_funcs);
+		e->user_funcs = next;
+	}
+	for (size_t i = 0; i < e->formulas_len; i++)
+		formula_free(e->formulas[i]);
+	free(e->formulas);
+	free(e->formula_queue);
+	scratch_free(&e->formula_scratch);
+	free(e->src);
+	smap_free(&e->vars, sizeof(Var));
+	free(e->free_slots);
+	while (e->var_chunks != NULL) {
+		VarChunk *next = e->var_chunks->next;
+		for (size_t i = 0; i < e->var_chunks->len; i++) {
+			VarDeps *d = e->var_chunks->slots[i].deps;
+			if (d != NULL)
+				free(d->users);
+			free(d);
+		}
+		free(e->var_chunks);
+		e->var_chunks = next;
+	}
+	smap_free(&e->funcs, sizeof(Func));
+	expr_env_unref(e->env);
+	free(e);
+}
+
+ExprError expr_set(Expr *e, const char *expr) {
+	return expr_set_n(e, expr, strlen(expr));
+}
+
+ExprError expr_set_n(Expr *e, const char *expr, size_t len) {
+	/* Buffers are kept and reused, so setting an expression doesn't allocate
+	 * once they are big enough. */
+	arena_reset(&e->arena);
+	e->toks_len = 0;
+
+	if (expr != e->src)
+		set_src(e, expr, len);
+
+	uint32_t hash = 0;
+	if (e->cache.cap > 0 && !e->keep_consts) {
+		hash = fnv1a32(e->src, len);
+		CacheEntry *ent = cache_get(&e->cache, e->src, hash);
+		if (ent != NULL && !prog_outdated(e, &ent->prog)) {
+			e->cache.hits++;
+			e->cur = &ent->prog;
+			scratch_reserve(&e->scratch, e->cur, false);
+			return (ExprError){0};
+		}
+		if (ent != NULL)
+			cache_remove(&e->cache, ent);
+		e->cache.misses++;
+	}
+
+	/* Leave an empty program behind if anything goes wrong. */
+	e->cur = &e->prog;
+	e->prog.ops_len = 0;
+
+	STAT(uint64_t t = stats_now());
+	ExprError err = tokenize(e, expr, len);
+	STAT(stats.tokenize_ns += stats_now() - t);
+	if (err.err != NULL)
+		return err;
+	STAT(t = stats_now());
+	err = compile(e);
+	STAT(stats.compile_ns += stats_now() - t);
+	if (err.err != NULL)
+		e->prog.ops_len = 0;
+	else if (e->cache.cap > 0 && !e->keep_consts)
+		cache_put(&e->cache, e->src, hash, &e->prog);
+	return err;
+}
+
+void expr_set_cache_size(Expr *e, size_t n) {
+	Cache *c = &e->cache;
+	bool cur_cached = e->cur != &e->prog && e->cur != &e->file_prog;
+	while (c->len > n)
+		cache_remove(c, c->lru_last);
+	if (n == 0 && cur_cached) {
+		/* The current program was just freed; compile it again. */
+		e->cur = &e->prog;
+		ExprError err = expr_set(e, e->src);
+		(void)err;
+	}
+
+	size_t n_buckets = 16;
+	while (n_buckets < 2 * n)
+		n_buckets *= 2;
+	if (n_buckets != c->n_buckets) {
+		CacheEntry **buckets = calloc(n_buckets, sizeof(CacheEntry*));
+		for (CacheEntry *ent = c->lru_first; ent != NULL; ent = ent->lru_next) {
+			size_t i = ent->hash & (n_buckets - 1);
+			ent->bucket_next = buckets[i];
+			buckets[i] = ent;
+		}
+		free(c->buckets);
+		c->buckets = buckets;
+		c->n_buckets = n_buckets;
+	}
+	c->cap = n;
+}
+
+void expr_get_cache_stats(Expr *e, size_t *hits, size_t *misses) {
+	*hits = e->cache.hits;
+	*misses = e->cache.misses;
+}
+
+ExprError expr_eval(Expr *e, double *out_res) {
+	STAT(uint64_t t = stats_now());
+	ExprError err = eval(e, out_res);
+	STAT(stats.eval_ns += stats_now() - t; stats.evals++);
+	return err;
+}
+
+static ExprError eval(Expr *e, double *out_res) {
+	TRY(prog_refresh(e));
+	Prog *p = e->cur;
+	if (e->use_jit && p->jit == NULL && !p->runs_bodies) {
+		jit_compile(p);
+		if (p->jit == NULL)
+			e->use_jit = false;
+	}
+	if (p->jit != NULL) {
+		uint32_t unset = p->jit(e, e->scratch.stack);
+		if (unset != 0)
+			return (ExprError){.start = p->vars[unset - 1].start, .end = p->vars[unset - 1].end, .err = "unknown variable"};
+		*out_res = e->scratch.stack[0].Num;
+		return (ExprError){0};
+	}
+	TRY(run(e, p, &e->scratch, out_res));
+	return (ExprError){0};
+}
+
+ExprError expr_eval_grad(Expr *e, double *out_res, double *grad) {
+	STAT(uint64_t t = stats_now());
+	ExprError err = eval_grad(e, out_res, grad, false);
+	STAT(stats.eval_ns += stats_now() - t; stats.evals++);
+	return err;
+}
+
+ExprError expr_eval_grad_forward(Expr *e, double *out_res, double *grad) {
+	STAT(uint64_t t = stats_now());
+	ExprError err = eval_grad(e, out_res, grad, true);
+	STAT(stats.eval_ns += stats_now() - t; stats.evals++);
+	return err;
+}
+
+static ExprError eval_grad(Expr *e, double *out_res, double *grad, bool forward) {
+	TRY(prog_refresh(e));
+	TRY(prog_unfold(e, NULL, true));
+	const Prog *p = e->cur;
+	if (!funcs_support(p, false))
+		return (ExprError){.err = "function without derivative"};
+	Grad *g = &e->grad;
+	g->forward = forward;
+	g->top = p;
+	g->n_inputs = p->vars_len;
+	scratch_reserve(&e->scratch, p, false);
+	g->stack = e->scratch.stack;
+	grad_reserve(g, p);
+
+	size_t n = g->n_inputs;
+	/* The inputs, which aren't computed from anything. */
+	for (size_t k = 0; k < n && !forward; k++)
+		g->tape[k] = (GradNode){.in = {GRAD_CONST, GRAD_CONST}};
+	g->tape_len = n;
+	TRY(run_grad(e, g, p, 0, 0));
+	*out_res = g->stack[0].Num;
+
+	if (forward) {
+		for (size_t k = 0; k < n; k++)
+			grad[k] = g->zero[0] ? 0.0 : g->tangents[k];
+		return (ExprError){0};
+	}
+	/* Walk the record backwards, accumulating the derivative of the result
+	 * with respect to each node in its adjoint. */
+	double *adj = g->adjoints;
+	memset(adj, 0, sizeof(double) * g->tape_len);
+	if (g->nodes[0] != GRAD_CONST)
+		adj[g->nodes[0]] = 1.0;
+	for (size_t k = g->tape_len; k-- > n;) {
+		const GradNode *node = &g->tape[k];
+		if (adj[k] == 0.0)
+			continue;
+		for (size_t j = 0; j < 2; j++) {
+			if (node->in[j] != GRAD_CONST)
+				adj[node->in[j]] += adj[k] * node->d[j];
+		}
+	}
+	memcpy(grad, adj, sizeof(double) * n);
+	return (ExprError){0};
+}
+
+ExprError expr_eval_interval(Expr *e, const ExprInterval *var_ranges, ExprInterval *out) {
+	STAT(uint64_t t = stats_now());
+	ExprError err = eval_interval(e, var_ranges, out);
+	STAT(stats.eval_ns += stats_now() - t; stats.evals++);
+	return err;
+}
+
+static ExprError eval_interval(Expr *e, const ExprInterval *var_ranges, ExprInterval *out) {
+	TRY(prog_refresh(e));
+	TRY(prog_unfold(e, NULL, var_ranges != NULL));
+	const Prog *p = e->cur;
+	if (!funcs_support(p, true))
+		return (ExprError){.err = "function without interval version"};
+	if (p->stack_cap > e->intervals_cap) {
+		e->intervals = realloc(e->intervals, sizeof(ExprInterval) * p->stack_cap);
+		e->intervals_cap = p->stack_cap;
+	}
+	TRY(run_interval(e, p, var_ranges, p, e->intervals, NULL));
+	*out = e->intervals[0];
+	return (ExprError){0};
+}
+
+bool expr_jit(Expr *e) {
+#ifdef JIT_X86_64
+	e->use_jit = true;
+	return true;
+#else
+	(void)e;
+	return false;
+#endif
+}
+
+ExprError expr_eval_batch(Expr *e, size_t n, const double **var_columns, double *out) {
+	STAT(uint64_t t = stats_now());
+	ExprError err = eval_batch(e, n, var_columns, out);
+	STAT(stats.eval_ns += stats_now() - t; stats.evals += n);
+	return err;
+}
+
+static ExprError eval_batch(Expr *e, size_t n, const double **var_columns, double *out) {
+	TRY(prog_refresh(e));
+	TRY(prog_unfold(e, var_columns, false));
+	const Prog *p = e->cur;
+
+	/* String arguments only make sense for functions with side effects (like
+	 * set), which must see the rows one after the other. Bodies of user
+	 * functions which weren't inlined and of range reductions are run row by
+	 * row as well, and so are formulas reading the columns. */
+	if (p->strs_len > 0 || p->runs_bodies || batch_feeds_formulas(p, var_columns))
+		return run_rows(e, n, var_columns, out);
+
+	TRY(batch_check_vars(p, var_columns));
+
+	scratch_reserve(&e->scratch, p, true);
+	for (size_t row = 0; row < n; row += BATCH_BLOCK)
+		run_block(e, p, &e->scratch, row, n - row < BATCH_BLOCK ? n - row : BATCH_BLOCK, var_columns, NULL, out + row);
+	STAT(stats_count_calls(p, n));
+	return (ExprError){0};
+}
+
+ExprError expr_eval_batch_parallel(Expr *e, size_t n, const double **var_columns, double *out, size_t n_threads) {
+	STAT(uint64_t t = stats_now());
+	ExprError err = eval_batch_parallel(e, n, var_columns, out, n_threads);
+	STAT(stats.eval_ns += stats_now() - t; stats.evals += n);
+	return err;
+}
+
+static ExprError eval_batch_parallel(Expr *e, size_t n, const double **var_columns, double *out, size_t n_threads) {
+	if (n_threads == 0) {
+		long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n_threads = n_cpus > 0 ? n_cpus : 1;
+	}
+	size_t n_blocks = (n + BATCH_BLOCK - 1) / BATCH_BLOCK;
+	if (n_threads > n_blocks)
+		n_threads = n_blocks;
+	TRY(prog_refresh(e));
+	TRY(prog_unfold(e, var_columns, false));
+	const Prog *p = e->cur;
+	if (n_threads <= 1 || !batch_parallel_ok(p) || batch_feeds_formulas(p, var_columns))
+		return eval_batch(e, n, var_columns, out);
+
+	TRY(batch_check_vars(p, var_columns));
+
+	BatchJob job = {
+		.e = e,
+		.var_columns = var_columns,
+		.out = out,
+		.n = n,
+		.workers = aligned_alloc(_Alignof(BatchWorker), sizeof(BatchWorker) * n_threads),
+		.n_workers = n_threads,
+	};
+	for (size_t i = 0; i < n_threads; i++) {
+		BatchWorker *w = &job.workers[i];
+		uint64_t lo = n_blocks * i / n_threads, hi = n_blocks * (i + 1) / n_threads;
+		atomic_init(&w->range, lo | hi << 32);
+		w->job = &job;
+		w->id = i;
+		w->scratch = (Scratch){0};
+	}
+	/* The calling thread works as worker 0. */
+	size_t n_started = 1;
+	for (; n_started < n_threads; n_started++) {
+		if (pthread_create(&job.workers[n_started].thread, NULL, batch_worker, &job.workers[n_started]) != 0)
+			break; /* The others will steal its blocks. */
+	}
+	batch_worker(&job.workers[0]);
+	for (size_t i = 1; i < n_started; i++)
+		pthread_join(job.workers[i].thread, NULL);
+	/* Workers that failed to start may still own blocks. */
+	for (size_t i = n_started; i < n_threads; i++)
+		batch_worker(&job.workers[i]);
+
+	for (size_t i = 0; i < n_threads; i++)
+		scratch_free(&job.workers[i].scratch);
+	free(job.workers);
+	/* Counted here, as the workers' counters are their own. */
+	STAT(stats_count_calls(p, n));
+	return (ExprError){0};
+}
+
+ExprError expr_sweep(Expr *e, const ExprSweepAxis *axes, size_t n_axes, void (*out)(void *userdata, const double **coords, const double *res, size_t n), void *userdata) {
+	STAT(uint64_t t = stats_now());
+	ExprError err = sweep(e, axes, n_axes, out, userdata);
+	STAT(stats.eval_ns += stats_now() - t);
+	return err;
+}
+
+static ExprError sweep(Expr *e, const ExprSweepAxis *axes, size_t n_axes, void (*out)(void *userdata, const double **coords, const double *res, size_t n), void *userdata) {
+	size_t total = 1;
+	for (size_t k = 0; k < n_axes; k++) {
+		for (size_t j = 0; j < k; j++) {
+			if (strcmp(axes[j].name, axes[k].name) == 0)
+				return (ExprError){.err = "variable on more than one axis"};
+		}
+		if (axes[k].n != 0 && total > SIZE_MAX / axes[k].n)
+			return (ExprError){.err = "grid too large"};
+		total *= axes[k].n;
+	}
+	if (n_axes == 0)
+		return (ExprError){0};
+	TRY(prog_refresh(e));
+	/* Folded constants are inputs as well; eval_batch() unfolds them. */
+	for (size_t k = 0; k < n_axes; k++) {
+		size_t i = 0;
+		while (i < e->cur->vars_len && strcmp(e->cur->vars[i].name, axes[k].name) != 0)
+			i++;
+		if (i == e->cur->vars_len)
+			return (ExprError){.err = "axis variable not read by the expression"};
+	}
+	if (total == 0)
+		return (ExprError){0};
+
+	/* The inputs on an axis read its column of coords; the last column
+	 * takes the results. */
+	size_t n_inputs = e->cur->vars_len;
+	double *coords = malloc(sizeof(double) * SWEEP_CHUNK * (n_axes + 1));
+	const double **cols = calloc(n_inputs + n_axes, sizeof(double*));
+	const double **axis_cols = cols + n_inputs;
+	size_t *idx = calloc(n_axes, sizeof(size_t));
+	double *res = coords + SWEEP_CHUNK * n_axes;
+	for (size_t k = 0; k < n_axes; k++) {
+		axis_cols[k] = coords + SWEEP_CHUNK * k;
+		for (size_t i = 0; i < n_inputs; i++) {
+			if (strcmp(e->cur->vars[i].name, axes[k].name) == 0)
+				cols[i] = axis_cols[k];
+		}
+	}
+
+	ExprError err = {0};
+	for (size_t row = 0; row < total && err.err == NULL; row += SWEEP_CHUNK) {
+		size_t n = total - row < SWEEP_CHUNK ? total - row : SWEEP_CHUNK;
+		sweep_fill(axes, n_axes, idx, coords, n);
+		err = eval_batch(e, n, cols, res);
+		STAT(stats.evals += n);
+		if (err.err == NULL)
+			out(userdata, axis_cols, res, n);
+	}
+	free(coords);
+	free(cols);
+	free(idx);
+	return err;
+}
+
+/* Writes the coordinates of the next n points, starting at the indices idx
+ * along each axis, to the axes' columns in coords and advances idx. */
+static void sweep_fill(const ExprSweepAxis *axes, size_t n_axes, size_t *idx, double *coords, size_t n) {
+	const ExprSweepAxis *last = &axes[n_axes - 1];
+	for (size_t i = 0; i < n;) {
+		/* A run along the last axis, with the others fixed. */
+		size_t run = last->n - idx[n_axes - 1];
+		if (run > n - i)
+			run = n - i;
+		double *c = coords + SWEEP_CHUNK * (n_axes - 1) + i;
+		for (size_t j = 0; j < run; j++)
+			c[j] = last->from + (double)(idx[n_axes - 1] + j) * last->step;
+		for (size_t k = 0; k + 1 < n_axes; k++) {
+			const double v = axes[k].from + (double)idx[k] * axes[k].step;
+			c = coords + SWEEP_CHUNK * k + i;
+			for (size_t j = 0; j < run; j++)
+				c[j] = v;
+		}
+		i += run;
+		idx[n_axes - 1] += run;
+		for (size_t k = n_axes - 1; k > 0 && idx[k] == axes[k].n; k--) {
+			idx[k] = 0;
+			idx[k - 1]++;
+		}
+	}
+}
+
+bool expr_get_stats(ExprStats *out) {
+#ifdef EXPR_STATS
+	*out = (ExprStats){
+		.toks = stats.toks,
+		.ops = stats.ops,
+		.folds = stats.folds,
+		.moved = stats.moved,
+		.probes = stats.probes,
+		.resizes = stats.resizes,
+		.allocs = stats.allocs,
+		.evals = stats.evals,
+		.tokenize_ns = stats.tokenize_ns,
+		.compile_ns = stats.compile_ns,
+		.eval_ns = stats.eval_ns,
+		.builtin_calls = stats.builtin_calls + 1,
+	};
+	return true;
+#else
+	*out = (ExprStats){0};
+	return false;
+#endif
+}
+
+void expr_add_stats(const ExprStats *s) {
+#ifdef EXPR_STATS
+	stats.toks += s->toks;
+	stats.ops += s->ops;
+	stats.folds += s->folds;
+	stats.moved += s->moved;
+	stats.probes += s->probes;
+	stats.resizes += s->resizes;
+	stats.allocs += s->allocs;
+	stats.evals += s->evals;
+	stats.tokenize_ns += s->tokenize_ns;
+	stats.compile_ns += s->compile_ns;
+	stats.eval_ns += s->eval_ns;
+	for (size_t i = 0; i < expr_n_builtin_funcs; i++)
+		stats.builtin_calls[i + 1] += s->builtin_calls[i];
+#else
+	(void)s;
+#endif
+}
+
+void expr_reset_stats() {
+	STAT(stats = (Stats){0});
+}
+
+size_t expr_n_inputs(Expr *e) {
+	return e->cur->vars_len;
+}
+
+const char *expr_input_name(Expr *e, size_t i) {
+	return e->cur->vars[i].name;
+}
+
+bool expr_has_side_effects(Expr *e) {
+	return prog_impure(e->cur);
+}
+
+static void *arena_alloc(Arena *a, size_t size) {
+	size = (size + 7) & ~(size_t)7;
+	if (a->chunks == NULL || a->chunks->len + size > a->chunks->cap) {
+		size_t cap = a->total_cap > size ? a->total_cap : size;
+		if (cap < 1024)
+			cap = 1024;
+		ArenaChunk *c = malloc(sizeof(ArenaChunk) + cap);
+		c->next = a->chunks;
+		c->len = 0;
+		c->cap = cap;
+		a->chunks = c;
+		a->total_cap += cap;
+	}
+	void *res = a->chunks->data + a->chunks->len;
+	a->chunks->len += size;
+	return res;
+}
+
+static char *arena_strndup(Arena *a, const char *str, size_t n) {
+	char *res = arena_alloc(a, n + 1);
+	memcpy(res, str, n);
+	res[n] = 0;
+	return res;
+}
+
+static void arena_reset(Arena *a) {
+	if (a->chunks == NULL)
+		return;
+	if (a->chunks->next != NULL) {
+		/* Replace the chunks by a single one big enough for all of them, so
+		 * the next expression of this size fits without allocating. */
+		size_t cap = a->total_cap;
+		arena_free(a);
+		a->chunks = malloc(sizeof(ArenaChunk) + cap);
+		a->chunks->next = NULL;
+		a->chunks->cap = cap;
+		a->total_cap = cap;
+	}
+	a->chunks->len = 0;
+}
+
+static void arena_free(Arena *a) {
+	while (a->chunks != NULL) {
+		ArenaChunk *next = a->chunks->next;
+		free(a->chunks);
+		a->chunks = next;
+	}
+	a->total_cap = 0;
+}
+
+#ifndef __SSE2__
+/* Loads 8 control bytes, the first in the lowest byte. */
+static uint64_t smap_load8(const uint8_t *bytes) {
+	uint64_t res;
+	memcpy(&res, bytes, sizeof(res));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	res = __builtin_bswap64(res);
+#endif
+	return res;
+}
+
+/* Gathers the top bits of the 8 bytes of x into the low 8 bits. */
+static uint32_t smap_movemask8(uint64_t x) {
+	return ((x & 0x8080808080808080ull) >> 7) * 0x0102040810204080ull >> 56;
+}
+#endif
+
+/* Bit i is set if group[i] == b. */
+static uint32_t smap_match(const uint8_t *group, uint8_t b) {
+#ifdef __SSE2__
+	__m128i g = _mm_loadu_si128((const __m128i*)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)b)));
+#else
+	/* Zero bytes of x are found with a carry trick, which may also flag the
+	 * byte above a zero one; those are told apart by their hashes. */
+	uint32_t res = 0;
+	for (size_t i = 0; i < SMAP_GROUP; i += 8) {
+		uint64_t x = smap_load8(group + i) ^ (0x0101010101010101ull * b);
+		res |= smap_movemask8((x - 0x0101010101010101ull) & ~x) << i;
+	}
+	return res;
+#endif
+}
+
+/* Bit i is set if slot i of the group has no entry, whose control bytes are
+ * the only ones with the top bit set. */
+static uint32_t smap_match_free(const uint8_t *group) {
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+	return smap_movemask8(smap_load8(group)) | smap_movemask8(smap_load8(group + 8)) << 8;
+#endif
+}
+
+/* Returns the index of the entry named key, or SIZE_MAX. The groups are
+ * probed one after the other from the slot hash points to; there is always a
+ * free slot, which ends the search. */
+static size_t smap_probe(const SMap *m, const char *key, size_t key_len, uint32_t hash, size_t type_size) {
+	if (m->cap == 0)
+		return SIZE_MAX;
+	const uint8_t h7 = hash >> 25;
+	for (size_t pos = hash & (m->cap - 1); ; pos = (pos + SMAP_GROUP) & (m->cap - 1)) {
+		STAT(stats.probes++);
+		const uint8_t *group = m->ctrl + pos;
+		for (uint32_t match = smap_match(group, h7); match != 0; match &= match - 1) {
+			size_t i = (pos + __builtin_ctz(match)) & (m->cap - 1);
+			if (m->hashes[i] != hash)
+				continue;
+			const char *i_key = *(char**)((uint8_t*)m->entries + type_size * i);
+			if (strncmp(i_key, key, key_len) == 0 && i_key[key_len] == 0)
+				return i;
+		}
+		if (smap_match(group, SMAP_EMPTY) != 0)
+			return SIZE_MAX;
+	}
+}
+
+static size_t smap_idx(const SMap *m, const char *key, size_t key_len, size_t type_size) {
+	return smap_probe(m, key, key_len, fnv1a32(key, key_len), type_size);
+}
+
+static void *smap_get(const SMap *m, const char *key, size_t key_len, size_t type_size) {
+	size_t i = smap_idx(m, key, key_len, type_size);
+	return i == SIZE_MAX ? NULL : (uint8_t*)m->entries + type_size * i;
+}
+
+/* Returns the entry named key, adding it, with everything but the name zeroed,
+ * if there is none. Entries move when the table is resized. */
+static void *smap_get_for_setting(SMap *m, const char *key, size_t key_len, size_t type_size) {
+	uint32_t hash = fnv1a32(key, key_len);
+	size_t i = smap_probe(m, key, key_len, hash, type_size);
+	if (i != SIZE_MAX)
+		return (uint8_t*)m->entries + type_size * i;
+
+	/* Tombstones count towards the load, as they lengthen the probes. */
+	if ((m->len + m->deleted + 1) * 8 > m->cap * 7)
+		smap_resize(m, smap_cap_for(m->len + 1), type_size);
+	for (size_t pos = hash & (m->cap - 1); ; pos = (pos + SMAP_GROUP) & (m->cap - 1)) {
+		uint32_t free_slots = smap_match_free(m->ctrl + pos);
+		if (free_slots != 0) {
+			i = (pos + __builtin_ctz(free_slots)) & (m->cap - 1);
+			break;
+		}
+	}
+	m->deleted -= m->ctrl[i] == SMAP_DELETED;
+	m->len++;
+	smap_set_ctrl(m, i, hash >> 25);
+	m->hashes[i] = hash;
+	char **keyptr = (char**)((uint8_t*)m->entries + type_size * i);
+	*keyptr = strndup(key, key_len);
+	return keyptr;
+}
+
+/* Frees the name of entry and leaves a tombstone, so probes for other names
+ * still go past it. Shrinks the table when it gets mostly empty. */
+static void smap_remove(SMap *m, void *entry, size_t type_size) {
+	size_t i = ((uint8_t*)entry - (uint8_t*)m->entries) / type_size;
+	free(*(char**)entry);
+	memset(entry, 0, type_size);
+	smap_set_ctrl(m, i, SMAP_DELETED);
+	m->len--;
+	m->deleted++;
+	if (m->cap > SMAP_GROUP && m->len * 8 < m->cap)
+		smap_resize(m, smap_cap_for(m->len), type_size);
+}
+
+static void smap_set_ctrl(SMap *m, size_t i, uint8_t b) {
+	m->ctrl[i] = b;
+	if (i < SMAP_GROUP)
+		m->ctrl[m->cap + i] = b;
+}
+
+/* Capacity for len entries, at most half full, so it neither grows nor shrinks
+ * again right away. */
+static size_t smap_cap_for(size_t len) {
+	size_t cap = SMAP_GROUP;
+	while (cap < len * 2)
+		cap *= 2;
+	return cap;
+}
+
+static size_t smap_bytes(size_t cap, size_t type_size) {
+	return (type_size + sizeof(uint32_t) + 1) * cap + SMAP_GROUP;
+}
+
+/* Moves the entries to a table of cap slots, dropping the tombstones. */
+static void smap_resize(SMap *m, size_t cap, size_t type_size) {
+	STAT(stats.resizes += m->cap > 0);
+	SMap res = {.len = m->len, .cap = cap};
+	res.entries = calloc(1, smap_bytes(cap, type_size));
+	res.hashes = (uint32_t*)((uint8_t*)res.entries + type_size * cap);
+	res.ctrl = (uint8_t*)(res.hashes + cap);
+	memset(res.ctrl, SMAP_EMPTY, cap + SMAP_GROUP);
+	for (size_t i = 0; i < m->cap; i++) {
+		if (m->ctrl[i] & 0x80)
+			continue;
+		for (size_t pos = m->hashes[i] & (cap - 1); ; pos = (pos + SMAP_GROUP) & (cap - 1)) {
+			uint32_t free_slots = smap_match_free(res.ctrl + pos);
+			if (free_slots != 0) {
+				size_t j = (pos + __builtin_ctz(free_slots)) & (cap - 1);
+				smap_set_ctrl(&res, j, m->ctrl[i]);
+				res.hashes[j] = m->hashes[i];
+				memcpy((uint8_t*)res.entries + type_size * j, (uint8_t*)m->entries + type_size * i, type_size);
+				break;
+			}
+		}
+	}
+	free(m->entries);
+	*m = res;
+}
+
+/* Copies the table as it is, so every entry keeps its index. The names are
+ * still those of src. */
+static void smap_copy(SMap *dst, const SMap *src, size_t type_size) {
+	*dst = *src;
+	if (src->cap == 0)
+		return;
+	dst->entries = memdup(src->entries, smap_bytes(src->cap, type_size));
+	dst->hashes = (uint32_t*)((uint8_t*)dst->entries + type_size * src->cap);
+	dst->ctrl = (uint8_t*)(dst->hashes + src->cap);
+}
+
+static void smap_free(SMap *m, size_t type_size) {
+	for (size_t i = 0; i < m->cap; i++)
+		free(*(char**)((uint8_t*)m->entries + type_size * i));
+	free(m->entries);
+	*m = (SMap){0};
+}
+
+static ExprVar *alloc_slot(VarChunk **chunks) {
+	if (*chunks == NULL || (*chunks)->len == sizeof((*chunks)->slots) / sizeof(ExprVar)) {
+		VarChunk *c = malloc(sizeof(VarChunk));
+		c->next = *chunks;
+		c->len = 0;
+		*chunks = c;
+	}
+	ExprVar *res = &(*chunks)->slots[(*chunks)->len++];
+	*res = (ExprVar){0};
+	return res;
+}
+
+/* Returns a slot for a new variable of e, reusing one of a removed variable
+ * if there is any. */
+static ExprVar *new_slot(Expr *e) {
+	if (e->free_slots_len == 0)
+		return alloc_slot(&e->var_chunks);
+	ExprVar *res = e->free_slots[--e->free_slots_len];
+	*res = (ExprVar){0};
+	return res;
+}
+
+/* Returns the variable name refers to, which is that of the environment if
+ * there is one and this Expr doesn't have its own. */
+static Var *get_var(Expr *e, const char *name, size_t name_len) {
+	Var *v = smap_get_for_setting(&e->vars, name, name_len, sizeof(Var));
+	if (v->slot == NULL) {
+		ExprVar *shared = env_get_var(e->env, name, name_len);
+		v->slot = shared != NULL ? shared : new_slot(e);
+		v->shared = shared != NULL;
+		v->prog_stamp = 0;
+	}
+	return v;
+}
+
+/* Like get_var, but the variable of the environment is never written to
+ * through an Expr; it gets a copy of its own instead. */
+static Var *get_var_for_setting(Expr *e, const char *name, size_t name_len) {
+	Var *v = get_var(e, name, name_len);
+	if (v->shared) {
+		ExprVar *shared = v->slot, *slot = new_slot(e);
+		*slot = (ExprVar){.val = shared->val, .set = shared->set, .constant = shared->constant};
+		v->slot = slot;
+		v->shared = false;
+		/* Programs still refer to the shared slot. Top-level ones are
+		 * compiled again, but user functions aren't. */
+		e->names_gen++;
+		rebind_shadowed(e, shared, slot);
+	}
+	return v;
+}
+
+/* Points the programs of e which outlive names_gen from the slot shared to
+ * slot, which shadows it, and makes the formulas reading it through a user
+ * function depend on slot. */
+static void rebind_shadowed(Expr *e, const ExprVar *shared, ExprVar *slot) {
+	/* That includes a body being compiled. */
+	bool changed = prog_rebind_slot(&e->prog, shared, slot, false);
+	for (UserFunc *u = e->user_funcs; u != NULL; u = u->next)
+		changed |= prog_rebind_slot(&u->body, shared, slot, false);
+	for (size_t k = 0; k < e->file_funcs_len; k++) {
+		if (e->file_funcs[k] != NULL)
+			changed |= prog_rebind_slot(&e->file_funcs[k]->body, shared, slot, false);
+	}
+	if (!changed)
+		return;
+	for (size_t i = 0; i < e->formulas_len; i++) {
+		Formula *f = e->formulas[i];
+		formula_unlink(f);
+		f->inputs_len = 0;
+		formula_add_inputs(f, &f->prog);
+		formula_link(f);
+	}
+}
+
+static bool prog_rebind_slot(Prog *p, const ExprVar *from, ExprVar *to, bool shared) {
+	bool changed = false;
+	for (size_t i = 0; i < p->vars_len; i++) {
+		if (p->vars[i].slot == from) {
+			p->vars[i].slot = to;
+			p->vars[i].shared = shared;
+			changed = true;
+		}
+	}
+	for (size_t i = 0; i < p->ranges_len; i++)
+		changed |= prog_rebind_slot(&p->ranges[i]->body, from, to, shared);
+	return changed;
+}
+
+/* Points the entry v, whose own variable shadowed shared, and the programs of
+ * e which outlive names_gen back to shared, undoing get_var_for_setting().
+ * Top-level programs are compiled again; until then they may refer to the old
+ * slot, which is therefore not reused. */
+static void rebind_unshadowed(Expr *e, Var *v, ExprVar *shared) {
+	ExprVar *slot = v->slot;
+	v->slot = shared;
+	v->shared = true;
+	e->names_gen++;
+	for (UserFunc *u = e->user_funcs; u != NULL; u = u->next)
+		prog_rebind_slot(&u->body, slot, shared, true);
+	for (size_t k = 0; k < e->file_funcs_len; k++) {
+		if (e->file_funcs[k] != NULL)
+			prog_rebind_slot(&e->file_funcs[k]->body, slot, shared, true);
+	}
+}
+
+static ExprVar *env_get_var(ExprEnv *env, const char *name, size_t name_len) {
+	int builtin = builtin_var_idx(name, name_len);
+	if (builtin != -1)
+		return &env->builtin_vars[builtin];
+	EnvTable *t = atomic_load_explicit(&env->vars, memory_order_acquire);
+	for (size_t i = fnv1a32(name, name_len) & (t->cap - 1); ; i = (i + 1) & (t->cap - 1)) {
+		STAT(stats.probes++);
+		char *i_name = atomic_load_explicit(&t->vars[i].name, memory_order_acquire);
+		if (i_name == NULL)
+			return NULL;
+		if (strncmp(i_name, name, name_len) == 0 && i_name[name_len] == 0)
+			return t->vars[i].slot;
+	}
+}
+
+/* Adds an unset variable, which mustn't exist yet. Only called with env->lock
+ * held, or while nobody else knows about env. */
+static ExprVar *env_add_var(ExprEnv *env, const char *name) {
+	EnvTable *t = atomic_load_explicit(&env->vars, memory_order_relaxed);
+	if ((t->len + 1) * 10 > t->cap * 7) {
+		STAT(stats.resizes++);
+		EnvTable *bigger = calloc(1, sizeof(EnvTable) + sizeof(EnvVar) * t->cap * 2);
+		bigger->prev = t;
+		bigger->len = t->len;
+		bigger->cap = t->cap * 2;
+		for (size_t i = 0; i < t->cap; i++) {
+			char *i_name = atomic_load_explicit(&t->vars[i].name, memory_order_relaxed);
+			if (i_name == NULL)
+				continue;
+			size_t j = fnv1a32(i_name, strlen(i_name)) & (bigger->cap - 1);
+			while (atomic_load_explicit(&bigger->vars[j].name, memory_order_relaxed) != NULL)
+				j = (j + 1) & (bigger->cap - 1);
+			bigger->vars[j].slot = t->vars[i].slot;
+			atomic_store_explicit(&bigger->vars[j].name, i_name, memory_order_relaxed);
+		}
+		atomic_store_explicit(&env->vars, bigger, memory_order_release);
+		t = bigger;
+	}
+
+	ExprVar *slot = alloc_slot(&env->var_chunks);
+	size_t i = fnv1a32(name, strlen(name)) & (t->cap - 1);
+	while (atomic_load_explicit(&t->vars[i].name, memory_order_relaxed) != NULL)
+		i = (i + 1) & (t->cap - 1);
+	t->vars[i].slot = slot;
+	atomic_store_explicit(&t->vars[i].name, strdup(name), memory_order_release);
+	t->len++;
+	return slot;
+}
+
+static void env_store(ExprEnv *env, ExprVar *v, double val) {
+	atomic_store_explicit(&v->val, val, memory_order_release);
+	atomic_store_explicit(&v->set, true, memory_order_release);
+	/* Programs which folded the old value are recompiled. */
+	if (atomic_exchange(&v->constant, false))
+		atomic_fetch_add(&env->consts_gen, 1);
+}
+
+static void default_env_init() {
+	default_env = expr_env_new();
+}
+
+void expr_set_var(Expr *e, const char *name, double val) {
+	expr_set_var_by_handle(e, get_var_for_setting(e, name, strlen(name))->slot, val);
+}
+
+bool expr_get_var(Expr *e, const char *name, double *out) {
+	size_t name_len = strlen(name);
+	Var *v = smap_get(&e->vars, name, name_len, sizeof(Var));
+	ExprVar *slot = v != NULL ? v->slot : NULL;
+	if (slot == NULL)
+		slot = env_get_var(e->env, name, name_len);
+	if (slot == NULL) {
+		*out = NAN;
+		return false;
+	}
+	return expr_get_var_by_handle(e, slot, out);
+}
+
+bool expr_unset_var(Expr *e, const char *name) {
+	Var *v = smap_get(&e->vars, name, strlen(name), sizeof(Var));
+	if (v == NULL)
+		return false;
+	bool own = !v->shared;
+	if (own) {
+		if (v->slot->constant) {
+			v->slot->constant = false;
+			e->consts_gen++;
+		}
+		v->slot->set = false;
+		/* The formula computing the variable goes with it, and those reading
+		 * it are left unset. */
+		VarDeps *d = v->slot->deps;
+		if (d != NULL) {
+			if (d->formula != NULL)
+				formula_remove(e, d->formula);
+			formulas_queue_users(e, v->slot);
+			formulas_run_queue(e);
+			if (d->users_len == 0) {
+				free(d->users);
+				free(d);
+				v->slot->deps = NULL;
+			}
+		}
+	}
+	/* Formulas and handles refer to the slot of the entry, which then has to
+	 * stay. */
+	if (own && (v->slot->deps != NULL || v->slot->handle))
+		return own;
+	/* Programs refer to its name, which goes back to the variable of the
+	 * environment, if there is one. */
+	if (name_in_use(e, v->name)) {
+		ExprVar *shared = own ? env_get_var(e->env, v->name, strlen(v->name)) : NULL;
+		if (shared != NULL)
+			rebind_unshadowed(e, v, shared);
+		return own;
+	}
+	if (own) {
+		if (e->free_slots_len == e->free_slots_cap) {
+			e->free_slots_cap = e->free_slots_cap == 0 ? 16 : e->free_slots_cap * 2;
+			e->free_slots = realloc(e->free_slots, sizeof(ExprVar*) * e->free_slots_cap);
+		}
+		e->free_slots[e->free_slots_len++] = v->slot;
+	}
+	smap_remove(&e->vars, v, sizeof(Var));
+	return own;
+}
+
+ExprVar *expr_var_handle(Expr *e, const char *name) {
+	ExprVar *slot = get_var_for_setting(e, name, strlen(name))->slot;
+	slot->handle = true;
+	return slot;
+}
+
+void expr_set_var_by_handle(Expr *e, ExprVar *var, double val) {
+	if (var->constant) {
+		var->constant = false;
+		e->consts_gen++;
+	}
+	var->val = val;
+	var->set = true;
+	if (var->deps != NULL && var->deps->users_len > 0) {
+		formulas_queue_users(e, var);
+		formulas_run_queue(e);
+	}
+}
+
+bool expr_get_var_by_handle(Expr *e, ExprVar *var, double *out) {
+	*out = var->set ? var->val : NAN;
+	return var->set;
+}
+
+static Func *set_func(Expr *e, const char *name, double (*func)(Expr *e, ExprArg *args), void (*vfunc)(double *res, const double **args, size_t n), ExprArgType *arg_types, size_t n_args, bool impure) {
+	Func *v = smap_get_for_setting(&e->funcs, name, strlen(name), sizeof(Func));
+	v->func = func;
+	v->vfunc = vfunc;
+	v->dfunc = NULL;
+	v->ifunc = NULL;
+	v->arg_types = arg_types;
+	v->n_args = n_args;
+	v->impure = impure;
+	v->variadic = false;
+	v->user = NULL;
+	e->names_gen++;
+	return v;
+}
+
+void expr_set_func(Expr *e, const char *name, double (*func)(Expr *e, ExprArg *args), ExprArgType *arg_types, size_t n_args) {
+	/* We know nothing about the function, so it's never folded. */
+	set_func(e, name, func, NULL, arg_types, n_args, true);
+	formulas_recompile(e);
+}
+
+bool expr_unset_func(Expr *e, const char *name) {
+	Func *f = smap_get(&e->funcs, name, strlen(name), sizeof(Func));
+	if (f == NULL || (f->func == NULL && f->user == NULL))
+		return false;
+	e->names_gen++;
+	/* Programs calling it refer to its name; get_func() skips the entry. The
+	 * body of a user function is kept either way, as redefining it does. */
+	if (name_in_use(e, f->name))
+		*f = (Func){.name = f->name};
+	else
+		smap_remove(&e->funcs, f, sizeof(Func));
+	formulas_recompile(e);
+	return true;
+}
+
+ExprError expr_define_func(Expr *e, const char *def) {
+	/* Parse the head, name(param, ...) = */
+	const char *c = def;
+	while (*c == ' ')
+		c++;
+	const char *name = c;
+	while (IS_SYMBOL(*c))
+		c++;
+	size_t name_len = c - name;
+	while (*c == ' ')
+		c++;
+	if (name_len == 0 || *c != '(')
+		return (ExprError){.start = c - def, .end = c - def, .err = "expected function name and parameters"};
+	c++;
+
+	/* Parameters are passed to the compiler as identifier tokens. */
+	e->toks_len = 0;
+	while (1) {
+		while (*c == ' ')
+			c++;
+		const char *param = c;
+		while (IS_SYMBOL(*c))
+			c++;
+		if (c == param)
+			return (ExprError){.start = c - def, .end = c - def, .err = "expected parameter name"};
+		push_tok(e, (Tok){.start = param - def, .end = c - def - 1, .kind = TokIdent, .Str = param, .Len = c - param});
+		while (*c == ' ')
+			c++;
+		if (*c == ')')
+			break;
+		if (*c != ',')
+			return (ExprError){.start = c - def, .end = c - def, .err = "expected ',' or ')'"};
+		c++;
+	}
+	c++;
+	while (*c == ' ')
+		c++;
+	if (*c != '=')
+		return (ExprError){.start = c - def, .end = c - def, .err = "expected '='"};
+	c++;
+	size_t n_params = e->toks_len;
+	size_t body_start = c - def;
+
+	/* The tokens of the body overwrite the parameters. */
+	Tok *params = malloc(sizeof(Tok) * n_params);
+	memcpy(params, e->toks, sizeof(Tok) * n_params);
+	Prog body;
+	ExprError err = compile_body(e, c, params, n_params, false, &body);
+	free(params);
+	if (err.err != NULL) {
+		err.start += body_start;
+		err.end += body_start;
+		return err;
+	}
+
+	UserFunc *u = malloc(sizeof(UserFunc));
+	u->n_params = n_params;
+	u->arg_types = malloc(sizeof(ExprArgType) * n_params);
+	for (size_t i = 0; i < n_params; i++)
+		u->arg_types[i] = ExprArgTypeNum;
+	u->body = body;
+	u->next = e->user_funcs;
+	e->user_funcs = u;
+
+	bool impure = false;
+	for (size_t i = 0; i < u->body.funcs_len; i++)
+		impure |= u->body.funcs[i].impure;
+
+	char *name_str = arena_strndup(&e->arena, name, name_len);
+	Func *f = set_func(e, name_str, NULL, NULL, u->arg_types, n_params, impure);
+	f->user = u;
+	formulas_recompile(e);
+	return (ExprError){0};
+}
+
+ExprError expr_define_var(Expr *e, const char *def) {
+	/* Parse the head, name := */
+	const char *c = def;
+	while (*c == ' ')
+		c++;
+	const char *name = c;
+	while (IS_SYMBOL(*c))
+		c++;
+	size_t name_len = c - name;
+	while (*c == ' ')
+		c++;
+	if (name_len == 0 || c[0] != ':' || c[1] != '=')
+		return (ExprError){.start = c - def, .end = c - def, .err = "expected variable name and ':='"};
+	c += 2;
+	size_t body_start = c - def;
+
+	Formula *f = calloc(1, sizeof(Formula));
+	ExprError err = compile_body(e, c, NULL, 0, true, &f->prog);
+	if (err.err != NULL) {
+		free(f);
+		err.start += body_start;
+		err.end += body_start;
+		return err;
+	}
+	if (prog_impure(&f->prog)) {
+		formula_free(f);
+		return (ExprError){.start = body_start, .end = strlen(def) - 1, .err = "formulas can't call functions with side effects"};
+	}
+	Var *v = get_var_for_setting(e, name, name_len);
+	f->name = v->name;
+	f->slot = v->slot;
+	f->src = strdup(c);
+	formula_add_inputs(f, &f->prog);
+	if (formula_reads(f, f->slot, ++e->formula_visit)) {
+		formula_free(f);
+		return (ExprError){.start = name - def, .end = name - def + name_len - 1, .err = "circular definition"};
+	}
+
+	/* The value changes without the constant being set. */
+	if (f->slot->constant) {
+		f->slot->constant = false;
+		e->consts_gen++;
+	}
+	VarDeps *d = var_deps(f->slot);
+	if (d->formula != NULL) {
+		for (size_t i = 0; i < e->formulas_len; i++) {
+			if (e->formulas[i] == d->formula)
+				e->formulas[i] = f;
+		}
+		formula_unlink(d->formula);
+		formula_free(d->formula);
+	} else
+		formulas_add(e, f);
+	d->formula = f;
+	formula_link(f);
+
+	/* Redefining a formula may change the depths of those reading it. */
+	for (size_t i = 0; i < e->formulas_len; i++)
+		e->formulas[i]->depth = 0;
+	for (size_t i = 0; i < e->formulas_len; i++)
+		formula_depth(e->formulas[i]);
+
+	f->queued = true;
+	e->formula_queue[e->formula_queue_len++] = f;
+	formulas_queue_users(e, f->slot);
+	formulas_run_queue(e);
+	return (ExprError){0};
+}
+
+void expr_set_userdata(Expr *e, void *userdata) {
+	e->userdata = userdata;
+}
+
+void *expr_get_userdata(Expr *e) {
+	return e->userdata;
+}
+
+ExprFileWriter *expr_file_writer_new() {
+	ExprFileWriter *w = calloc(1, sizeof(ExprFileWriter));
+	qcb_add(w, NULL, sizeof(QcbHeader), 8);
+	return w;
+}
+
+bool expr_file_writer_add(ExprFileWriter *w, Expr *e) {
+	if (prog_refresh(e).err != NULL) {
+		errno = EINVAL;
+		return false;
+	}
+	/* Programs folding constants are compiled again without for the time
+	 * being, as the file may be loaded after the constants changed. */
+	bool refold = e->cur->folds_consts;
+	e->keep_consts = refold;
+	ExprError err = refold ? expr_set(e, e->src) : (ExprError){0};
+	QcbExpr x;
+	bool ok = err.err == NULL && qcb_write_prog(w, e->cur, 0, &x.prog);
+	e->keep_consts = false;
+	if (refold && err.err == NULL)
+		err = expr_set(e, e->src);
+	if (!ok) {
+		errno = err.err != NULL ? EINVAL : ENOTSUP;
+		return false;
+	}
+
+	x.src = qcb_add_str(w, e->src);
+	if (w->exprs_len >= w->exprs_cap) {
+		w->exprs_cap = w->exprs_cap == 0 ? 16 : w->exprs_cap * 2;
+		w->exprs = realloc(w->exprs, sizeof(QcbExpr) * w->exprs_cap);
+	}
+	w->exprs[w->exprs_len++] = x;
+	return true;
+}
+
+bool expr_file_writer_save(ExprFileWriter *w, const char *path) {
+	size_t len = w->len;
+	QcbHeader h = {
+		.magic = QCB_MAGIC,
+		.version = QCB_VERSION,
+		.byte_order = QCB_BYTE_ORDER,
+		.op_size = sizeof(Op),
+		.n_exprs = w->exprs_len,
+		.n_progs = w->progs_len,
+	};
+	h.exprs = qcb_add(w, w->exprs, sizeof(QcbExpr) * w->exprs_len, 4);
+	h.progs = qcb_add(w, w->progs, sizeof(QcbProg) * w->progs_len, 4);
+	h.size = w->len;
+	memcpy(w->data, &h, sizeof(QcbHeader));
+	/* The tables are taken off again, so more can be added. */
+	size_t size = w->len;
+	w->len = len;
+	if (size > UINT32_MAX) {
+		errno = EFBIG;
+		return false;
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	size_t n_written = 0;
+	while (n_written < size) {
+		ssize_t res = write(fd, w->data + n_written, size - n_written);
+		if (res < 0 && errno != EINTR)
+			break;
+		n_written += res > 0 ? res : 0;
+	}
+	bool ok = n_written == size;
+	ok &= close(fd) == 0;
+	return ok;
+}
+
+void expr_file_writer_free(ExprFileWriter *w) {
+	free(w->data);
+	free(w->exprs);
+	free(w->progs);
+	free(w->users);
+	free(w->user_progs);
+	free(w);
+}
+
+ExprFile *expr_file_open(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof(QcbHeader)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	int err = errno;
+	close(fd);
+	if (data == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+
+	ExprFile *f = malloc(sizeof(ExprFile));
+	*f = (ExprFile){.data = data, .size = st.st_size, .header = data};
+	if (!file_check(f)) {
+		expr_file_close(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	return f;
+}
+
+void expr_file_close(ExprFile *f) {
+	munmap((void*)f->data, f->size);
+	free(f->stack_caps);
+	free(f);
+}
+
+size_t expr_file_len(ExprFile *f) {
+	return f->header->n_exprs;
+}
+
+const char *expr_file_src(ExprFile *f, size_t i) {
+	return f->data + f->exprs[i].src;
+}
+
+ExprError expr_set_from_file(Expr *e, ExprFile *f, size_t i) {
+	if (i >= f->header->n_exprs)
+		return (ExprError){.err = "no such expression in file"};
+	/* The old program may call bodies of the old file. */
+	prog_free(&e->file_prog);
+	e->file_prog = (Prog){0};
+	if (f != e->file) {
+		file_funcs_free(e);
+		e->file = f;
+		e->file_funcs = calloc(f->header->n_progs, sizeof(UserFunc*));
+		e->file_funcs_len = f->header->n_progs;
+	}
+	const char *src = f->data + f->exprs[i].src;
+	set_src(e, src, strlen(src));
+	file_load_prog(e, f->exprs[i].prog, &e->file_prog);
+	e->file_expr = i;
+	e->cur = &e->file_prog;
+	scratch_reserve(&e->scratch, e->cur, false);
+	return (ExprError){0};
+}
+
+/* Compiles src into a program of its own, keeping the one of the current
+ * expression. params are those of the user function src is the body of. With
+ * own_vars, the variables of the environment src reads are replaced by copies
+ * of this Expr first, which are never folded. */
+static ExprError compile_body(Expr *e, const char *src, const Tok *params, size_t n_params, bool own_vars, Prog *res) {
+	Prog saved = e->prog;
+	e->prog = (Prog){0};
+	e->params = params;
+	e->n_params = n_params;
+	e->toks_len = 0;
+	STAT(uint64_t t = stats_now());
+	ExprError err = tokenize(e, src, strlen(src));
+	STAT(stats.tokenize_ns += stats_now() - t);
+	for (size_t i = 0; own_vars && err.err == NULL && i < e->toks_len; i++) {
+		Tok *t = &e->toks[i];
+		if (t->kind != TokIdent || (t[1].kind == TokOp && t[1].Char == '(') || env_get_var(e->env, t->Str, t->Len) == NULL)
+			continue;
+		ExprVar *slot = get_var_for_setting(e, t->Str, t->Len)->slot;
+		if (slot->constant) {
+			slot->constant = false;
+			e->consts_gen++;
+		}
+	}
+	STAT(t = stats_now());
+	if (err.err == NULL)
+		err = compile(e);
+	STAT(stats.compile_ns += stats_now() - t);
+	Prog body = e->prog;
+	e->prog = saved;
+	e->params = NULL;
+	e->n_params = 0;
+	/* The strings of the body live in the arena, so it is copied. */
+	if (err.err == NULL)
+		prog_copy(res, &body);
+	prog_free(&body);
+	return err;
+}
+
+static bool prog_impure(const Prog *p) {
+	for (size_t i = 0; i < p->funcs_len; i++) {
+		if (p->funcs[i].impure || (p->funcs[i].user != NULL && prog_impure(&p->funcs[i].user->body)))
+			return true;
+	}
+	for (size_t i = 0; i < p->ranges_len; i++) {
+		if (prog_impure(&p->ranges[i]->body))
+			return true;
+	}
+	return false;
+}
+
+static VarDeps *var_deps(ExprVar *v) {
+	if (v->deps == NULL)
+		v->deps = calloc(1, sizeof(VarDeps));
+	return v->deps;
+}
+
+static void formulas_add(Expr *e, Formula *f) {
+	if (e->formulas_len >= e->formulas_cap) {
+		e->formulas_cap = e->formulas_cap == 0 ? 16 : e->formulas_cap * 2;
+		e->formulas = realloc(e->formulas, sizeof(Formula*) * e->formulas_cap);
+		e->formula_queue = realloc(e->formula_queue, sizeof(Formula*) * e->formulas_cap);
+	}
+	e->formulas[e->formulas_len++] = f;
+}
+
+static void formula_add_inputs(Formula *f, const Prog *p) {
+	for (size_t i = 0; i < p->vars_len; i++) {
+		/* Variables of the environment are only read through user
+		 * functions, which were compiled before the formula. */
+		if (p->vars[i].shared)
+			continue;
+		size_t j = 0;
+		while (j < f->inputs_len && f->inputs[j] != p->vars[i].slot)
+			j++;
+		if (j < f->inputs_len)
+			continue;
+		if (f->inputs_len >= f->inputs_cap) {
+			f->inputs_cap = f->inputs_cap == 0 ? 4 : f->inputs_cap * 2;
+			f->inputs = realloc(f->inputs, sizeof(ExprVar*) * f->inputs_cap);
+		}
+		f->inputs[f->inputs_len++] = p->vars[i].slot;
+	}
+	for (size_t i = 0; i < p->funcs_len; i++) {
+		if (p->funcs[i].user != NULL)
+			formula_add_inputs(f, &p->funcs[i].user->body);
+	}
+	for (size_t i = 0; i < p->ranges_len; i++)
+		formula_add_inputs(f, &p->ranges[i]->body);
+}
+
+/* Whether f reads v, directly or through other formulas. Formulas already
+ * marked with visit aren't looked at again. */
+static bool formula_reads(Formula *f, const ExprVar *v, uint32_t visit) {
+	for (size_t i = 0; i < f->inputs_len; i++) {
+		if (f->inputs[i] == v)
+			return true;
+		Formula *g = f->inputs[i]->deps != NULL ? f->inputs[i]->deps->formula : NULL;
+		if (g != NULL && g->visit != visit) {
+			g->visit = visit;
+			if (formula_reads(g, v, visit))
+				return true;
+		}
+	}
+	return false;
+}
+
+static size_t formula_depth(Formula *f) {
+	if (f->depth != 0)
+		return f->depth;
+	size_t depth = 0;
+	for (size_t i = 0; i < f->inputs_len; i++) {
+		Formula *g = f->inputs[i]->deps != NULL ? f->inputs[i]->deps->formula : NULL;
+		if (g != NULL && formula_depth(g) > depth)
+			depth = g->depth;
+	}
+	f->depth = depth + 1;
+	return f->depth;
+}
+
+static void formula_link(Formula *f) {
+	for (size_t i = 0; i < f->inputs_len; i++) {
+		VarDeps *d = var_deps(f->inputs[i]);
+		if (d->users_len >= d->users_cap) {
+			d->users_cap = d->users_cap == 0 ? 4 : d->users_cap * 2;
+			d->users = realloc(d->users, sizeof(Formula*) * d->users_cap);
+		}
+		d->users[d->users_len++] = f;
+	}
+}
+
+static void formula_unlink(Formula *f) {
+	for (size_t i = 0; i < f->inputs_len; i++) {
+		VarDeps *d = f->inputs[i]->deps;
+		for (size_t j = 0; j < d->users_len; j++) {
+			if (d->users[j] == f) {
+				d->users[j] = d->users[--d->users_len];
+				break;
+			}
+		}
+	}
+}
+
+static void formula_free(Formula *f) {
+	free(f->src);
+	prog_free(&f->prog);
+	free(f->inputs);
+	free(f);
+}
+
+/* Removes f from the formulas of e, leaving the value of its variable. */
+static void formula_remove(Expr *e, Formula *f) {
+	size_t i = 0;
+	while (e->formulas[i] != f)
+		i++;
+	memmove(e->formulas + i, e->formulas + i + 1, sizeof(Formula*) * (e->formulas_len - i - 1));
+	e->formulas_len--;
+	formula_unlink(f);
+	f->slot->deps->formula = NULL;
+	formula_free(f);
+}
+
+/* Queues the formulas reading v, directly or through other formulas. */
+static void formulas_queue_users(Expr *e, ExprVar *v) {
+	if (v->deps == NULL)
+		return;
+	for (size_t i = 0; i < v->deps->users_len; i++) {
+		Formula *f = v->deps->users[i];
+		if (f->queued)
+			continue;
+		f->queued = true;
+		e->formula_queue[e->formula_queue_len++] = f;
+		formulas_queue_users(e, f->slot);
+	}
+}
+
+static int formula_cmp_depth(const void *a, const void *b) {
+	size_t x = (*(Formula**)a)->depth, y = (*(Formula**)b)->depth;
+	return (x > y) - (x < y);
+}
+
+/* Recomputes the queued formulas, each once and after its inputs. A formula
+ * which can't be evaluated leaves its variable unset. */
+static void formulas_run_queue(Expr *e) {
+	qsort(e->formula_queue, e->formula_queue_len, sizeof(Formula*), formula_cmp_depth);
+	Scratch saved = e->scratch;
+	e->scratch = e->formula_scratch;
+	for (size_t i = 0; i < e->formula_queue_len; i++) {
+		Formula *f = e->formula_queue[i];
+		scratch_reserve(&e->scratch, &f->prog, false);
+		double val = 0.0;
+		f->slot->set = run(e, &f->prog, &e->scratch, &val).err == NULL;
+		f->slot->val = val;
+		f->queued = false;
+	}
+	e->formula_queue_len = 0;
+	e->formula_scratch = e->scratch;
+	e->scratch = saved;
+}
+
+/* Compiles the formulas again after a function changed, unlike user functions,
+ * which keep calling the old one. Those whose program changed are recomputed.
+ * A formula which no longer compiles, or would call itself or functions with
+ * side effects, keeps its previous program. */
+static void formulas_recompile(Expr *e) {
+	bool changed = false;
+	for (size_t i = 0; i < e->formulas_len; i++) {
+		Formula *f = e->formulas[i];
+		Formula g = {.slot = f->slot};
+		if (compile_body(e, f->src, NULL, 0, true, &g.prog).err != NULL)
+			continue;
+		formula_add_inputs(&g, &g.prog);
+		if (prog_same(&f->prog, &g.prog) || prog_impure(&g.prog) || formula_reads(&g, f->slot, ++e->formula_visit)) {
+			prog_free(&g.prog);
+			free(g.inputs);
+			continue;
+		}
+		formula_unlink(f);
+		prog_free(&f->prog);
+		free(f->inputs);
+		f->prog = g.prog;
+		f->inputs = g.inputs;
+		f->inputs_len = g.inputs_len;
+		f->inputs_cap = g.inputs_cap;
+		formula_link(f);
+		if (!f->queued) {
+			f->queued = true;
+			e->formula_queue[e->formula_queue_len++] = f;
+		}
+		formulas_queue_users(e, f->slot);
+		changed = true;
+	}
+	if (!changed)
+		return;
+	for (size_t i = 0; i < e->formulas_len; i++)
+		e->formulas[i]->depth = 0;
+	for (size_t i = 0; i < e->formulas_len; i++)
+		formula_depth(e->formulas[i]);
+	formulas_run_queue(e);
+}
+
+/* Whether both programs compute the same. Range reductions are never taken to
+ * be the same. */
+static bool prog_same(const Prog *a, const Prog *b) {
+	if (a->ops_len != b->ops_len || a->vars_len != b->vars_len || a->funcs_len != b->funcs_len || a->ranges_len > 0 || b->ranges_len > 0)
+		return false;
+	if (memcmp(a->ops, b->ops, sizeof(Op) * a->ops_len) != 0)
+		return false;
+	for (size_t i = 0; i < a->vars_len; i++) {
+		if (a->vars[i].slot != b->vars[i].slot)
+			return false;
+	}
+	for (size_t i = 0; i < a->funcs_len; i++) {
+		if (a->funcs[i].func != b->funcs[i].func || a->funcs[i].user != b->funcs[i].user)
+			return false;
+	}
+	return true;
+}
+
+static void push_op(Expr *e, Op op) {
+	Prog *p = &e->prog;
+	if (p->ops_len >= p->ops_cap) {
+		size_t new_cap = p->ops_cap == 0 ? 16 : p->ops_cap * 2;
+		p->ops = realloc(p->ops, sizeof(Op) * new_cap);
+		p->ops_cap = new_cap;
+	}
+	if (p->stack_len + 1 > e->op_starts_cap) {
+		e->op_starts_cap = e->op_starts_cap == 0 ? 16 : e->op_starts_cap * 2;
+		e->op_starts = realloc(e->op_starts, sizeof(size_t) * e->op_starts_cap);
+	}
+
+	/* Keep track of how deep the evaluation stack can get, and where the
+	 * instructions computing each stack entry start. */
+	size_t n_in = op_n_in(p, op);
+	if (n_in == 0)
+		e->op_starts[p->stack_len] = p->ops_len;
+	p->stack_len = p->stack_len - n_in + 1;
+	if (p->stack_len > p->stack_cap)
+		p->stack_cap = p->stack_len;
+
+	p->ops[p->ops_len++] = op;
+	STAT(stats.ops++);
+}
+
+/* Removes the instructions computing the stack entry k below the top, which
+ * must not have side effects. */
+static void drop_operand(Expr *e, size_t k) {
+	Prog *p = &e->prog;
+	size_t top = p->stack_len - 1;
+	size_t start = e->op_starts[top - k];
+	size_t end = k == 0 ? p->ops_len : e->op_starts[top - k + 1];
+	memmove(p->ops + start, p->ops + end, sizeof(Op) * (p->ops_len - end));
+	STAT(stats.moved += sizeof(Op) * (p->ops_len - end));
+	p->ops_len -= end - start;
+	for (size_t i = top - k + 1; i <= top; i++)
+		e->op_starts[i - 1] = e->op_starts[i] - (end - start);
+	p->stack_len--;
+}
+
+static bool operand_is(Expr *e, size_t k, double val) {
+	Prog *p = &e->prog;
+	size_t top = p->stack_len - 1;
+	size_t start = e->op_starts[top - k];
+	size_t end = k == 0 ? p->ops_len : e->op_starts[top - k + 1];
+	/* Compared on the bits, as -ffinite-math-only lets NaN compare equal to
+	 * anything. */
+	return end - start == 1 && p->ops[start].kind == OpNum && memcmp(&p->ops[start].Num, &val, sizeof(val)) == 0;
+}
+
+static void emit(Expr *e, Op op) {
+	Prog *p = &e->prog;
+	size_t n_in = op_n_in(p, op);
+
+	if ((op.kind == OpCall || op.kind == OpCallUser) && p->funcs[op.arg].impure)
+		p->impure_seen = true;
+
+	if (op.kind == OpCallUser) {
+		/* The body runs on the stack above its arguments. */
+		const Prog *body = &p->funcs[op.arg].user->body;
+		if (p->stack_len + body->stack_cap > p->stack_cap)
+			p->stack_cap = p->stack_len + body->stack_cap;
+		p->runs_bodies = true;
+		push_op(e, op);
+		return;
+	}
+	if (op.kind == OpReduce) {
+		/* The body runs above its arguments and the index, which replace
+		 * the bounds. */
+		const Range *r = p->ranges[op.arg];
+		size_t need = p->stack_len - 2 + r->n_args + 1 + r->body.stack_cap;
+		if (need > p->stack_cap)
+			p->stack_cap = need;
+		p->impure_seen |= r->impure;
+		p->runs_bodies = true;
+		push_op(e, op);
+		return;
+	}
+
+	/* Fold operations on constants. */
+	bool fold = n_in > 0 && !(op.kind == OpCall && p->funcs[op.arg].impure);
+	for (size_t i = 1; fold && i <= n_in; i++)
+		fold = p->ops[p->ops_len - i].kind == OpNum;
+	if (fold) {
+		ExprArg *a = e->scratch.stack;
+		for (size_t i = 0; i < n_in; i++)
+			a[i].Num = p->ops[p->ops_len - n_in + i].Num;
+		double res;
+		switch (op.kind) {
+		case OpNeg: res = -a[0].Num;                 break;
+		case OpSqr: res = a[0].Num * a[0].Num;       break;
+		case OpAdd: res = a[0].Num + a[1].Num;       break;
+		case OpSub: res = a[0].Num - a[1].Num;       break;
+		case OpMul: res = a[0].Num * a[1].Num;       break;
+		case OpDiv: res = a[0].Num / a[1].Num;       break;
+		case OpPow: res = pow(a[0].Num, a[1].Num);   break;
+		case OpCall:
+			STAT(stats.builtin_calls[p->funcs[op.arg].builtin]++);
+			res = p->funcs[op.arg].func(e, a);
+			/* The call was the last thing added. */
+			p->funcs_len--;
+			break;
+		default: res = NAN; break;
+		}
+		p->ops_len -= n_in;
+		p->stack_len -= n_in;
+		STAT(stats.folds++);
+		push_op(e, (Op){.kind = OpNum, .Num = res});
+		return;
+	}
+
+	/* Simplify operations with a neutral or otherwise special constant
+	 * operand. x + 0 and 0 - x aren't, as they turn -0 into 0 and 0 into -0. */
+	switch (op.kind) {
+	case OpSub:
+		if (operand_is(e, 0, 0.0)) {
+			drop_operand(e, 0);
+			return;
+		}
+		break;
+	case OpMul:
+		if (operand_is(e, 0, 1.0)) {
+			drop_operand(e, 0);
+			return;
+		} else if (operand_is(e, 1, 1.0)) {
+			drop_operand(e, 1);
+			return;
+		}
+		break;
+	case OpDiv:
+		if (operand_is(e, 0, 1.0)) {
+			drop_operand(e, 0);
+			return;
+		}
+		break;
+	case OpPow:
+		if (operand_is(e, 0, 1.0)) {
+			drop_operand(e, 0);
+			return;
+		} else if (operand_is(e, 0, 2.0)) {
+			drop_operand(e, 0);
+			op.kind = OpSqr;
+		} else if (operand_is(e, 0, 0.5)) {
+			drop_operand(e, 0);
+			op = (Op){.kind = OpCall, .arg = prog_add_func(e, builtin_func(builtin_func_idx("sqrt", 4)))};
+		}
+		break;
+	case OpCall:
+		if (p->funcs[op.arg].func == fn_pow) {
+			if (operand_is(e, 0, 1.0)) {
+				drop_operand(e, 0);
+				p->funcs_len--;
+				return;
+			} else if (operand_is(e, 0, 2.0)) {
+				drop_operand(e, 0);
+				p->funcs_len--;
+				op.kind = OpSqr;
+			} else if (operand_is(e, 0, 0.5)) {
+				drop_operand(e, 0);
+				p->funcs[op.arg] = builtin_func(builtin_func_idx("sqrt", 4));
+			}
+		}
+		break;
+	}
+
+	push_op(e, op);
+}
+
+static size_t op_n_in(const Prog *p, Op op) {
+	switch (op.kind) {
+	case OpNum:
+	case OpVar:
+	case OpStr:
+	case OpArg:
+		return 0;
+	case OpNeg:
+	case OpSqr:
+		return 1;
+	case OpCall:
+	case OpCallUser:
+		return p->funcs[op.arg].n_args;
+	default:
+		return 2;
+	}
+}
+
+static uint32_t prog_add_var(Expr *e, Var *v, Tok *t) {
+	Prog *p = &e->prog;
+	if (e->params != NULL) {
+		/* Bodies may be compiled in the middle of another program, whose
+		 * stamps must be left alone. */
+		for (size_t i = 0; i < p->vars_len; i++) {
+			if (p->vars[i].slot == v->slot)
+				return i;
+		}
+	} else if (v->prog_stamp == e->prog_stamp)
+		return v->prog_idx;
+	else {
+		v->prog_stamp = e->prog_stamp;
+		v->prog_idx = p->vars_len;
+	}
+	if (p->vars_len >= p->vars_cap) {
+		size_t new_cap = p->vars_cap == 0 ? 16 : p->vars_cap * 2;
+		p->vars = realloc(p->vars, sizeof(ProgVar) * new_cap);
+		p->vars_cap = new_cap;
+	}
+	p->vars[p->vars_len] = (ProgVar){.slot = v->slot, .name = v->name, .start = t->start, .end = t->end, .shared = v->shared};
+	return p->vars_len++;
+}
+
+static uint32_t prog_add_str(Expr *e, char *str) {
+	Prog *p = &e->prog;
+	if (p->strs_len >= p->strs_cap) {
+		size_t new_cap = p->strs_cap == 0 ? 16 : p->strs_cap * 2;
+		p->strs = realloc(p->strs, sizeof(char*) * new_cap);
+		p->strs_cap = new_cap;
+	}
+	p->strs[p->strs_len] = str;
+	return p->strs_len++;
+}
+
+static uint32_t prog_add_func(Expr *e, Func f) {
+	Prog *p = &e->prog;
+	if (p->funcs_len >= p->funcs_cap) {
+		size_t new_cap = p->funcs_cap == 0 ? 16 : p->funcs_cap * 2;
+		p->funcs = realloc(p->funcs, sizeof(Func) * new_cap);
+		p->funcs_cap = new_cap;
+	}
+	p->funcs[p->funcs_len] = f;
+	return p->funcs_len++;
+}
+
+static uint32_t prog_add_range(Expr *e, Range *r) {
+	Prog *p = &e->prog;
+	if (p->ranges_len >= p->ranges_cap) {
+		size_t new_cap = p->ranges_cap == 0 ? 4 : p->ranges_cap * 2;
+		p->ranges = realloc(p->ranges, sizeof(Range*) * new_cap);
+		p->ranges_cap = new_cap;
+	}
+	p->ranges[p->ranges_len] = r;
+	return p->ranges_len++;
+}
+
+static void push_frame(Expr *e, Frame f) {
+	if (e->frames_len >= e->frames_cap) {
+		size_t new_cap = e->frames_cap == 0 ? 16 : e->frames_cap * 2;
+		e->frames = realloc(e->frames, sizeof(Frame) * new_cap);
+		e->frames_cap = new_cap;
+	}
+	e->frames[e->frames_len++] = f;
+}
+
+/* Compiles a reference to the variable name; errors are reported at t. */
+static void compile_var(Expr *e, const char *name, size_t name_len, Tok *t) {
+	for (size_t i = 0; i < e->n_params; i++) {
+		if (e->params[i].Len == name_len && memcmp(e->params[i].Str, name, name_len) == 0) {
+			emit(e, (Op){.kind = OpArg, .arg = i});
+			return;
+		}
+	}
+	compile_global_var(e, name, name_len, t);
+}
+
+/* Like compile_var, but name is never a parameter or range index. */
+static void compile_global_var(Expr *e, const char *name, size_t name_len, Tok *t) {
+	/* Variables are bound to their slots once here, which also creates
+	 * not-yet-set ones, so they may still be set before evaluation.
+	 * Constants aren't folded into function bodies, which outlive them;
+	 * they are once the body is inlined. */
+	Var *v = get_var(e, name, name_len);
+	if (v->slot->constant && !e->prog.impure_seen && e->params == NULL && !e->keep_consts) {
+		/* It stays an input, which prog_unfold() gives back its variable. */
+		prog_add_var(e, v, t);
+		emit(e, (Op){.kind = OpNum, .Num = v->slot->val});
+		e->prog.folds_consts = true;
+	} else
+		emit(e, (Op){.kind = OpVar, .arg = prog_add_var(e, v, t)});
+}
+
+/* Starts the next argument of the call on top of the frame stack; *i is at
+ * the '(' or ',' before it. */
+static ExprError compile_arg(Expr *e, size_t *i, bool *want_operand) {
+	Frame *f = &e->frames[e->frames_len - 1];
+	if (f->n_args < f->func.n_args && f->func.arg_types[f->n_args] == ExprArgTypeStr) {
+		Tok *arg = &e->toks[*i + 1];
+		if (arg->kind != TokIdent || !(arg[1].kind == TokOp && OP_PREC(arg[1].Char) == 0))
+			return (ExprError){.start = arg->start, .end = arg->end, .err = "expected string argument"};
+		emit(e, (Op){.kind = OpStr, .arg = prog_add_str(e, arena_strndup(&e->arena, arg->Str, arg->Len))});
+		/* Give the Expr its own copy of a variable of the environment now,
+		 * so the uses following set() see what it sets. */
+		if (f->func.func == fn_set)
+			get_var_for_setting(e, arg->Str, arg->Len);
+		*i += 2;
+		*want_operand = false;
+	} else {
+		(*i)++;
+		*want_operand = true;
+	}
+	return (ExprError){0};
+}
+
+static void compile_call(Expr *e, Func f, Tok *t) {
+	Prog *p = &e->prog;
+	if (f.user == NULL) {
+		emit(e, (Op){.kind = OpCall, .arg = prog_add_func(e, f)});
+		return;
+	}
+
+	const UserFunc *u = f.user;
+	if (!can_inline(e, u)) {
+		emit(e, (Op){.kind = OpCallUser, .arg = prog_add_func(e, f), .Pos = {t->start, t->end}});
+		return;
+	}
+
+	/* Take the instructions of the arguments off the program, then emit the
+	 * body with the arguments substituted for the parameters. */
+	size_t base = p->stack_len - u->n_params;
+	size_t start = e->op_starts[base];
+	size_t n_ops = p->ops_len - start;
+	if (n_ops > e->inline_args_cap) {
+		e->inline_args_cap = n_ops;
+		e->inline_args = realloc(e->inline_args, sizeof(Op) * n_ops);
+	}
+	memcpy(e->inline_args, p->ops + start, sizeof(Op) * n_ops);
+	if (u->n_params + 1 > e->inline_starts_cap) {
+		e->inline_starts_cap = u->n_params + 1;
+		e->inline_starts = realloc(e->inline_starts, sizeof(size_t) * e->inline_starts_cap);
+	}
+	size_t *arg_starts = e->inline_starts;
+	for (size_t i = 0; i < u->n_params; i++)
+		arg_starts[i] = e->op_starts[base + i] - start;
+	arg_starts[u->n_params] = n_ops;
+	p->ops_len = start;
+	p->stack_len = base;
+
+	const Prog *body = &u->body;
+	for (size_t i = 0; i < body->ops_len; i++) {
+		Op op = body->ops[i];
+		switch (op.kind) {
+		case OpArg:
+			/* Already simplified, so they go in as they are. */
+			for (size_t j = arg_starts[op.arg]; j < arg_starts[op.arg + 1]; j++)
+				push_op(e, e->inline_args[j]);
+			break;
+		case OpVar: {
+			/* A global of the body, even if the caller has a parameter
+			 * or range index by that name. */
+			const char *name = body->vars[op.arg].name;
+			compile_global_var(e, name, strlen(name), t);
+			break;
+		}
+		case OpStr:
+			emit(e, (Op){.kind = OpStr, .arg = prog_add_str(e, body->strs[op.arg])});
+			break;
+		case OpCall:
+		case OpCallUser:
+			op.arg = prog_add_func(e, body->funcs[op.arg]);
+			if (op.kind == OpCallUser) {
+				op.Pos.start = t->start;
+				op.Pos.end = t->end;
+			}
+			emit(e, op);
+			break;
+		default:
+			emit(e, op);
+			break;
+		}
+	}
+}
+
+/* Small bodies are inlined as long as that neither changes side effects nor
+ * duplicates the work of computing an argument. */
+static bool can_inline(Expr *e, const UserFunc *u) {
+	Prog *p = &e->prog;
+	if (u->body.ops_len > INLINE_MAX_OPS || u->body.ranges_len > 0)
+		return false;
+	for (size_t i = 0; i < u->body.funcs_len; i++) {
+		if (u->body.funcs[i].impure)
+			return false;
+	}
+	size_t base = p->stack_len - u->n_params;
+	for (size_t i = 0; i < u->n_params; i++) {
+		size_t start = e->op_starts[base + i];
+		size_t end = i + 1 < u->n_params ? e->op_starts[base + i + 1] : p->ops_len;
+		for (size_t j = start; j < end; j++) {
+			if ((p->ops[j].kind == OpCall || p->ops[j].kind == OpCallUser) && p->funcs[p->ops[j].arg].impure)
+				return false;
+			if (p->ops[j].kind == OpReduce && p->ranges[p->ops[j].arg]->impure)
+				return false;
+		}
+		size_t uses = 0;
+		for (size_t j = 0; j < u->body.ops_len; j++)
+			uses += u->body.ops[j].kind == OpArg && u->body.ops[j].arg == i;
+		if (uses > 1 && end - start > 1)
+			return false;
+	}
+	return true;
+}
+
+static OpKind binary_op(char op) {
+	switch (op) {
+	case '+': return OpAdd;
+	case '-': return OpSub;
+	case '*': return OpMul;
+	case '/': return OpDiv;
+	default:  return OpPow;
+	}
+}
+
+/* Combines the two values on top of the stack for the variadic function f. */
+static void compile_combine(Expr *e, Func f, Tok *t) {
+	if (f.func == fn_sum || f.func == fn_mean)
+		emit(e, (Op){.kind = OpAdd});
+	else if (f.func == fn_prod)
+		emit(e, (Op){.kind = OpMul});
+	else
+		compile_call(e, f, t);
+}
+
+/* Returns the index of the ')' closing the call whose '(' is at i if it has
+ * the three arguments after "i =" of a range reduction, else 0. */
+static size_t find_range_end(Expr *e, size_t i) {
+	size_t depth = 0, n_commas = 0;
+	for (i++; ; i++) {
+		Tok *t = &e->toks[i];
+		if (t->kind != TokOp)
+			continue;
+		if (t->Char == '(')
+			depth++;
+		else if (t->Char == ')' && depth-- == 0)
+			return n_commas == 2 ? i : 0;
+		else if (t->Char == ',' && depth == 0 && ++n_commas > 2)
+			return 0;
+	}
+}
+
+/* Compiles the body of the range reduction on top of the frame stack into a
+ * program of its own and emits the reduction; *i is at the ',' before the
+ * body. */
+static ExprError compile_range(Expr *e, size_t *i, bool *want_operand) {
+	Frame f = e->frames[e->frames_len - 1];
+	e->frames_len--;
+
+	/* The index is passed to the body like a parameter, behind those of the
+	 * function being compiled. */
+	const Tok *saved_params = e->params;
+	size_t n_args = e->n_params;
+	Tok *params = malloc(sizeof(Tok) * (n_args + 1));
+	if (n_args > 0)
+		memcpy(params, saved_params, sizeof(Tok) * n_args);
+	params[n_args] = f.tok[2];
+
+	Prog saved = e->prog;
+	size_t *saved_starts = e->op_starts;
+	size_t saved_starts_cap = e->op_starts_cap;
+	e->prog = (Prog){0};
+	e->op_starts = NULL;
+	e->op_starts_cap = 0;
+	e->params = params;
+	e->n_params = n_args + 1;
+	size_t j = *i + 1;
+	ExprError err = compile_toks(e, &j);
+	Range *r = malloc(sizeof(Range));
+	r->body = e->prog;
+	free(e->op_starts);
+	e->prog = saved;
+	e->op_starts = saved_starts;
+	e->op_starts_cap = saved_starts_cap;
+	e->params = saved_params;
+	e->n_params = n_args;
+	free(params);
+	if (err.err != NULL) {
+		prog_free(&r->body);
+		free(r);
+		return err;
+	}
+
+	/* Variables of the body are inputs of the whole program. */
+	for (size_t k = 0; k < r->body.vars_len; k++) {
+		const ProgVar *pv = &r->body.vars[k];
+		Tok t = {.start = pv->start, .end = pv->end};
+		prog_add_var(e, get_var(e, pv->name, strlen(pv->name)), &t);
+	}
+
+	r->n_args = n_args;
+	range_init(r, f.func);
+	emit(e, (Op){.kind = OpReduce, .arg = prog_add_range(e, r), .Pos = {f.tok->start, f.tok->end}});
+	*i = j + 1;
+	*want_operand = false;
+	return (ExprError){0};
+}
+
+/* Sets up r, whose body and n_args are set, to combine the values of the body
+ * with the variadic builtin f. */
+static void range_init(Range *r, Func f) {
+	r->combine = f;
+	r->mean = f.func == fn_mean;
+	if (r->mean) {
+		r->combine.func = fn_sum;
+		r->combine.vfunc = vfn_sum;
+		r->combine.dfunc = dfn_sum;
+		r->combine.ifunc = ifn_sum;
+	}
+	r->empty = f.func == fn_sum || f.func == fn_hypot ? 0.0 : f.func == fn_prod ? 1.0 : NAN;
+	r->impure = false;
+	for (size_t k = 0; k < r->body.funcs_len; k++)
+		r->impure |= r->body.funcs[k].impure;
+	for (size_t k = 0; k < r->body.ranges_len; k++)
+		r->impure |= r->body.ranges[k]->impure;
+	r->batch = batch_parallel_ok(&r->body);
+	for (size_t k = 0; k < r->body.ops_len; k++) {
+		if (r->body.ops[k].kind == OpArg && r->body.ops[k].arg != r->n_args)
+			r->batch = false;
+	}
+}
+
+/* Compiles the expression starting at token *i, up to the ')' closing the
+ * parenthesis it is in, at which *i is left. */
+static ExprError compile_toks(Expr *e, size_t *i) {
+	/* Shunting-yard parser; pending operators are kept in e->frames instead
+	 * of on the call stack, so nesting depth is only limited by memory. */
+	size_t base = e->frames_len;
+	push_frame(e, (Frame){.kind = FrameParen});
+	bool want_operand = true;
+	while (e->frames_len > base) {
+		Tok *t = &e->toks[*i];
+
+		if (want_operand) {
+			if (t->kind == TokOp && t->Char == '-') {
+				/* Minus factor; binds tighter than any binary operator. */
+				Tok *next = t + 1;
+				if (next->kind == TokOp && next->Char != '(' && next->Char != '-')
+					return (ExprError){.start = next->start, .end = next->end, .err = "invalid expression after minus factor"};
+				push_frame(e, (Frame){.kind = FrameNeg});
+				(*i)++;
+			} else if (t->kind == TokOp && t->Char == '(') {
+				push_frame(e, (Frame){.kind = FrameParen});
+				(*i)++;
+			} else if (t->kind == TokNum) {
+				emit(e, (Op){.kind = OpNum, .Num = t->Num});
+				want_operand = false;
+				(*i)++;
+			} else if (t->kind == TokIdent && !(t[1].kind == TokOp && t[1].Char == '(')) {
+				compile_var(e, t->Str, t->Len, t);
+				want_operand = false;
+				(*i)++;
+			} else if (t->kind == TokIdent) {
+				Func func = get_func(e, t->Str, t->Len);
+				if (func.name == NULL)
+					return (ExprError){.start = t->start, .end = t->end, .err = "unknown function"};
+				/* f(i = from, to, body) with a variadic f is a range
+				 * reduction; the index i isn't compiled as an argument.
+				 * No other call has an '=' in it. */
+				size_t range_end = 0;
+				if (func.variadic && t[2].kind == TokIdent && t[3].kind == TokOp && t[3].Char == '=') {
+					range_end = find_range_end(e, *i + 1);
+					if (range_end == 0)
+						return (ExprError){.start = t->start, .end = t->end, .err = "expected range like f(i = from, to, body)"};
+				}
+				push_frame(e, (Frame){.kind = FrameCall, .tok = t, .func = func, .range_end = range_end});
+				(*i)++;
+				if (range_end != 0) {
+					e->frames[e->frames_len - 1].n_args = 1;
+					*i += 2;
+				}
+				TRY(compile_arg(e, i, &want_operand));
+			} else
+				return (ExprError){.start = t->start, .end = t->end, .err = "unexpected token"};
+			continue;
+		}
+
+		if (t->kind != TokOp)
+			return (ExprError){.start = t->start, .end = t->end, .err = "unexpected token"};
+
+		/* Apply pending operators which bind at least as tightly as this one;
+		 * right-associative operators leave those of equal precedence. */
+		const uint8_t prec = OP_PREC(t->Char);
+		while (1) {
+			Frame *f = &e->frames[e->frames_len - 1];
+			if (f->kind == FrameNeg)
+				emit(e, (Op){.kind = OpNeg});
+			else if (f->kind == FrameOp && (OP_PREC(f->op) > prec || (OP_PREC(f->op) == prec && OP_ORDER(t->Char) == OrderLtr)))
+				emit(e, (Op){.kind = binary_op(f->op)});
+			else
+				break;
+			e->frames_len--;
+		}
+
+		if (prec > 0) {
+			push_frame(e, (Frame){.kind = FrameOp, .op = t->Char});
+			want_operand = true;
+			(*i)++;
+			continue;
+		}
+
+		/* Delimiter closing a parenthesis or function argument. */
+		Frame *f = &e->frames[e->frames_len - 1];
+		if (f->kind == FrameParen) {
+			if (t->Char != ')')
+				return (ExprError){.start = t->start, .end = t->end, .err = "unexpected token"};
+			e->frames_len--;
+			if (e->frames_len > base)
+				(*i)++;
+		} else {
+			f->n_args++;
+			if (f->range_end != 0 && f->n_args == 3)
+				TRY(compile_range(e, i, &want_operand))
+			else if (t->Char == ',') {
+				/* Variadic functions combine their arguments as they come. */
+				if (f->func.variadic && f->range_end == 0 && f->n_args >= 2)
+					compile_combine(e, f->func, f->tok);
+				TRY(compile_arg(e, i, &want_operand))
+			} else if (t->Char == ')' && f->func.variadic && f->range_end == 0) {
+				if (f->n_args >= 2)
+					compile_combine(e, f->func, f->tok);
+				if (f->func.func == fn_mean && f->n_args >= 2) {
+					emit(e, (Op){.kind = OpNum, .Num = f->n_args});
+					emit(e, (Op){.kind = OpDiv});
+				} else if (f->func.func == fn_hypot && f->n_args == 1) {
+					emit(e, (Op){.kind = OpNum, .Num = 0.0});
+					compile_combine(e, f->func, f->tok);
+				}
+				e->frames_len--;
+				(*i)++;
+			} else if (t->Char == ')') {
+				if (f->n_args != f->func.n_args)
+					return (ExprError){.start = f->tok->start, .end = f->tok->end, .err = "invalid number of arguments to function"};
+				compile_call(e, f->func, f->tok);
+				e->frames_len--;
+				(*i)++;
+			} else
+				return (ExprError){.start = t->start, .end = t->end, .err = "unexpected token"};
+		}
+	}
+	return (ExprError){0};
+}
+
+static ExprError compile(Expr *e) {
+	Prog *p = &e->prog;
+	jit_free(p);
+	prog_free_ranges(p);
+	p->ops_len = 0;
+	p->vars_len = 0;
+	p->strs_len = 0;
+	p->funcs_len = 0;
+	p->stack_len = 0;
+	p->stack_cap = 0;
+	p->impure_seen = false;
+	p->folds_consts = false;
+	p->runs_bodies = false;
+	p->consts_gen = current_consts_gen(e);
+	p->names_gen = e->names_gen;
+
+	if (++e->prog_stamp == 0) {
+		/* Stamps wrapped around; forget all old ones. */
+		for (size_t i = 0; i < e->vars.cap; i++)
+			((Var*)e->vars.entries)[i].prog_stamp = 0;
+		e->prog_stamp = 1;
+	}
+
+	/* Folding calls functions on their arguments on the stack. */
+	if (e->scratch.stack_cap < e->toks_len) {
+		e->scratch.stack = realloc(e->scratch.stack, sizeof(ExprArg) * e->toks_len);
+		e->scratch.stack_cap = e->toks_len;
+	}
+
+	/* The whole expression is wrapped in parentheses by the tokenizer. */
+	e->frames_len = 0;
+	size_t i = 1;
+	TRY(compile_toks(e, &i));
+	if (i != e->toks_len - 1)
+		return (ExprError){.start = e->toks[i].start, .end = e->toks[i].end, .err = "unexpected token"};
+
+	scratch_reserve(&e->scratch, p, false);
+	return (ExprError){0};
+}
+
+static ExprError prog_refresh(Expr *e) {
+	if (e->cur->ops_len == 0)
+		return (ExprError){.err = "no expression set"};
+	if (!prog_outdated(e, e->cur))
+		return (ExprError){0};
+	/* Programs from a file are bound to the names again, not recompiled. */
+	if (e->cur == &e->file_prog)
+		return expr_set_from_file(e, e->file, e->file_expr);
+	return expr_set(e, e->src);
+}
+
+/* Compiles the expression again without folding constants if one of them is
+ * given a value of its own, like a batch column named after it, or with all,
+ * by any input. The program is kept that way, as the same inputs are usually
+ * given again. */
+static ExprError prog_unfold(Expr *e, const double **var_columns, bool all) {
+	const Prog *p = e->cur;
+	if (!p->folds_consts)
+		return (ExprError){0};
+	bool given = false;
+	for (size_t i = 0; i < p->vars_len && !given; i++)
+		given = p->vars[i].slot->constant && (all || (var_columns != NULL && var_columns[i] != NULL));
+	if (!given)
+		return (ExprError){0};
+	e->keep_consts = true;
+	ExprError err = expr_set(e, e->src);
+	e->keep_consts = false;
+	return err;
+}
+
+static bool prog_outdated(Expr *e, const Prog *p) {
+	return (p->folds_consts && p->consts_gen != current_consts_gen(e)) || p->names_gen != e->names_gen;
+}
+
+/* Changes whenever a constant of either the Expr or its environment does. */
+static uint32_t current_consts_gen(Expr *e) {
+	return e->consts_gen + atomic_load_explicit(&e->env->consts_gen, memory_order_acquire);
+}
+
+static void *memdup(const void *src, size_t size) {
+	if (size == 0)
+		return NULL;
+	void *res = malloc(size);
+	memcpy(res, src, size);
+	return res;
+}
+
+static void prog_copy(Prog *dst, const Prog *src) {
+	*dst = *src;
+	dst->ops = memdup(src->ops, sizeof(Op) * src->ops_len);
+	dst->ops_cap = src->ops_len;
+	dst->vars = memdup(src->vars, sizeof(ProgVar) * src->vars_len);
+	dst->vars_cap = src->vars_len;
+	dst->funcs = memdup(src->funcs, sizeof(Func) * src->funcs_len);
+	dst->funcs_cap = src->funcs_len;
+
+	/* The strings live in the arena of the Expr, so copy them into a single
+	 * block right behind the pointers to them. */
+	size_t size = sizeof(char*) * src->strs_len;
+	for (size_t i = 0; i < src->strs_len; i++)
+		size += strlen(src->strs[i]) + 1;
+	dst->strs = malloc(size);
+	char *str = (char*)(dst->strs + src->strs_len);
+	for (size_t i = 0; i < src->strs_len; i++) {
+		size_t len = strlen(src->strs[i]) + 1;
+		memcpy(str, src->strs[i], len);
+		dst->strs[i] = str;
+		str += len;
+	}
+	dst->strs_cap = src->strs_len;
+
+	dst->ranges = memdup(src->ranges, sizeof(Range*) * src->ranges_len);
+	dst->ranges_cap = src->ranges_len;
+	for (size_t i = 0; i < src->ranges_len; i++) {
+		dst->ranges[i] = memdup(src->ranges[i], sizeof(Range));
+		prog_copy(&dst->ranges[i]->body, &src->ranges[i]->body);
+	}
+
+	dst->mapped = false;
+	dst->jit = NULL;
+	dst->jit_mem = NULL;
+}
+
+/* Appends size bytes of data, or zeros if it is NULL, at a multiple of align
+ * and returns their offset. */
+static uint32_t qcb_add(ExprFileWriter *w, const void *data, size_t size, size_t align) {
+	size_t off = (w->len + align - 1) & ~(align - 1);
+	if (off + size > w->cap) {
+		while (off + size > w->cap)
+			w->cap = w->cap == 0 ? 4096 : w->cap * 2;
+		w->data = realloc(w->data, w->cap);
+	}
+	memset(w->data + w->len, 0, off - w->len);
+	if (data != NULL)
+		memcpy(w->data + off, data, size);
+	else
+		memset(w->data + off, 0, size);
+	w->len = off + size;
+	return off;
+}
+
+static uint32_t qcb_add_str(ExprFileWriter *w, const char *s) {
+	return qcb_add(w, s, strlen(s) + 1, 1);
+}
+
+/* Writes p, taking n_params arguments, behind the bodies it runs and returns
+ * its index in *out_idx. Returns false if it calls a function set with
+ * expr_set_func(), which can't be saved. */
+static bool qcb_write_prog(ExprFileWriter *w, const Prog *p, uint32_t n_params, uint32_t *out_idx) {
+	/* The index of the body of each user function and range reduction. */
+	uint32_t *bodies = malloc(sizeof(uint32_t) * (p->funcs_len + p->ranges_len) + 1);
+	bool ok = true;
+	for (size_t i = 0; ok && i < p->funcs_len; i++) {
+		const UserFunc *u = p->funcs[i].user;
+		if (u == NULL) {
+			ok = p->funcs[i].builtin != 0;
+			continue;
+		}
+		size_t j = 0;
+		while (j < w->users_len && w->users[j] != u)
+			j++;
+		if (j == w->users_len) {
+			if (!qcb_write_prog(w, &u->body, u->n_params, &bodies[i]))
+				ok = false;
+			if (w->users_len >= w->users_cap) {
+				w->users_cap = w->users_cap == 0 ? 16 : w->users_cap * 2;
+				w->users = realloc(w->users, sizeof(UserFunc*) * w->users_cap);
+				w->user_progs = realloc(w->user_progs, sizeof(uint32_t) * w->users_cap);
+			}
+			w->users[w->users_len] = u;
+			w->user_progs[w->users_len++] = bodies[i];
+		} else
+			bodies[i] = w->user_progs[j];
+	}
+	for (size_t i = 0; ok && i < p->ranges_len; i++)
+		ok = qcb_write_prog(w, &p->ranges[i]->body, n_params + 1, &bodies[p->funcs_len + i]);
+	if (!ok) {
+		free(bodies);
+		return false;
+	}
+
+	QcbProg q = {.n_params = n_params};
+	q.n_ops = p->ops_len;
+	q.ops = qcb_add(w, p->ops, sizeof(Op) * p->ops_len, 8);
+	/* Entries are copied in one by one, as adding their strings may move
+	 * w->data. */
+	q.n_vars = p->vars_len;
+	q.vars = qcb_add(w, NULL, sizeof(QcbVar) * p->vars_len, 4);
+	for (size_t i = 0; i < p->vars_len; i++) {
+		QcbVar v = {.name = qcb_add_str(w, p->vars[i].name), .start = p->vars[i].start, .end = p->vars[i].end};
+		memcpy(w->data + q.vars + sizeof(QcbVar) * i, &v, sizeof(QcbVar));
+	}
+	q.n_strs = p->strs_len;
+	q.strs = qcb_add(w, NULL, sizeof(uint32_t) * p->strs_len, 4);
+	for (size_t i = 0; i < p->strs_len; i++) {
+		uint32_t str = qcb_add_str(w, p->strs[i]);
+		memcpy(w->data + q.strs + sizeof(uint32_t) * i, &str, sizeof(uint32_t));
+	}
+	q.n_funcs = p->funcs_len;
+	q.funcs = qcb_add(w, NULL, sizeof(QcbFunc) * p->funcs_len, 4);
+	for (size_t i = 0; i < p->funcs_len; i++) {
+		const Func *f = &p->funcs[i];
+		QcbFunc qf = {
+			.name = qcb_add_str(w, f->user != NULL ? f->name : _builtin_funcs[f->builtin - 1].name),
+			.body = f->user != NULL ? (int32_t)bodies[i] : -1,
+			.n_args = f->n_args,
+		};
+		memcpy(w->data + q.funcs + sizeof(QcbFunc) * i, &qf, sizeof(QcbFunc));
+	}
+	q.n_ranges = p->ranges_len;
+	q.ranges = qcb_add(w, NULL, sizeof(QcbRange) * p->ranges_len, 4);
+	for (size_t i = 0; i < p->ranges_len; i++) {
+		QcbRange qr = {.combine = qcb_add_str(w, _builtin_funcs[p->ranges[i]->combine.builtin - 1].name), .body = bodies[p->funcs_len + i]};
+		memcpy(w->data + q.ranges + sizeof(QcbRange) * i, &qr, sizeof(QcbRange));
+	}
+	free(bodies);
+
+	if (w->progs_len >= w->progs_cap) {
+		w->progs_cap = w->progs_cap == 0 ? 16 : w->progs_cap * 2;
+		w->progs = realloc(w->progs, sizeof(QcbProg) * w->progs_cap);
+	}
+	*out_idx = w->progs_len;
+	w->progs[w->progs_len++] = q;
+	return true;
+}
+
+/* The n elements of size bytes at off in f, or NULL if they aren't within f
+ * or aligned to align. */
+static const void *file_at(const ExprFile *f, uint32_t off, uint32_t n, size_t size, size_t align) {
+	if (off % align != 0 || off > f->size || (f->size - off) / size < n)
+		return NULL;
+	return f->data + off;
+}
+
+/* The string at off in f, or NULL if it isn't terminated within f. */
+static const char *file_str(const ExprFile *f, uint32_t off) {
+	if (off >= f->size || memchr(f->data + off, 0, f->size - off) == NULL)
+		return NULL;
+	return f->data + off;
+}
+
+/* Checks the whole file up front, so loading and running its programs can
+ * trust it like compiled ones. */
+static bool file_check(ExprFile *f) {
+	const QcbHeader *h = f->header;
+	if (memcmp(h->magic, QCB_MAGIC, 4) != 0 || h->version != QCB_VERSION || h->byte_order != QCB_BYTE_ORDER ||
+			h->op_size != sizeof(Op) || h->size != f->size)
+		return false;
+	f->exprs = file_at(f, h->exprs, h->n_exprs, sizeof(QcbExpr), 4);
+	f->progs = file_at(f, h->progs, h->n_progs, sizeof(QcbProg), 4);
+	if (f->exprs == NULL || f->progs == NULL)
+		return false;
+	/* Bodies come first, so the stack they need is known when checking the
+	 * programs running them. */
+	f->stack_caps = malloc(sizeof(size_t) * h->n_progs + 1);
+	for (uint32_t k = 0; k < h->n_progs; k++) {
+		if (!file_check_prog(f, k))
+			return false;
+	}
+	for (uint32_t i = 0; i < h->n_exprs; i++) {
+		if (file_str(f, f->exprs[i].src) == NULL || f->exprs[i].prog >= h->n_progs || f->progs[f->exprs[i].prog].n_params != 0)
+			return false;
+	}
+	return true;
+}
+
+/* Checks that program k only refers to what f holds and never takes more from
+ * the stack than it pushed, and finds the stack depth it needs. */
+static bool file_check_prog(ExprFile *f, uint32_t k) {
+	const QcbProg *q = &f->progs[k];
+	const Op *ops = file_at(f, q->ops, q->n_ops, sizeof(Op), 8);
+	const QcbVar *vars = file_at(f, q->vars, q->n_vars, sizeof(QcbVar), 4);
+	const uint32_t *strs = file_at(f, q->strs, q->n_strs, sizeof(uint32_t), 4);
+	const QcbFunc *funcs = file_at(f, q->funcs, q->n_funcs, sizeof(QcbFunc), 4);
+	const QcbRange *ranges = file_at(f, q->ranges, q->n_ranges, sizeof(QcbRange), 4);
+	if (ops == NULL || vars == NULL || strs == NULL || funcs == NULL || ranges == NULL)
+		return false;
+	for (uint32_t i = 0; i < q->n_vars; i++) {
+		if (file_str(f, vars[i].name) == NULL)
+			return false;
+	}
+	for (uint32_t i = 0; i < q->n_strs; i++) {
+		if (file_str(f, strs[i]) == NULL)
+			return false;
+	}
+	for (uint32_t i = 0; i < q->n_funcs; i++) {
+		const char *name = file_str(f, funcs[i].name);
+		if (name == NULL)
+			return false;
+		int32_t body = funcs[i].body;
+		if (body < 0) {
+			int b = builtin_func_idx(name, strlen(name));
+			if (b < 0 || _builtin_funcs[b].n_args != funcs[i].n_args)
+				return false;
+		} else if ((uint32_t)body >= k || f->progs[body].n_params != funcs[i].n_args)
+			return false;
+	}
+	for (uint32_t i = 0; i < q->n_ranges; i++) {
+		const char *name = file_str(f, ranges[i].combine);
+		int b = name != NULL ? builtin_func_idx(name, strlen(name)) : -1;
+		if (b < 0 || !_builtin_funcs[b].variadic || ranges[i].body >= k || f->progs[ranges[i].body].n_params != q->n_params + 1)
+			return false;
+	}
+
+	/* Each instruction pushes at most one entry, so the stack never gets
+	 * deeper than n_ops. Only builtins taking strings get them. */
+	bool *is_str = malloc(sizeof(bool) * q->n_ops + 1);
+	size_t depth = 0, need = 0;
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < q->n_ops; i++) {
+		Op op = ops[i];
+		const ExprArgType *arg_types = NULL;
+		size_t n_in = 0;
+		switch (op.kind) {
+		case OpNum:
+			break;
+		case OpVar:
+			ok = op.arg < q->n_vars;
+			break;
+		case OpStr:
+			ok = op.arg < q->n_strs;
+			break;
+		case OpArg:
+			ok = op.arg < q->n_params;
+			break;
+		case OpNeg:
+		case OpSqr:
+			n_in = 1;
+			break;
+		case OpAdd:
+		case OpSub:
+		case OpMul:
+		case OpDiv:
+		case OpPow:
+			n_in = 2;
+			break;
+		case OpCall:
+		case OpCallUser:
+			ok = op.arg < q->n_funcs && (funcs[op.arg].body < 0) == (op.kind == OpCall);
+			if (!ok)
+				break;
+			n_in = funcs[op.arg].n_args;
+			if (op.kind == OpCall) {
+				const char *name = f->data + funcs[op.arg].name;
+				arg_types = _builtin_funcs[builtin_func_idx(name, strlen(name))].arg_types;
+			} else if (depth + f->stack_caps[funcs[op.arg].body] > need)
+				need = depth + f->stack_caps[funcs[op.arg].body];
+			break;
+		case OpReduce:
+			ok = op.arg < q->n_ranges && depth >= 2;
+			n_in = 2;
+			if (ok && depth - 2 + q->n_params + 1 + f->stack_caps[ranges[op.arg].body] > need)
+				need = depth - 2 + q->n_params + 1 + f->stack_caps[ranges[op.arg].body];
+			break;
+		default:
+			ok = false;
+			break;
+		}
+		if (!ok || depth < n_in)
+			ok = false;
+		for (size_t j = 0; ok && j < n_in; j++)
+			ok = is_str[depth - n_in + j] == (arg_types != NULL && arg_types[j] == ExprArgTypeStr);
+		if (!ok)
+			break;
+		depth -= n_in;
+		is_str[depth++] = op.kind == OpStr;
+		if (depth > need)
+			need = depth;
+	}
+	ok &= depth == 1 && !is_str[0];
+	free(is_str);
+	f->stack_caps[k] = need;
+	return ok;
+}
+
+/* Binds program k of e->file to the variables and functions of e as p, whose
+ * instructions stay in the file. */
+static void file_load_prog(Expr *e, uint32_t k, Prog *p) {
+	const ExprFile *f = e->file;
+	const QcbProg *q = &f->progs[k];
+	*p = (Prog){
+		.ops = (Op*)(f->data + q->ops),
+		.ops_len = q->n_ops,
+		.ops_cap = q->n_ops,
+		.vars = malloc(sizeof(ProgVar) * q->n_vars + 1),
+		.vars_len = q->n_vars,
+		.vars_cap = q->n_vars,
+		.strs = malloc(sizeof(char*) * q->n_strs + 1),
+		.strs_len = q->n_strs,
+		.strs_cap = q->n_strs,
+		.funcs = malloc(sizeof(Func) * q->n_funcs + 1),
+		.funcs_len = q->n_funcs,
+		.funcs_cap = q->n_funcs,
+		.ranges = malloc(sizeof(Range*) * q->n_ranges + 1),
+		.ranges_len = q->n_ranges,
+		.ranges_cap = q->n_ranges,
+		.stack_cap = f->stack_caps[k],
+		.consts_gen = current_consts_gen(e),
+		.names_gen = e->names_gen,
+		.mapped = true,
+	};
+
+	const QcbVar *vars = (const QcbVar*)(f->data + q->vars);
+	for (uint32_t i = 0; i < q->n_vars; i++) {
+		const char *name = f->data + vars[i].name;
+		Var *v = get_var(e, name, strlen(name));
+		p->vars[i] = (ProgVar){.slot = v->slot, .name = v->name, .start = vars[i].start, .end = vars[i].end, .shared = v->shared};
+	}
+	const uint32_t *strs = (const uint32_t*)(f->data + q->strs);
+	for (uint32_t i = 0; i < q->n_strs; i++)
+		p->strs[i] = (char*)(f->data + strs[i]);
+	const QcbFunc *funcs = (const QcbFunc*)(f->data + q->funcs);
+	for (uint32_t i = 0; i < q->n_funcs; i++) {
+		const char *name = f->data + funcs[i].name;
+		if (funcs[i].body < 0) {
+			p->funcs[i] = builtin_func(builtin_func_idx(name, strlen(name)));
+			continue;
+		}
+		UserFunc *u = file_user_func(e, funcs[i].body);
+		p->funcs[i] = (Func){.name = (char*)name, .arg_types = u->arg_types, .n_args = u->n_params, .impure = prog_impure(&u->body), .user = u};
+		p->runs_bodies = true;
+	}
+	const QcbRange *ranges = (const QcbRange*)(f->data + q->ranges);
+	for (uint32_t i = 0; i < q->n_ranges; i++) {
+		const char *name = f->data + ranges[i].combine;
+		Range *r = malloc(sizeof(Range));
+		r->n_args = q->n_params;
+		file_load_prog(e, ranges[i].body, &r->body);
+		range_init(r, builtin_func(builtin_func_idx(name, strlen(name))));
+		p->ranges[i] = r;
+		p->runs_bodies = true;
+	}
+}
+
+/* The user function whose body is program k of e->file, loaded on first use. */
+static UserFunc *file_user_func(Expr *e, uint32_t k) {
+	if (e->file_funcs[k] != NULL)
+		return e->file_funcs[k];
+	UserFunc *u = malloc(sizeof(UserFunc));
+	u->next = NULL;
+	u->n_params = e->file->progs[k].n_params;
+	u->arg_types = malloc(sizeof(ExprArgType) * u->n_params + 1);
+	for (size_t i = 0; i < u->n_params; i++)
+		u->arg_types[i] = ExprArgTypeNum;
+	file_load_prog(e, k, &u->body);
+	e->file_funcs[k] = u;
+	return u;
+}
+
+static void file_funcs_free(Expr *e) {
+	for (size_t k = 0; k < e->file_funcs_len; k++) {
+		UserFunc *u = e->file_funcs[k];
+		if (u == NULL)
+			continue;
+		prog_free(&u->body);
+		free(u->arg_types);
+		free(u);
+	}
+	free(e->file_funcs);
+	e->file_funcs = NULL;
+	e->file_funcs_len = 0;
+}
+
+/* Keeps a copy of the source of the current expression, in case the program
+ * has to be made again. */
+static void set_src(Expr *e, const char *src, size_t len) {
+	if (len + 1 > e->src_cap) {
+		free(e->src);
+		e->src_cap = len + 1;
+		e->src = malloc(e->src_cap);
+	}
+	memcpy(e->src, src, len);
+	e->src[len] = 0;
+}
+
+/* The user function of the clone res corresponding to u of e. */
+static UserFunc *clone_user_func(Expr *res, Expr *e, UserFunc *u) {
+	UserFunc *v = e->user_funcs, *w = res->user_funcs;
+	while (v != u) {
+		v = v->next;
+		w = w->next;
+	}
+	return w;
+}
+
+/* Whether any program of e refers to a variable or function by the string
+ * name, which is one of e's tables. */
+static bool name_in_use(Expr *e, const char *name) {
+	if (prog_uses_name(&e->prog, name) || prog_uses_name(&e->file_prog, name))
+		return true;
+	for (CacheEntry *c = e->cache.lru_first; c != NULL; c = c->lru_next) {
+		if (prog_uses_name(&c->prog, name))
+			return true;
+	}
+	for (UserFunc *u = e->user_funcs; u != NULL; u = u->next) {
+		if (prog_uses_name(&u->body, name))
+			return true;
+	}
+	for (size_t k = 0; k < e->file_funcs_len; k++) {
+		if (e->file_funcs[k] != NULL && prog_uses_name(&e->file_funcs[k]->body, name))
+			return true;
+	}
+	for (size_t i = 0; i < e->formulas_len; i++) {
+		if (e->formulas[i]->name == name || prog_uses_name(&e->formulas[i]->prog, name))
+			return true;
+	}
+	return false;
+}
+
+static bool prog_uses_name(const Prog *p, const char *name) {
+	for (size_t i = 0; i < p->vars_len; i++) {
+		if (p->vars[i].name == name)
+			return true;
+	}
+	for (size_t i = 0; i < p->funcs_len; i++) {
+		if (p->funcs[i].name == name)
+			return true;
+	}
+	for (size_t i = 0; i < p->ranges_len; i++) {
+		if (p->ranges[i]->combine.name == name || prog_uses_name(&p->ranges[i]->body, name))
+			return true;
+	}
+	return false;
+}
+
+/* Points a program copied from e to the variables and functions of its clone
+ * res. */
+static void prog_rebind(Expr *res, Expr *e, Prog *p) {
+	for (size_t i = 0; i < p->vars_len; i++) {
+		ProgVar *pv = &p->vars[i];
+		Var *v = &((Var*)res->vars.entries)[smap_idx(&e->vars, pv->name, strlen(pv->name), sizeof(Var))];
+		pv->name = v->name;
+		if (!pv->shared)
+			pv->slot = v->slot;
+	}
+	for (size_t i = 0; i < p->funcs_len; i++) {
+		Func *f = &p->funcs[i];
+		size_t idx = smap_idx(&e->funcs, f->name, strlen(f->name), sizeof(Func));
+		if (idx != SIZE_MAX && ((Func*)e->funcs.entries)[idx].name == f->name)
+			f->name = ((Func*)res->funcs.entries)[idx].name;
+		if (f->user != NULL) {
+			f->user = clone_user_func(res, e, f->user);
+			f->arg_types = f->user->arg_types;
+		}
+	}
+	for (size_t i = 0; i < p->ranges_len; i++)
+		prog_rebind(res, e, &p->ranges[i]->body);
+}
+
+static void prog_free(Prog *p) {
+	jit_free(p);
+	prog_free_ranges(p);
+	if (!p->mapped)
+		free(p->ops);
+	free(p->vars);
+	free(p->strs);
+	free(p->funcs);
+	free(p->ranges);
+}
+
+static void prog_free_ranges(Prog *p) {
+	for (size_t i = 0; i < p->ranges_len; i++) {
+		prog_free(&p->ranges[i]->body);
+		free(p->ranges[i]);
+	}
+	p->ranges_len = 0;
+}
+
+static CacheEntry *cache_get(Cache *c, const char *src, uint32_t hash) {
+	for (CacheEntry *ent = c->buckets[hash & (c->n_buckets - 1)]; ent != NULL; ent = ent->bucket_next) {
+		if (ent->hash == hash && strcmp(ent->src, src) == 0) {
+			/* Move to the front of the LRU list. */
+			if (ent != c->lru_first) {
+				ent->lru_prev->lru_next = ent->lru_next;
+				if (ent->lru_next != NULL)
+					ent->lru_next->lru_prev = ent->lru_prev;
+				else
+					c->lru_last = ent->lru_prev;
+				ent->lru_prev = NULL;
+				ent->lru_next = c->lru_first;
+				c->lru_first->lru_prev = ent;
+				c->lru_first = ent;
+			}
+			return ent;
+		}
+	}
+	return NULL;
+}
+
+static void cache_put(Cache *c, const char *src, uint32_t hash, const Prog *p) {
+	if (c->len == c->cap)
+		cache_remove(c, c->lru_last);
+
+	CacheEntry *ent = malloc(sizeof(CacheEntry));
+	ent->hash = hash;
+	ent->src = strdup(src);
+	prog_copy(&ent->prog, p);
+
+	size_t i = hash & (c->n_buckets - 1);
+	ent->bucket_next = c->buckets[i];
+	c->buckets[i] = ent;
+
+	ent->lru_prev = NULL;
+	ent->lru_next = c->lru_first;
+	if (c->lru_first != NULL)
+		c->lru_first->lru_prev = ent;
+	else
+		c->lru_last = ent;
+	c->lru_first = ent;
+	c->len++;
+}
+
+static void cache_remove(Cache *c, CacheEntry *ent) {
+	CacheEntry **link = &c->buckets[ent->hash & (c->n_buckets - 1)];
+	while (*link != ent)
+		link = &(*link)->bucket_next;
+	*link = ent->bucket_next;
+
+	if (ent->lru_prev != NULL)
+		ent->lru_prev->lru_next = ent->lru_next;
+	else
+		c->lru_first = ent->lru_next;
+	if (ent->lru_next != NULL)
+		ent->lru_next->lru_prev = ent->lru_prev;
+	else
+		c->lru_last = ent->lru_prev;
+	c->len--;
+
+	prog_free(&ent->prog);
+	free(ent->src);
+	free(ent);
+}
+
+static void scratch_reserve(Scratch *sc, const Prog *p, bool batch) {
+	if (p->stack_cap > sc->stack_cap) {
+		sc->stack = realloc(sc->stack, sizeof(ExprArg) * p->stack_cap);
+		sc->stack_cap = p->stack_cap;
+	}
+	if (batch && p->stack_cap > sc->batch_cap) {
+		free(sc->batch_bufs);
+		sc->batch_bufs = malloc(sizeof(double) * BATCH_BLOCK * p->stack_cap);
+		sc->batch_ptrs = realloc(sc->batch_ptrs, sizeof(double*) * p->stack_cap);
+		sc->batch_cap = p->stack_cap;
+	}
+}
+
+static void scratch_free(Scratch *sc) {
+	free(sc->stack);
+	free(sc->batch_bufs);
+	free(sc->batch_ptrs);
+	*sc = (Scratch){0};
+}
+
+static ExprError run(Expr *e, const Prog *p, Scratch *sc, double *out_res) {
+	TRY(run_stack(e, p, sc->stack, NULL));
+	*out_res = sc->stack[0].Num;
+	return (ExprError){0};
+}
+
+/* Runs the program on the stack s, leaving the result in s[0]. args are those
+ * of the user function p is the body of. */
+static ExprError run_stack(Expr *e, const Prog *p, ExprArg *s, const ExprArg *args) {
+	size_t sp = 0;
+	for (const Op *op = p->ops, *end = p->ops + p->ops_len; op != end; op++) {
+		switch (op->kind) {
+		case OpNum:
+			s[sp++].Num = op->Num;
+			break;
+		case OpVar: {
+			const ExprVar *v = p->vars[op->arg].slot;
+			if (!v->set)
+				return (ExprError){.start = p->vars[op->arg].start, .end = p->vars[op->arg].end, .err = "unknown variable"};
+			s[sp++].Num = v->val;
+			break;
+		}
+		case OpStr:
+			s[sp++].Str = p->strs[op->arg];
+			break;
+		case OpNeg:
+			s[sp-1].Num = -s[sp-1].Num;
+			break;
+		case OpSqr:
+			s[sp-1].Num = s[sp-1].Num * s[sp-1].Num;
+			break;
+		case OpAdd: sp--; s[sp-1].Num = s[sp-1].Num + s[sp].Num; break;
+		case OpSub: sp--; s[sp-1].Num = s[sp-1].Num - s[sp].Num; break;
+		case OpMul: sp--; s[sp-1].Num = s[sp-1].Num * s[sp].Num; break;
+		case OpDiv: sp--; s[sp-1].Num = s[sp-1].Num / s[sp].Num; break;
+		case OpPow: sp--; s[sp-1].Num = pow(s[sp-1].Num, s[sp].Num); break;
+		case OpCall: {
+			const Func *f = &p->funcs[op->arg];
+			STAT(stats.builtin_calls[f->builtin]++);
+			sp -= f->n_args;
+			s[sp].Num = f->func(e, s + sp);
+			sp++;
+			break;
+		}
+		case OpCallUser: {
+			const Func *f = &p->funcs[op->arg];
+			sp -= f->n_args;
+			ExprError err = run_stack(e, &f->user->body, s + sp + f->n_args, s + sp);
+			if (err.err != NULL)
+				return (ExprError){.start = op->Pos.start, .end = op->Pos.end, .err = err.err};
+			s[sp] = s[sp + f->n_args];
+			sp++;
+			break;
+		}
+		case OpArg:
+			s[sp++] = args[op->arg];
+			break;
+		case OpReduce: {
+			sp -= 2;
+			double from = s[sp].Num, span = s[sp + 1].Num - from;
+			/* Checked on the bits, as -ffinite-math-only makes isfinite()
+			 * always true. */
+			uint64_t bits;
+			memcpy(&bits, &span, sizeof(bits));
+			if ((bits >> 52 & 0x7ff) == 0x7ff)
+				return (ExprError){.start = op->Pos.start, .end = op->Pos.end, .err = "invalid range"};
+			TRY(run_range(e, p->ranges[op->arg], s + sp, args, from, span < 0.0 ? 0 : (size_t)span + 1, &s[sp].Num));
+			sp++;
+			break;
+		}
+		}
+	}
+	return (ExprError){0};
+}
+
+/* Combines the body of r for the n indices from, from + 1, ..., using the
+ * stack from s on. args are those of the user function r is part of. */
+static ExprError run_range(Expr *e, const Range *r, ExprArg *s, const ExprArg *args, double from, size_t n, double *out) {
+	if (n == 0) {
+		*out = r->empty;
+		return (ExprError){0};
+	}
+
+	double acc = 0.0;
+	if (r->batch) {
+		/* Evaluate the body for a block of indices at a time and combine
+		 * the results lane by lane, which the compiler vectorizes; the lanes
+		 * are only combined with each other at the end. */
+		Scratch *sc = &e->scratch;
+		scratch_reserve(sc, &r->body, true);
+		TRY(batch_check_vars(&r->body, NULL));
+		double index[BATCH_BLOCK], vals[BATCH_BLOCK], lanes[BATCH_BLOCK];
+		for (size_t k = 0; k < n; k += BATCH_BLOCK) {
+			size_t m = n - k < BATCH_BLOCK ? n - k : BATCH_BLOCK;
+			for (size_t j = 0; j < m; j++)
+				index[j] = from + (double)(k + j);
+			if (k == 0)
+				run_block(e, &r->body, sc, 0, m, NULL, index, lanes);
+			else {
+				run_block(e, &r->body, sc, 0, m, NULL, index, vals);
+				r->combine.vfunc(lanes, (const double*[]){lanes, vals}, m);
+			}
+		}
+		STAT(stats_count_calls(&r->body, n));
+		acc = lanes[0];
+		for (size_t j = 1; j < n && j < BATCH_BLOCK; j++)
+			acc = r->combine.func(e, (ExprArg[]){{.Num = acc}, {.Num = lanes[j]}});
+	} else {
+		/* The body's arguments go below its stack. */
+		if (r->n_args > 0)
+			memcpy(s, args, sizeof(ExprArg) * r->n_args);
+		ExprArg *body_s = s + r->n_args + 1;
+		for (size_t k = 0; k < n; k++) {
+			s[r->n_args].Num = from + (double)k;
+			TRY(run_stack(e, &r->body, body_s, s));
+			acc = k == 0 ? body_s[0].Num : r->combine.func(e, (ExprArg[]){{.Num = acc}, body_s[0]});
+		}
+	}
+	*out = r->mean ? acc / n : acc;
+	return (ExprError){0};
+}
+
+/* Whether the derivatives (or interval versions) of all functions p calls
+ * are known. */
+static bool funcs_support(const Prog *p, bool interval) {
+	for (size_t k = 0; k < p->funcs_len; k++) {
+		const Func *f = &p->funcs[k];
+		if (f->user != NULL) {
+			if (!funcs_support(&f->user->body, interval))
+				return false;
+		} else if (interval ? f->ifunc == NULL : f->dfunc == NULL || f->n_args > 2)
+			return false;
+	}
+	for (size_t k = 0; k < p->ranges_len; k++) {
+		const Range *r = p->ranges[k];
+		if ((interval ? r->combine.ifunc == NULL : r->combine.dfunc == NULL) || !funcs_support(&r->body, interval))
+			return false;
+	}
+	return true;
+}
+
+/* The input of the expression top which variable var of p is, or -1 if the
+ * variable is only read by the body p of a function. */
+static int prog_input(const Prog *top, const Prog *p, uint32_t var) {
+	if (p == top)
+		return var;
+	for (size_t k = 0; k < top->vars_len; k++) {
+		if (top->vars[k].slot == p->vars[var].slot)
+			return k;
+	}
+	return -1;
+}
 
-static size_t smap_get_idx(void *smap, const char *key, size_t type_size, size_t cap);
-static void *smap_get_for_setting(void **smap, const char *key, size_t type_size, size_t *len, size_t *cap);
-static void del_toks(Expr *e, Tok *start, Tok *end);
-static ExprError collapse(Expr *e, Tok *t) __attribute__((warn_unused_result));
-static ExprError eval(Expr *e, Tok *t, double *out_res) __attribute__((warn_unused_result));
-static uint32_t fnv1a32(const void *data, size_t n);
-static Func get_func(Expr *e, const char *name);
-static void push_tok(Expr *e, Tok t);
-static ExprError tokenize(Expr *e, const char *expr) __attribute__((warn_unused_result));
+/* Makes room for evaluating p with g->n_inputs inputs; the record grows as
+ * needed. */
+static void grad_reserve(Grad *g, const Prog *p) {
+	if (p->stack_cap > g->stack_cap) {
+		g->nodes = realloc(g->nodes, sizeof(uint32_t) * p->stack_cap);
+		g->zero = realloc(g->zero, sizeof(bool) * p->stack_cap);
+		g->stack_cap = p->stack_cap;
+	}
+	if (g->forward && g->stack_cap * g->n_inputs > g->tangents_cap) {
+		g->tangents_cap = g->stack_cap * g->n_inputs;
+		free(g->tangents);
+		g->tangents = malloc(sizeof(double) * g->tangents_cap);
+	}
+	if (!g->forward && g->n_inputs + 64 > g->tape_cap) {
+		g->tape_cap = g->n_inputs + 64;
+		g->tape = realloc(g->tape, sizeof(GradNode) * g->tape_cap);
+		g->adjoints = realloc(g->adjoints, sizeof(double) * g->tape_cap);
+	}
+}
 
-const static uint8_t op_prec[256] = {
-	['('] = 0, /* A precedence of 0 is reserved for delimiters. */
-	[')'] = 0,
-	[','] = 0,
-	['+'] = 1,
-	['-'] = 1,
-	['*'] = 2,
-	['/'] = 2,
-	['^'] = 3,
-};
-#define OP_PREC(tok_char) (op_prec[(size_t)tok_char])
+static void grad_free(Grad *g) {
+	free(g->tape);
+	free(g->adjoints);
+	free(g->nodes);
+	free(g->tangents);
+	free(g->zero);
+	*g = (Grad){0};
+}
 
-const static enum {
-	OrderLtr,
-	OrderRtl,
-} op_order[256] = {
-	['('] = OrderLtr,
-	[')'] = OrderLtr,
-	['+'] = OrderLtr,
-	['-'] = OrderLtr,
-	['*'] = OrderLtr,
-	['/'] = OrderLtr,
-	['^'] = OrderRtl,
-};
-#define OP_ORDER(tok_char) (op_order[(size_t)tok_char])
+static void grad_const(Grad *g, size_t slot) {
+	if (g->forward)
+		g->zero[slot] = true;
+	else
+		g->nodes[slot] = GRAD_CONST;
+}
 
-#define IS_NUM(c) (c >= '0' && c <= '9')
-#define IS_ALPHA(c) ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
-#define IS_SYMBOL(c) ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+static void grad_copy(Grad *g, size_t dst, size_t src) {
+	if (!g->forward) {
+		g->nodes[dst] = g->nodes[src];
+		return;
+	}
+	g->zero[dst] = g->zero[src];
+	if (!g->zero[src] && dst != src)
+		memcpy(g->tangents + dst * g->n_inputs, g->tangents + src * g->n_inputs, sizeof(double) * g->n_inputs);
+}
 
-Expr *expr_new() {
-	Expr *res = malloc(sizeof(Expr));
-	*res = (Expr){0};
-	for (size_t i = 0; i < expr_n_builtin_funcs; i++) {
-		expr_set_func(res, expr_builtin_funcs[i].name, expr_builtin_funcs[i].func, expr_builtin_funcs[i].arg_types, expr_builtin_funcs[i].n_args);
+/* Adds a node computed from the nodes a and b with the partial derivatives d,
+ * unless neither depends on the inputs. */
+static uint32_t grad_node(Grad *g, uint32_t a, uint32_t b, const double *d) {
+	if (a == GRAD_CONST && b == GRAD_CONST)
+		return GRAD_CONST;
+	if (g->tape_len >= g->tape_cap) {
+		g->tape_cap *= 2;
+		g->tape = realloc(g->tape, sizeof(GradNode) * g->tape_cap);
+		g->adjoints = realloc(g->adjoints, sizeof(double) * g->tape_cap);
 	}
-	for (size_t i = 0; i < expr_n_builtin_vars; i++) {
-		expr_set_var(res, expr_builtin_vars[i].name, expr_builtin_vars[i].val);
+	g->tape[g->tape_len] = (GradNode){.in = {a, b}, .d = {d[0], d[1]}};
+	return g->tape_len++;
+}
+
+/* Sets the derivatives dst to d[0] * a + d[1] * b, where dst may be a; the
+ * zero flags tell which have none. Terms without derivatives are left out,
+ * rather than multiplied by partial derivatives which may be infinite. */
+static void grad_tangent(Grad *g, double *dst, bool *dst_zero, const double *a, bool a_zero, const double *b, bool b_zero, const double *d) {
+	size_t n = g->n_inputs;
+	if (!a_zero && !b_zero) {
+		for (size_t k = 0; k < n; k++)
+			dst[k] = d[0] * a[k] + d[1] * b[k];
+	} else if (!a_zero) {
+		for (size_t k = 0; k < n; k++)
+			dst[k] = d[0] * a[k];
+	} else if (!b_zero) {
+		for (size_t k = 0; k < n; k++)
+			dst[k] = d[1] * b[k];
 	}
-	return res;
+	*dst_zero = a_zero && b_zero;
 }
 
-void expr_destroy(Expr *e) {
-	for (size_t i = 0; i < e->toks_len; i++) {
-		if (e->toks[i].kind == TokIdent)
-			free(e->toks[i].Str);
+/* Records that the stack entry slot was computed from itself and the n_in - 1
+ * entries above it, with the partial derivatives d. */
+static void grad_record(Grad *g, size_t slot, size_t n_in, const double *d) {
+	if (n_in == 0) {
+		grad_const(g, slot);
+	} else if (g->forward) {
+		double *t = g->tangents + slot * g->n_inputs;
+		grad_tangent(g, t, &g->zero[slot], t, g->zero[slot], t + g->n_inputs, n_in < 2 || g->zero[slot + 1], d);
+	} else {
+		g->nodes[slot] = grad_node(g, g->nodes[slot], n_in < 2 ? GRAD_CONST : g->nodes[slot + 1], d);
 	}
-	free(e->toks);
-	free(e->toks_working);
-	for (size_t i = 0; i < e->vars_cap; i++)
-		free(e->vars[i].name);
-	free(e->vars);
-	for (size_t i = 0; i < e->funcs_cap; i++)
-		free(e->funcs[i].name);
-	free(e->funcs);
-	free(e);
 }
 
-ExprError expr_set(Expr *e, const char *expr) {
-	for (size_t i = 0; i < e->toks_len; i++) {
-		if (e->toks[i].kind == TokIdent)
-			free(e->toks[i].Str);
+/* Like run_stack, but also tracks the derivatives of the stack entries, which
+ * start at index base of g's stacks; args is the index of those of the user
+ * function p is the body of. */
+static ExprError run_grad(Expr *e, Grad *g, const Prog *p, size_t base, size_t args) {
+	ExprArg *s = g->stack + base;
+	size_t sp = 0;
+	double d[2];
+	for (const Op *op = p->ops, *end = p->ops + p->ops_len; op != end; op++) {
+		switch (op->kind) {
+		case OpNum:
+			s[sp].Num = op->Num;
+			grad_const(g, base + sp++);
+			break;
+		case OpVar: {
+			const ExprVar *v = p->vars[op->arg].slot;
+			if (!v->set)
+				return (ExprError){.start = p->vars[op->arg].start, .end = p->vars[op->arg].end, .err = "unknown variable"};
+			s[sp].Num = v->val;
+			int k = prog_input(g->top, p, op->arg);
+			if (k == -1)
+				grad_const(g, base + sp);
+			else if (g->forward) {
+				double *t = g->tangents + (base + sp) * g->n_inputs;
+				memset(t, 0, sizeof(double) * g->n_inputs);
+				t[k] = 1.0;
+				g->zero[base + sp] = false;
+			} else
+				g->nodes[base + sp] = k;
+			sp++;
+			break;
+		}
+		case OpStr:
+			s[sp].Str = p->strs[op->arg];
+			grad_const(g, base + sp++);
+			break;
+		case OpNeg:
+			s[sp-1].Num = -s[sp-1].Num;
+			grad_record(g, base + sp - 1, 1, (double[]){-1.0, 0.0});
+			break;
+		case OpSqr:
+			d[0] = 2.0 * s[sp-1].Num;
+			s[sp-1].Num = s[sp-1].Num * s[sp-1].Num;
+			grad_record(g, base + sp - 1, 1, d);
+			break;
+		case OpAdd: case OpSub: case OpMul: case OpDiv: case OpPow: {
+			sp--;
+			double x = s[sp-1].Num, y = s[sp].Num;
+			switch (op->kind) {
+			case OpAdd: s[sp-1].Num = x + y; d[0] = 1.0;     d[1] = 1.0;  break;
+			case OpSub: s[sp-1].Num = x - y; d[0] = 1.0;     d[1] = -1.0; break;
+			case OpMul: s[sp-1].Num = x * y; d[0] = y;       d[1] = x;    break;
+			case OpDiv: s[sp-1].Num = x / y; d[0] = 1.0 / y; d[1] = -x / (y * y); break;
+			default:
+				s[sp-1].Num = pow(x, y);
+				dfn_pow(d, (ExprArg[]){{.Num = x}, {.Num = y}}, s[sp-1].Num);
+				break;
+			}
+			grad_record(g, base + sp - 1, 2, d);
+			break;
+		}
+		case OpCall: {
+			const Func *f = &p->funcs[op->arg];
+			STAT(stats.builtin_calls[f->builtin]++);
+			sp -= f->n_args;
+			double val = f->func(e, s + sp);
+			f->dfunc(d, s + sp, val);
+			s[sp].Num = val;
+			grad_record(g, base + sp, f->n_args, d);
+			sp++;
+			break;
+		}
+		case OpCallUser: {
+			const Func *f = &p->funcs[op->arg];
+			sp -= f->n_args;
+			ExprError err = run_grad(e, g, &f->user->body, base + sp + f->n_args, base + sp);
+			if (err.err != NULL)
+				return (ExprError){.start = op->Pos.start, .end = op->Pos.end, .err = err.err};
+			s[sp] = s[sp + f->n_args];
+			grad_copy(g, base + sp, base + sp + f->n_args);
+			sp++;
+			break;
+		}
+		case OpArg:
+			s[sp] = g->stack[args + op->arg];
+			grad_copy(g, base + sp++, args + op->arg);
+			break;
+		case OpReduce: {
+			sp -= 2;
+			double from = s[sp].Num, span = s[sp + 1].Num - from;
+			uint64_t bits;
+			memcpy(&bits, &span, sizeof(bits));
+			if ((bits >> 52 & 0x7ff) == 0x7ff)
+				return (ExprError){.start = op->Pos.start, .end = op->Pos.end, .err = "invalid range"};
+			TRY(run_grad_range(e, g, p->ranges[op->arg], base + sp, args, from, span < 0.0 ? 0 : (size_t)span + 1));
+			sp++;
+			break;
+		}
+		}
 	}
+	return (ExprError){0};
+}
 
-	free(e->toks_working); e->toks_working = NULL;
-	e->toks_working_len = 0;
+/* Like run_range, with the layout of the stack from base on being the same.
+ * The derivatives don't depend on the bounds, which only change stepwise. */
+static ExprError run_grad_range(Expr *e, Grad *g, const Range *r, size_t base, size_t args, double from, size_t n) {
+	ExprArg *s = g->stack + base;
+	if (n == 0) {
+		s[0].Num = r->empty;
+		grad_const(g, base);
+		return (ExprError){0};
+	}
 
-	free(e->toks); e->toks = NULL;
-	e->toks_len = 0;
-	e->toks_cap = 0;
+	for (size_t k = 0; k < r->n_args; k++) {
+		s[k] = g->stack[args + k];
+		grad_copy(g, base + k, args + k);
+	}
+	size_t index = base + r->n_args, body = index + 1;
+	grad_const(g, index);
+	/* In forward mode, the derivatives of acc are kept in the space of those
+	 * of the index, which has none, so the body never reads them. */
+	double acc = 0.0, d[2];
+	double *acc_tangents = g->tangents + index * g->n_inputs, *body_tangents = acc_tangents + g->n_inputs;
+	uint32_t acc_node = GRAD_CONST;
+	bool acc_zero = true;
+	for (size_t k = 0; k < n; k++) {
+		s[r->n_args].Num = from + (double)k;
+		TRY(run_grad(e, g, &r->body, body, base));
+		if (k == 0) {
+			acc = g->stack[body].Num;
+			d[0] = 0.0;
+			d[1] = 1.0;
+		} else {
+			ExprArg vals[] = {{.Num = acc}, g->stack[body]};
+			acc = r->combine.func(e, vals);
+			r->combine.dfunc(d, vals, acc);
+		}
+		if (g->forward)
+			grad_tangent(g, acc_tangents, &acc_zero, acc_tangents, acc_zero, body_tangents, g->zero[body], d);
+		else
+			acc_node = grad_node(g, acc_node, g->nodes[body], d);
+	}
+	if (r->mean) {
+		acc /= n;
+		d[0] = 1.0 / n;
+		d[1] = 0.0;
+		if (g->forward)
+			grad_tangent(g, acc_tangents, &acc_zero, acc_tangents, acc_zero, NULL, true, d);
+		else
+			acc_node = grad_node(g, acc_node, GRAD_CONST, d);
+	}
 
-	TRY(tokenize(e, expr));
+	s[0].Num = acc;
+	if (g->forward) {
+		g->zero[base] = acc_zero;
+		if (!acc_zero)
+			memmove(g->tangents + base * g->n_inputs, acc_tangents, sizeof(double) * g->n_inputs);
+	} else
+		g->nodes[base] = acc_node;
 	return (ExprError){0};
 }
 
-ExprError expr_eval(Expr *e, double *out_res) {
-	e->toks_working = realloc(e->toks_working, sizeof(Tok) * e->toks_len);
-	memcpy(e->toks_working, e->toks, sizeof(Tok) * e->toks_len);
-	e->toks_working_len = e->toks_len;
-	TRY(eval(e, e->toks_working, out_res));
-	return (ExprError){0};
-}
+/* Like run_stack, on intervals. Inputs of the expression top are taken from
+ * var_ranges, if given, and other variables have their current value. */
+static ExprError run_interval(Expr *e, const Prog *top, const ExprInterval *var_ranges, const Prog *p, ExprInterval *s, const ExprInterval *args) {
+	size_t sp = 0;
+	for (const Op *op = p->ops, *end = p->ops + p->ops_len; op != end; op++) {
+		/* Operations on empty intervals give empty ones, except max and min,
+		 * which leave them out. */
+		size_t n_in = op_n_in(p, *op);
+		bool empty = false;
+		for (size_t k = sp - n_in; k < sp; k++)
+			empty |= iv_empty(s[k]);
+		if (empty && op->kind == OpCall && (p->funcs[op->arg].ifunc == ifn_max || p->funcs[op->arg].ifunc == ifn_min))
+			empty = false;
+		if (empty) {
+			sp -= n_in;
+			s[sp++] = IV_EMPTY;
+			continue;
+		}
 
-static size_t smap_get_idx(void *smap, const char *key, size_t type_size, size_t cap) {
-	size_t i = fnv1a32(key, strlen(key)) & (cap - 1);
-	while (1) {
-		void *i_ptr = (uint8_t*)smap + type_size * i;
-		char *i_key = *((char**)i_ptr);
-		if (i_key == NULL || strcmp(i_key, key) == 0) {
-			return i;
+		switch (op->kind) {
+		case OpNum:
+			s[sp].lo = s[sp].hi = op->Num;
+			sp++;
+			break;
+		case OpVar: {
+			int k = var_ranges != NULL ? prog_input(top, p, op->arg) : -1;
+			const ExprVar *v = p->vars[op->arg].slot;
+			if (k != -1)
+				s[sp] = var_ranges[k];
+			else if (!v->set)
+				return (ExprError){.start = p->vars[op->arg].start, .end = p->vars[op->arg].end, .err = "unknown variable"};
+			else
+				s[sp].lo = s[sp].hi = v->val;
+			sp++;
+			break;
+		}
+		case OpStr:
+			/* Only passed to functions with side effects, which have no
+			 * interval versions. */
+			s[sp++] = IV_EMPTY;
+			break;
+		case OpNeg: s[sp-1] = iv_neg(s[sp-1]); break;
+		case OpSqr: s[sp-1] = iv_sqr(s[sp-1]); break;
+		case OpAdd: sp--; s[sp-1] = iv_add(s[sp-1], s[sp]); break;
+		case OpSub: sp--; s[sp-1] = iv_sub(s[sp-1], s[sp]); break;
+		case OpMul: sp--; s[sp-1] = iv_mul(s[sp-1], s[sp]); break;
+		case OpDiv: sp--; s[sp-1] = iv_div(s[sp-1], s[sp]); break;
+		case OpPow: sp--; s[sp-1] = iv_pow(s[sp-1], s[sp]); break;
+		case OpCall: {
+			const Func *f = &p->funcs[op->arg];
+			STAT(stats.builtin_calls[f->builtin]++);
+			sp -= f->n_args;
+			ExprInterval res;
+			f->ifunc(&res, s + sp);
+			s[sp++] = res;
+			break;
+		}
+		case OpCallUser: {
+			const Func *f = &p->funcs[op->arg];
+			sp -= f->n_args;
+			ExprError err = run_interval(e, top, var_ranges, &f->user->body, s + sp + f->n_args, s + sp);
+			if (err.err != NULL)
+				return (ExprError){.start = op->Pos.start, .end = op->Pos.end, .err = err.err};
+			s[sp] = s[sp + f->n_args];
+			sp++;
+			break;
+		}
+		case OpArg:
+			s[sp++] = args[op->arg];
+			break;
+		case OpReduce: {
+			sp -= 2;
+			/* Ranges whose length varies would have to be run for every
+			 * length. */
+			if (s[sp].lo != s[sp].hi || s[sp + 1].lo != s[sp + 1].hi)
+				return (ExprError){.start = op->Pos.start, .end = op->Pos.end, .err = "range bounds must not vary"};
+			double from = s[sp].lo, span = s[sp + 1].lo - from;
+			uint64_t bits;
+			memcpy(&bits, &span, sizeof(bits));
+			if ((bits >> 52 & 0x7ff) == 0x7ff)
+				return (ExprError){.start = op->Pos.start, .end = op->Pos.end, .err = "invalid range"};
+			TRY(run_interval_range(e, top, var_ranges, p->ranges[op->arg], s + sp, args, from, span < 0.0 ? 0 : (size_t)span + 1));
+			sp++;
+			break;
+		}
 		}
-		i = (i + 1) % cap;
 	}
+	return (ExprError){0};
 }
 
-static void *smap_get_for_setting(void **smap, const char *key, size_t type_size, size_t *len, size_t *cap) {
-	if (*cap == 0 || (double)*len / (double)*cap >= 0.7) {
-		size_t new_cap = *cap == 0 ? 16 : *cap * 2;
-		void *new = malloc(type_size * new_cap);
-		for (size_t i = 0; i < new_cap; i++)
-			*((char**)((uint8_t*)new + type_size * i)) = NULL;
-		for (size_t i = 0; i < *cap; i++) {
-			void *i_ptr = (uint8_t*)*smap + type_size * i;
-			char *i_key = *((char**)i_ptr);
-			if (i_key != NULL) {
-				void *ptr = (uint8_t*)new + type_size * smap_get_idx(new, i_key, type_size, new_cap);
-				memcpy(ptr, i_ptr, type_size);
-			}
-		}
-		free(*smap);
-		*cap = new_cap;
-		*smap = new;
+/* Like run_range, on intervals; the index is a single number. */
+static ExprError run_interval_range(Expr *e, const Prog *top, const ExprInterval *var_ranges, const Range *r, ExprInterval *s, const ExprInterval *args, double from, size_t n) {
+	if (n == 0) {
+		s[0].lo = s[0].hi = r->empty;
+		return (ExprError){0};
 	}
 
-	void *ptr = (uint8_t*)*smap + type_size * smap_get_idx(*smap, key, type_size, *cap);
-	char **keyptr = (char**)ptr;
-	if (*keyptr == NULL) {
-		*keyptr = strdup(key);
-		(*len)++;
+	if (r->n_args > 0)
+		memcpy(s, args, sizeof(ExprInterval) * r->n_args);
+	ExprInterval *body_s = s + r->n_args + 1, acc;
+	for (size_t k = 0; k < n; k++) {
+		s[r->n_args].lo = s[r->n_args].hi = from + (double)k;
+		TRY(run_interval(e, top, var_ranges, &r->body, body_s, s));
+		if (k == 0)
+			acc = body_s[0];
+		else if (!iv_empty(acc) && !iv_empty(body_s[0]))
+			r->combine.ifunc(&acc, (ExprInterval[]){acc, body_s[0]});
+		else
+			acc = IV_EMPTY;
 	}
-	return ptr;
+	s[0] = r->mean && !iv_empty(acc) ? iv_div(acc, (ExprInterval){n, n}) : acc;
+	return (ExprError){0};
 }
 
-void expr_set_var(Expr *e, const char *name, double val) {
-	Var *v = smap_get_for_setting((void**)&e->vars, name, sizeof(Var), &e->vars_len, &e->vars_cap);
-	v->val = val;
+#ifdef JIT_X86_64
+/* Stack entries below this depth are kept in xmm2 to xmm15, the rest in the
+ * scratch stack pointed to by rbx. xmm0 and xmm1 are temporaries. */
+#define JIT_N_REGS 14
+#define JIT_REG(slot) ((int)(slot) + 2)
+#define JIT_DISP(slot) ((uint32_t)(sizeof(ExprArg) * (slot)))
+
+typedef struct {
+	uint8_t *data;
+	size_t len, cap;
+} JitBuf;
+
+#define JIT_EMIT(b, ...) jit_emit(b, (uint8_t[]){__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__}))
+
+static void jit_emit(JitBuf *b, const void *data, size_t n) {
+	if (b->len + n > b->cap) {
+		b->cap = b->cap == 0 ? 1024 : b->cap * 2;
+		b->data = realloc(b->data, b->cap);
+	}
+	memcpy(b->data + b->len, data, n);
+	b->len += n;
 }
 
-bool expr_get_var(Expr *e, const char *name, double *out) {
-	Var v = e->vars[smap_get_idx(e->vars, name, sizeof(Var), e->vars_cap)];
-	*out = v.name == NULL ? NAN : v.val;
-	return v.name != NULL;
+static void jit_u32(JitBuf *b, uint32_t x) {
+	jit_emit(b, &x, sizeof(x));
 }
 
-void expr_set_func(Expr *e, const char *name, double (*func)(Expr *e, ExprArg *args), ExprArgType *arg_types, size_t n_args) {
-	Func *v = smap_get_for_setting((void**)&e->funcs, name, sizeof(Func), &e->funcs_len, &e->funcs_cap);
-	v->func = func;
-	v->arg_types = arg_types;
-	v->n_args = n_args;
+static void jit_u64(JitBuf *b, uint64_t x) {
+	jit_emit(b, &x, sizeof(x));
 }
 
-void expr_set_userdata(Expr *e, void *userdata) {
-	e->userdata = userdata;
+/* Scalar double instruction (movsd, addsd, ...) on two xmm registers. */
+static void jit_sse_rr(JitBuf *b, uint8_t op, int dst, int src) {
+	JIT_EMIT(b, 0xf2);
+	if (dst >= 8 || src >= 8)
+		JIT_EMIT(b, 0x40 | (dst >= 8) << 2 | (src >= 8));
+	JIT_EMIT(b, 0x0f, op, 0xc0 | (dst & 7) << 3 | (src & 7));
 }
 
-void *expr_get_userdata(Expr *e) {
-	return e->userdata;
+/* Scalar double instruction on an xmm register and [rbx + disp]. */
+static void jit_sse_rm(JitBuf *b, uint8_t op, int reg, uint32_t disp) {
+	JIT_EMIT(b, 0xf2);
+	if (reg >= 8)
+		JIT_EMIT(b, 0x44);
+	JIT_EMIT(b, 0x0f, op, 0x83 | (reg & 7) << 3);
+	jit_u32(b, disp);
 }
 
-static void del_toks(Expr *e, Tok *start, Tok *end) {
-	memmove(start, end, (e->toks_working_len - (end - e->toks_working)) * sizeof(Tok));
-	e->toks_working_len -= end - start;
+static void jit_load(JitBuf *b, int reg, size_t slot) {
+	if (slot >= JIT_N_REGS)
+		jit_sse_rm(b, 0x10, reg, JIT_DISP(slot));
+	else if (reg != JIT_REG(slot))
+		jit_sse_rr(b, 0x10, reg, JIT_REG(slot));
 }
 
-static ExprError collapse(Expr *e, Tok *t) {
-	/* Collapse factor. */
-	if (t[1].kind == TokOp && t[1].Char == '-') {
-		TRY(collapse(e, t + 1));
-		if (t[2].kind != TokNum) {
-			return (ExprError){.start = t[2].start, .end = t[2].end, .err = "invalid expression after minus factor"};
-		}
-		t[2].Num *= -1.0;
-		del_toks(e, t + 1, t + 2);
-	}
+static void jit_store(JitBuf *b, size_t slot, int reg) {
+	if (slot >= JIT_N_REGS)
+		jit_sse_rm(b, 0x11, reg, JIT_DISP(slot));
+	else if (reg != JIT_REG(slot))
+		jit_sse_rr(b, 0x10, JIT_REG(slot), reg);
+}
 
-	/* Collapse parentheses. */
-	if (t[1].kind == TokOp && t[1].Char == '(') {
-		double res;
-		TRY(eval(e, t + 1, &res));
-		size_t i;
-		for (i = 2; !(t[i].kind == TokOp && OP_PREC(t[i].Char) == 0); i++);
-		del_toks(e, t + 2, t + i + 1);
-		/* Put the newly evaluated value into place. */
-		t[1].kind = TokNum;
-		t[1].Num = res;
+/* Moves the entries in [from, to) between registers and the scratch stack
+ * around calls, which may clobber all xmm registers. */
+static void jit_spill(JitBuf *b, const bool *is_str, size_t from, size_t to, bool reload) {
+	for (size_t i = from; i < to && i < JIT_N_REGS; i++) {
+		if (!is_str[i])
+			jit_sse_rm(b, reload ? 0x10 : 0x11, JIT_REG(i), JIT_DISP(i));
 	}
+}
 
+/* mov rax, imm64 */
+static void jit_mov_rax(JitBuf *b, uint64_t x) {
+	JIT_EMIT(b, 0x48, 0xb8);
+	jit_u64(b, x);
+}
 
-	if (t[1].kind == TokIdent) {
-		if (t + 2 < e->toks_working + e->toks_working_len && (t[2].kind == TokOp && t[2].Char == '(')) {
-			/* Collapse function. */
-			ExprArg arg_results[16];
-			size_t arg_results_size = 0;
-
-			Func func = get_func(e, t[1].Str);
-			if (func.name == NULL)
-				return (ExprError){.start = t[1].start, .end = t[1].end, .err = "unknown function"};
+/* call rax, with rax = func */
+static void jit_call(JitBuf *b, uint64_t func) {
+	jit_mov_rax(b, func);
+	JIT_EMIT(b, 0xff, 0xd0);
+}
 
-			t += 2;
-			while (1) {
-				if (arg_results_size < 16) {
-					if (func.arg_types[arg_results_size] == ExprArgTypeNum) {
-						double res;
-						TRY(eval(e, t, &res));
-						arg_results[arg_results_size++].Num = res;
-					} else if (func.arg_types[arg_results_size] == ExprArgTypeStr) {
-						if (t[1].kind != TokIdent)
-							return (ExprError){.start = t[1].start, .end = t[1].end, .err = "expected string argument"};
-
-						arg_results[arg_results_size++].Str = t[1].Str;
-					}
-				}
-				size_t i = 1;
-				for (; !(t[i].kind == TokOp && OP_PREC(t[i].Char) == 0); i++);
-				bool end = t[i].Char == ')';
-				if (t[i].Char == ',')
-					del_toks(e, t, t + i);
-				else if (t[i].Char == ')')
-					del_toks(e, t, t + i + 1);
-				if (end)
-					break;
-			}
-			t -= 2;
+/* Compiles the program to a function operating on the same stack as run(),
+ * so results are identical. */
+static void jit_compile(Prog *p) {
+	JitBuf b = {0};
+	bool *is_str = calloc(p->stack_cap + 1, sizeof(bool));
+	size_t sp = 0;
 
-			if (arg_results_size != func.n_args)
-				return (ExprError){.start = t[1].start, .end = t[1].end, .err = "invalid number of arguments to function"};
+	/* The epilogue comes first, so jumps to it needn't be patched. */
+	JIT_EMIT(&b, 0x48, 0x83, 0xc4, 0x08); /* add rsp, 8 */
+	JIT_EMIT(&b, 0x41, 0x5c);             /* pop r12 */
+	JIT_EMIT(&b, 0x5b);                   /* pop rbx */
+	JIT_EMIT(&b, 0xc3);                   /* ret */
+	size_t entry = b.len;
+	JIT_EMIT(&b, 0x53);                   /* push rbx */
+	JIT_EMIT(&b, 0x41, 0x54);             /* push r12 */
+	JIT_EMIT(&b, 0x48, 0x83, 0xec, 0x08); /* sub rsp, 8 */
+	JIT_EMIT(&b, 0x49, 0x89, 0xfc);       /* mov r12, rdi */
+	JIT_EMIT(&b, 0x48, 0x89, 0xf3);       /* mov rbx, rsi */
 
-			t[1].kind = TokNum;
-			t[1].Num = func.func(e, arg_results);
-		} else {
-			/* Collapse variable. */
-			t[1].kind = TokNum;
-			if (!expr_get_var(e, t[1].Str, &t[1].Num))
-				return (ExprError){.start = t[1].start, .end = t[1].end, .err = "unknown variable"};
+	for (const Op *op = p->ops, *end = p->ops + p->ops_len; op != end; op++) {
+		switch (op->kind) {
+		case OpNum: {
+			uint64_t bits;
+			memcpy(&bits, &op->Num, sizeof(bits));
+			jit_mov_rax(&b, bits);
+			if (sp < JIT_N_REGS) {
+				int r = JIT_REG(sp);
+				JIT_EMIT(&b, 0x66, 0x48 | (r >= 8) << 2, 0x0f, 0x6e, 0xc0 | (r & 7) << 3); /* movq xmm, rax */
+			} else {
+				JIT_EMIT(&b, 0x48, 0x89, 0x83); /* mov [rbx + disp], rax */
+				jit_u32(&b, JIT_DISP(sp));
+			}
+			is_str[sp++] = false;
+			break;
+		}
+		case OpVar: {
+			JIT_EMIT(&b, 0x48, 0xb9); /* mov rcx, slot */
+			jit_u64(&b, (uintptr_t)p->vars[op->arg].slot);
+			JIT_EMIT(&b, 0x80, 0x79, offsetof(ExprVar, set), 0x00); /* cmp byte [rcx + set], 0 */
+			JIT_EMIT(&b, 0xb8); /* mov eax, 1 + index */
+			jit_u32(&b, op->arg + 1);
+			JIT_EMIT(&b, 0x0f, 0x84); /* je epilogue */
+			jit_u32(&b, (uint32_t)(0 - (b.len + 4)));
+			int r = sp < JIT_N_REGS ? JIT_REG(sp) : 0;
+			JIT_EMIT(&b, 0xf2);
+			if (r >= 8)
+				JIT_EMIT(&b, 0x44);
+			JIT_EMIT(&b, 0x0f, 0x10, (r & 7) << 3 | 1); /* movsd xmm, [rcx] */
+			jit_store(&b, sp, r);
+			is_str[sp++] = false;
+			break;
+		}
+		case OpStr:
+			jit_mov_rax(&b, (uintptr_t)p->strs[op->arg]);
+			JIT_EMIT(&b, 0x48, 0x89, 0x83); /* mov [rbx + disp], rax */
+			jit_u32(&b, JIT_DISP(sp));
+			is_str[sp++] = true;
+			break;
+		case OpNeg:
+			/* Flip the sign bit like the interpreter's negation does. */
+			if (sp - 1 < JIT_N_REGS) {
+				int r = JIT_REG(sp - 1);
+				JIT_EMIT(&b, 0x66, 0x48 | (r >= 8) << 2, 0x0f, 0x7e, 0xc0 | (r & 7) << 3); /* movq rax, xmm */
+				JIT_EMIT(&b, 0x48, 0x0f, 0xba, 0xf8, 0x3f);                                /* btc rax, 63 */
+				JIT_EMIT(&b, 0x66, 0x48 | (r >= 8) << 2, 0x0f, 0x6e, 0xc0 | (r & 7) << 3); /* movq xmm, rax */
+			} else {
+				JIT_EMIT(&b, 0x48, 0x0f, 0xba, 0xbb); /* btc qword [rbx + disp], 63 */
+				jit_u32(&b, JIT_DISP(sp - 1));
+				JIT_EMIT(&b, 0x3f);
+			}
+			break;
+		case OpSqr:
+			jit_load(&b, 0, sp - 1);
+			jit_sse_rr(&b, 0x59, 0, 0);
+			jit_store(&b, sp - 1, 0);
+			break;
+		case OpAdd:
+		case OpSub:
+		case OpMul:
+		case OpDiv: {
+			static const uint8_t sse_ops[] = {[OpAdd] = 0x58, [OpSub] = 0x5c, [OpMul] = 0x59, [OpDiv] = 0x5e};
+			size_t a = sp - 2, c = sp - 1;
+			if (c < JIT_N_REGS)
+				jit_sse_rr(&b, sse_ops[op->kind], JIT_REG(a), JIT_REG(c));
+			else {
+				jit_load(&b, 0, a);
+				jit_sse_rm(&b, sse_ops[op->kind], 0, JIT_DISP(c));
+				jit_store(&b, a, 0);
+			}
+			sp--;
+			break;
+		}
+		case OpPow:
+			jit_spill(&b, is_str, 0, sp - 2, false);
+			jit_load(&b, 0, sp - 2);
+			jit_load(&b, 1, sp - 1);
+			jit_call(&b, (uintptr_t)pow);
+			jit_spill(&b, is_str, 0, sp - 2, true);
+			jit_store(&b, sp - 2, 0);
+			sp--;
+			break;
+		case OpCall: {
+			const Func *f = &p->funcs[op->arg];
+			/* Arguments are passed on the scratch stack. */
+			jit_spill(&b, is_str, 0, sp, false);
+			sp -= f->n_args;
+			JIT_EMIT(&b, 0x4c, 0x89, 0xe7);       /* mov rdi, r12 */
+			JIT_EMIT(&b, 0x48, 0x8d, 0xb3);       /* lea rsi, [rbx + disp] */
+			jit_u32(&b, JIT_DISP(sp));
+			jit_call(&b, (uintptr_t)f->func);
+			jit_spill(&b, is_str, 0, sp, true);
+			jit_store(&b, sp, 0);
+			is_str[sp++] = false;
+			break;
+		}
 		}
 	}
-	return (ExprError){0};
-}
+	jit_load(&b, 0, 0);
+	jit_sse_rm(&b, 0x11, 0, JIT_DISP(0));
+	JIT_EMIT(&b, 0x31, 0xc0); /* xor eax, eax */
+	JIT_EMIT(&b, 0xe9);       /* jmp epilogue */
+	jit_u32(&b, (uint32_t)(0 - (b.len + 4)));
+	free(is_str);
 
-static ExprError eval(Expr *e, Tok *t, double *out_res) {
-	if (!(t[0].kind == TokOp && OP_PREC(t[0].Char) == 0)) {
-		return (ExprError){.start = t[0].start, .end = t[0].end, .err = "expected delimiter at beginning of expression"};
+	/* Map the code writable first and only make it executable once done. */
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t size = (b.len + page_size - 1) / page_size * page_size;
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem != MAP_FAILED) {
+		memcpy(mem, b.data, b.len);
+		if (mprotect(mem, size, PROT_READ | PROT_EXEC) == 0) {
+			void *fn = (uint8_t*)mem + entry;
+			memcpy(&p->jit, &fn, sizeof(fn));
+			p->jit_mem = mem;
+			p->jit_size = size;
+		} else
+			munmap(mem, size);
 	}
+	free(b.data);
+}
 
-	while (1) {
-		TRY(collapse(e, t));
+static void jit_free(Prog *p) {
+	if (p->jit_mem != NULL)
+		munmap(p->jit_mem, p->jit_size);
+	p->jit = NULL;
+	p->jit_mem = NULL;
+}
+#else
+static void jit_compile(Prog *p) {
+	(void)p;
+}
 
-		if (!(t[0].kind == TokOp && t[1].kind == TokNum && t[2].kind == TokOp)) {
-			return (ExprError){.start = t[0].start, .end = t[1].end, .err = "unexpected token"};
+static void jit_free(Prog *p) {
+	(void)p;
+}
+#endif
+
+static ExprError run_rows(Expr *e, size_t n, const double **var_columns, double *out) {
+	/* The columns are written to the variables' slots, which mustn't be
+	 * those of the environment. */
+	bool shadowed = false;
+	for (size_t i = 0; i < e->cur->vars_len; i++) {
+		const ProgVar *pv = &e->cur->vars[i];
+		if (var_columns != NULL && var_columns[i] != NULL && pv->shared) {
+			/* The copy of a constant mustn't be folded in its place. */
+			ExprVar *slot = get_var_for_setting(e, pv->name, strlen(pv->name))->slot;
+			if (slot->constant) {
+				slot->constant = false;
+				e->consts_gen++;
+			}
+			shadowed = true;
 		}
+	}
+	if (shadowed)
+		TRY(prog_refresh(e));
 
-		const char curr_op = t[0].Char;
-		const uint8_t curr_prec = OP_PREC(curr_op);
+	const Prog *p = e->cur;
+	ExprVar *saved = malloc(sizeof(ExprVar) * p->vars_len);
+	for (size_t i = 0; i < p->vars_len; i++)
+		saved[i] = *p->vars[i].slot;
 
-		const char next_op = t[2].Char;
-		const uint8_t next_prec = OP_PREC(next_op);
+	/* Formulas reading the columns are recomputed for every row. Their
+	 * values are saved as well, as they may have been set directly. */
+	for (size_t i = 0; i < p->vars_len; i++) {
+		if (var_columns != NULL && var_columns[i] != NULL)
+			formulas_queue_users(e, p->vars[i].slot);
+	}
+	size_t n_formulas = e->formula_queue_len;
+	ExprVar **formula_slots = malloc(sizeof(ExprVar*) * n_formulas);
+	ExprVar *saved_formulas = malloc(sizeof(ExprVar) * n_formulas);
+	for (size_t i = 0; i < n_formulas; i++) {
+		formula_slots[i] = e->formula_queue[i]->slot;
+		saved_formulas[i] = *formula_slots[i];
+		e->formula_queue[i]->queued = false;
+	}
+	e->formula_queue_len = 0;
 
-		/* Delimiters have a precedence of 0; if we have a number between two delimiters, we're done. */
-		if (curr_prec == 0 && next_prec == 0) {
-			*out_res = t[1].Num;
-			return (ExprError){0};
+	ExprError err = {0};
+	for (size_t row = 0; row < n && err.err == NULL; row++) {
+		for (size_t i = 0; i < p->vars_len; i++) {
+			if (var_columns != NULL && var_columns[i] != NULL) {
+				p->vars[i].slot->val = var_columns[i][row];
+				p->vars[i].slot->set = true;
+			}
 		}
+		if (n_formulas > 0) {
+			for (size_t i = 0; i < p->vars_len; i++) {
+				if (var_columns != NULL && var_columns[i] != NULL)
+					formulas_queue_users(e, p->vars[i].slot);
+			}
+			formulas_run_queue(e);
+		}
+		err = run(e, p, &e->scratch, &out[row]);
+	}
 
-		if (next_prec > curr_prec || (next_prec == curr_prec && OP_ORDER(curr_op) == OrderRtl)) {
-			t += 2;
-		} else if (next_prec < curr_prec || (next_prec == curr_prec && OP_ORDER(curr_op) == OrderLtr)) {
-			double res;
-			double lhs = t[-1].Num, rhs = t[1].Num;
-			switch (curr_op) {
-			case '+': res = lhs + rhs; break;
-			case '-': res = lhs - rhs; break;
-			case '*': res = lhs * rhs; break;
-			case '/': res = lhs / rhs; break;
-			case '^': res = pow(lhs, rhs); break;
-			default:
-				return (ExprError){.start = t[0].start, .end = t[0].end, .err = "invalid operator"};
+	/* Columns only stand in for the variables during evaluation. */
+	for (size_t i = 0; i < p->vars_len; i++) {
+		if (var_columns != NULL && var_columns[i] != NULL) {
+			p->vars[i].slot->val = saved[i].val;
+			p->vars[i].slot->set = saved[i].set;
+		}
+	}
+	for (size_t i = 0; i < n_formulas; i++) {
+		formula_slots[i]->val = saved_formulas[i].val;
+		formula_slots[i]->set = saved_formulas[i].set;
+	}
+	free(saved);
+	free(formula_slots);
+	free(saved_formulas);
+	return err;
+}
+
+/* Whether formulas read any of the columns, which only run_rows() updates
+ * for every row. */
+static bool batch_feeds_formulas(const Prog *p, const double **var_columns) {
+	for (size_t i = 0; i < p->vars_len; i++) {
+		const ExprVar *slot = p->vars[i].slot;
+		if (var_columns != NULL && var_columns[i] != NULL && slot->deps != NULL && slot->deps->users_len > 0)
+			return true;
+	}
+	return false;
+}
+
+/* index is the column of OpArg, which is only batched for the indices of range
+ * reductions. */
+static void run_block(Expr *e, const Prog *p, Scratch *sc, size_t row, size_t n, const double **var_columns, const double *index, double *out) {
+	/* Stack entry k points either straight at an input column or at its own
+	 * buffer in batch_bufs, into which operators write their results. */
+	const double **s = sc->batch_ptrs;
+	size_t sp = 0;
+	for (const Op *op = p->ops, *end = p->ops + p->ops_len; op != end; op++) {
+		double *r = sc->batch_bufs + BATCH_BLOCK * sp;
+		switch (op->kind) {
+		case OpNum:
+			for (size_t i = 0; i < n; i++)
+				r[i] = op->Num;
+			s[sp++] = r;
+			break;
+		case OpVar:
+			if (var_columns != NULL && var_columns[op->arg] != NULL) {
+				s[sp++] = var_columns[op->arg] + row;
+			} else {
+				const double v = p->vars[op->arg].slot->val;
+				for (size_t i = 0; i < n; i++)
+					r[i] = v;
+				s[sp++] = r;
+			}
+			break;
+		case OpArg:
+			s[sp++] = index + row;
+			break;
+		case OpStr:
+		case OpCallUser:
+		case OpReduce:
+			/* Handled by run_rows(). */
+			break;
+		case OpNeg:
+		case OpSqr: {
+			const double *a = s[sp-1];
+			r -= BATCH_BLOCK;
+			if (op->kind == OpNeg) {
+				for (size_t i = 0; i < n; i++)
+					r[i] = -a[i];
+			} else {
+				for (size_t i = 0; i < n; i++)
+					r[i] = a[i] * a[i];
+			}
+			s[sp-1] = r;
+			break;
+		}
+		case OpAdd:
+		case OpSub:
+		case OpMul:
+		case OpDiv:
+		case OpPow: {
+			const double *a = s[sp-2], *b = s[sp-1];
+			r -= 2 * BATCH_BLOCK;
+			switch (op->kind) {
+			case OpAdd: for (size_t i = 0; i < n; i++) r[i] = a[i] + b[i];      break;
+			case OpSub: for (size_t i = 0; i < n; i++) r[i] = a[i] - b[i];      break;
+			case OpMul: for (size_t i = 0; i < n; i++) r[i] = a[i] * b[i];      break;
+			case OpDiv: for (size_t i = 0; i < n; i++) r[i] = a[i] / b[i];      break;
+			case OpPow: for (size_t i = 0; i < n; i++) r[i] = pow(a[i], b[i]); break;
 			}
+			s[--sp - 1] = r;
+			break;
+		}
+		case OpCall: {
+			const Func *f = &p->funcs[op->arg];
+			sp -= f->n_args;
+			r = sc->batch_bufs + BATCH_BLOCK * sp;
+			if (f->vfunc != NULL) {
+				f->vfunc(r, s + sp, n);
+			} else {
+				/* No batch variant, call it row by row. */
+				ExprArg *args = sc->stack;
+				for (size_t i = 0; i < n; i++) {
+					for (size_t j = 0; j < f->n_args; j++)
+						args[j].Num = s[sp + j][i];
+					r[i] = f->func(e, args);
+				}
+			}
+			s[sp++] = r;
+			break;
+		}
+		}
+	}
+	memcpy(out, s[0], sizeof(double) * n);
+}
+
+#ifdef EXPR_STATS
+/* Counts the calls of running p, which makes no calls of its own (like
+ * run_block()), n times. */
+static void stats_count_calls(const Prog *p, size_t n) {
+	for (size_t i = 0; i < p->ops_len; i++) {
+		if (p->ops[i].kind == OpCall)
+			stats.builtin_calls[p->funcs[p->ops[i].arg].builtin] += n;
+	}
+}
+#endif
+
+static bool batch_parallel_ok(const Prog *p) {
+	/* Functions registered by the user may not be thread-safe. */
+	for (size_t i = 0; i < p->funcs_len; i++) {
+		if (p->funcs[i].vfunc == NULL)
+			return false;
+	}
+	return p->strs_len == 0 && !p->runs_bodies;
+}
+
+static ExprError batch_check_vars(const Prog *p, const double **var_columns) {
+	for (size_t i = 0; i < p->vars_len; i++) {
+		if ((var_columns == NULL || var_columns[i] == NULL) && !p->vars[i].slot->set)
+			return (ExprError){.start = p->vars[i].start, .end = p->vars[i].end, .err = "unknown variable"};
+	}
+	return (ExprError){0};
+}
 
-			t[1].Num = res;
+static void *batch_worker(void *arg) {
+	BatchWorker *w = arg;
+	BatchJob *job = w->job;
+	const Prog *p = job->e->cur;
+	scratch_reserve(&w->scratch, p, true);
 
-			del_toks(e, t - 1, t + 1);
+	while (1) {
+		/* Take the next block from the front of our own range. */
+		uint64_t r = atomic_load(&w->range);
+		uint64_t lo = r & 0xffffffff, hi = r >> 32;
+		if (lo < hi) {
+			if (!atomic_compare_exchange_weak(&w->range, &r, (lo + 1) | hi << 32))
+				continue;
+			size_t row = lo * BATCH_BLOCK;
+			size_t n = job->n - row < BATCH_BLOCK ? job->n - row : BATCH_BLOCK;
+			run_block(job->e, p, &w->scratch, row, n, job->var_columns, NULL, job->out + row);
+			continue;
+		}
 
-			t -= 2;
+		/* Out of work; steal the back half of someone else's range. We
+		 * only get here with an empty range, which thieves leave alone, so
+		 * we can simply overwrite it with what we stole. */
+		bool stole = false;
+		for (size_t i = 1; i < job->n_workers && !stole; i++) {
+			BatchWorker *v = &job->workers[(w->id + i) % job->n_workers];
+			uint64_t vr = atomic_load(&v->range);
+			while (1) {
+				uint64_t vlo = vr & 0xffffffff, vhi = vr >> 32;
+				if (vlo >= vhi)
+					break;
+				uint64_t k = (vhi - vlo + 1) / 2;
+				if (atomic_compare_exchange_weak(&v->range, &vr, vlo | (vhi - k) << 32)) {
+					atomic_store(&w->range, (vhi - k) | vhi << 32);
+					stole = true;
+					break;
+				}
+			}
 		}
+		if (!stole)
+			return NULL;
 	}
 }
 
@@ -361,8 +4844,48 @@ static uint32_t fnv1a32(const void *data, size_t n) {
 	return res;
 }
 
-static Func get_func(Expr *e, const char *name) {
-	return e->funcs[smap_get_idx(e->funcs, name, sizeof(Func), e->funcs_cap)];
+/* Must match builtin_hash() in gen_builtins.c. */
+static uint32_t builtin_hash(const char *s, size_t n, uint32_t seed) {
+	uint32_t res = seed;
+	for (size_t i = 0; i < n; i++) {
+		res ^= (uint8_t)s[i];
+		res *= 16777619u;
+	}
+	return res ^ res >> 16;
+}
+
+/* Index of the builtin function called name in _builtin_funcs, or -1. The
+ * perfect hash table has at most one candidate per name. */
+static int builtin_func_idx(const char *name, size_t name_len) {
+	STAT(stats.probes++);
+	int i = BUILTIN_FUNCS_table[builtin_hash(name, name_len, BUILTIN_FUNCS_SEED) & BUILTIN_FUNCS_MASK];
+	if (i == -1 || strncmp(_builtin_funcs[i].name, name, name_len) != 0 || _builtin_funcs[i].name[name_len] != 0)
+		return -1;
+	return i;
+}
+
+/* Like builtin_func_idx, but for _builtin_vars. */
+static int builtin_var_idx(const char *name, size_t name_len) {
+	STAT(stats.probes++);
+	int i = BUILTIN_VARS_table[builtin_hash(name, name_len, BUILTIN_VARS_SEED) & BUILTIN_VARS_MASK];
+	if (i == -1 || strncmp(_builtin_vars[i].name, name, name_len) != 0 || _builtin_vars[i].name[name_len] != 0)
+		return -1;
+	return i;
+}
+
+static Func get_func(Expr *e, const char *name, size_t name_len) {
+	/* Removed functions which programs still refer to keep their entry,
+	 * with neither func nor user. */
+	const Func *f = smap_get(&e->funcs, name, name_len, sizeof(Func));
+	if (f != NULL && (f->func != NULL || f->user != NULL))
+		return *f;
+	int i = builtin_func_idx(name, name_len);
+	return i == -1 ? (Func){0} : builtin_func(i);
+}
+
+static Func builtin_func(int i) {
+	const ExprBuiltinFunc *b = &_builtin_funcs[i];
+	return (Func){.name = (char*)b->name, .func = b->func, .vfunc = b->vfunc, .dfunc = b->dfunc, .ifunc = b->ifunc, .arg_types = b->arg_types, .n_args = b->n_args, .impure = b->impure, .variadic = b->variadic, .builtin = i + 1};
 }
 
 static void push_tok(Expr *e, Tok t) {
@@ -372,24 +4895,113 @@ static void push_tok(Expr *e, Tok t) {
 		e->toks_cap = new_cap;
 	}
 	e->toks[e->toks_len++] = t;
+	STAT(stats.toks++);
+}
+
+/* Parses the longest prefix of s[0, n) that is a decimal number, like strtod()
+ * would, and returns its length. Numbers with up to 19 significant digits
+ * whose value and power of ten are exact doubles are converted with a single
+ * correctly rounded multiplication or division (Clinger's fast path); others
+ * are left to strtod(). */
+static size_t parse_num(Expr *e, const char *s, size_t n, double *out) {
+	static const double pow10[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+
+	uint64_t mant = 0;
+	int n_digits = 0;
+	bool truncated = false;
+	bool has_digits = false;
+	int64_t exp10 = 0;
+	size_t i = 0;
+	for (; i < n && IS_NUM(s[i]); i++) {
+		has_digits = true;
+		if (n_digits < 19) {
+			mant = mant * 10 + (s[i] - '0');
+			n_digits += mant != 0;
+		} else {
+			exp10++;
+			truncated |= s[i] != '0';
+		}
+	}
+	if (i < n && s[i] == '.') {
+		size_t dot = i++;
+		for (; i < n && IS_NUM(s[i]); i++) {
+			has_digits = true;
+			if (n_digits < 19) {
+				mant = mant * 10 + (s[i] - '0');
+				n_digits += mant != 0;
+				exp10--;
+			} else
+				truncated |= s[i] != '0';
+		}
+		if (!has_digits)
+			i = dot;
+	}
+	if (!has_digits) {
+		*out = 0.0;
+		return 0;
+	}
+	if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+		size_t j = i + 1;
+		bool neg = false;
+		if (j < n && (s[j] == '+' || s[j] == '-'))
+			neg = s[j++] == '-';
+		if (j < n && IS_NUM(s[j])) {
+			int64_t x = 0;
+			for (; j < n && IS_NUM(s[j]); j++) {
+				/* Saturate; anything this large over- or underflows anyway. */
+				if (x < 1000000)
+					x = x * 10 + (s[j] - '0');
+			}
+			exp10 += neg ? -x : x;
+			i = j;
+		}
+	}
+
+	if (!truncated && mant <= (1ull << 53)) {
+		if (mant == 0) {
+			*out = 0.0;
+			return i;
+		}
+		if (exp10 >= -22 && exp10 <= 22) {
+			*out = exp10 < 0 ? (double)mant / pow10[-exp10] : (double)mant * pow10[exp10];
+			return i;
+		}
+		if (exp10 > 22 && exp10 <= 22 + 15) {
+			/* Move the excess into the mantissa while that's exact. */
+			uint64_t m = mant;
+			int64_t x = exp10;
+			while (x > 22 && m <= (1ull << 53) / 10) {
+				m *= 10;
+				x--;
+			}
+			if (x == 22) {
+				*out = (double)m * pow10[22];
+				return i;
+			}
+		}
+	}
+
+	*out = strtod(arena_strndup(&e->arena, s, i), NULL);
+	return i;
 }
 
-static ExprError tokenize(Expr *e, const char *expr) {
+static ExprError tokenize(Expr *e, const char *expr, size_t len) {
 	size_t start;
 
 	push_tok(e, (Tok){.start = 0, .end = 1, .kind = TokOp, .Char = '('});
 
-	/* We try to use the stack first for parenthesis tracking and only resort
-	 * to heap allocation if the depth exceeds 16. */
+	/* Only the depth is tracked; the position of an unmatched '(' is looked
+	 * up in the tokens if there is one. */
 	size_t paren_depth = 0;
-	size_t parens_cap = 16;
-	size_t *h_parens = NULL;
-	size_t s_parens[16];
-	size_t *parens = s_parens;
 
 	Tok last;
 	const char *curr = expr;
-	for (char c = *curr; c != 0; c = *(++curr)) {
+	const char *end = expr + len;
+	for (; curr < end; curr++) {
+		char c = *curr;
 		if (e->toks_len > 0)
 			last = e->toks[e->toks_len-1];
 		else
@@ -401,15 +5013,11 @@ static ExprError tokenize(Expr *e, const char *expr) {
 		if (IS_NUM(c) || c == '.') {
 			bool dot_seen = c == '.';
 			bool e_seen = false;
-			char add_e_as_var = 0;
-			char buf[32];
 			start = curr - expr;
-			buf[0] = c;
 			size_t i = 1;
-			while (i < 31 && (IS_NUM(curr[i]) || curr[i] == '.' || curr[i] == 'e' || curr[i] == 'E' || ((curr[i-1] == 'e' || curr[i-1] == 'E') && (curr[i] == '-' || curr[i] == '+')))) {
+			while (curr + i < end && (IS_NUM(curr[i]) || curr[i] == '.' || curr[i] == 'e' || curr[i] == 'E' || ((curr[i-1] == 'e' || curr[i-1] == 'E') && (curr[i] == '-' || curr[i] == '+')))) {
 				if (curr[i] == '.') {
 					if (dot_seen) {
-						free(h_parens);
 						return (ExprError){.start = start + i, .end = start + i, .err = "more than one dot in decimal number"};
 					} else if (e_seen) {
 						return (ExprError){.start = start + i, .end = start + i, .err = "decimal dot not allowed in exponent"};
@@ -418,79 +5026,57 @@ static ExprError tokenize(Expr *e, const char *expr) {
 				}
 				if (curr[i] == 'e' || curr[i] == 'E') {
 					if (e_seen) {
-						free(h_parens);
 						return (ExprError){.start = start + i, .end = start + i, .err = "more than one 'e' or 'E' in decimal number"};
 					} else
 						e_seen = true;
 				}
-				buf[i] = curr[i];
 				i++;
 			}
 
-			if (i > 0 && (curr[i-1] == 'e' || curr[i-1] == 'E'))
-				add_e_as_var = curr[i-1];
-
-			curr += i - 1;
-
-			if (add_e_as_var)
-				buf[--i] = 0;
-			else
-				buf[i] = 0;
+			/* A trailing 'e' is Euler's number (or a variable named E). */
+			const char *e_var = NULL;
+			if (curr[i-1] == 'e' || curr[i-1] == 'E')
+				e_var = &curr[--i];
 
-			char *endptr;
-			double num = strtod(buf, &endptr);
-			size_t endpos = endptr - buf;
-			if (endpos != i) {
-				free(h_parens);
+			double num;
+			size_t endpos = parse_num(e, curr, i, &num);
+			if (endpos != i)
 				return (ExprError){.start = start + endpos, .end = start + endpos, .err = "error parsing number"};
-			}
+
+			curr += e_var != NULL ? i : i - 1;
 
 			if (last.kind == TokIdent || (last.kind == TokOp && last.Char == ')') || last.kind == TokNum)
 				push_tok(e, (Tok){.start = last.end + 1, .end = last.end + 1, .kind = TokOp, .Char = '*'});
 
 			push_tok(e, (Tok){.start = start, .end = curr - expr, .kind = TokNum, .Num = num});
 
-			if (add_e_as_var) {
-				char b[2] = { add_e_as_var, 0 };
+			if (e_var != NULL) {
 				push_tok(e, (Tok){.start = curr - expr + 1, .end = curr - expr + 1, .kind = TokOp, .Char = '*'});
-				push_tok(e, (Tok){.start = curr - expr - 1, .end = curr - expr - 1, .kind = TokIdent, .Str = strdup(b)});
+				push_tok(e, (Tok){.start = curr - expr - 1, .end = curr - expr - 1, .kind = TokIdent, .Str = e_var, .Len = 1});
 			}
 			continue;
 		}
 
 		if (IS_SYMBOL(c)) {
 			start = curr - expr;
-			char *buf = malloc(32);
-			buf[0] = c;
 			size_t i = 1;
-			while (i < 31 && IS_SYMBOL(curr[i])) {
-				buf[i] = curr[i];
+			while (curr + i < end && IS_SYMBOL(curr[i]))
 				i++;
-			}
+			const char *name = curr;
 			curr += i - 1;
-			buf[i++] = 0;
 
 			if (last.kind == TokIdent || (last.kind == TokOp && last.Char == ')') || last.kind == TokNum)
 				push_tok(e, (Tok){.start = last.end + 1, .end = last.end + 1, .kind = TokOp, .Char = '*'});
 
-			push_tok(e, (Tok){.start = start, .end = curr - expr, .kind = TokIdent, .Str = buf});
+			push_tok(e, (Tok){.start = start, .end = curr - expr, .kind = TokIdent, .Str = name, .Len = i});
 			continue;
 		}
 
-		if (c == '(') {
-			if (paren_depth+1 > parens_cap) {
-				bool h_n = h_parens == NULL;
-				parens = h_parens = realloc(h_parens, sizeof(size_t) * (parens_cap *= 2));
-				if (h_n) {
-					memcpy(h_parens, s_parens, sizeof(size_t) * 16);
-				}
-			}
-			parens[paren_depth++] = curr - expr;
-		} else if (c == ')') {
-			if (paren_depth == 0) {
-				free(h_parens);
+		if (c == '(')
+			paren_depth++;
+		else if (c == ')') {
+			if (paren_depth == 0)
 				return (ExprError){.start = curr - expr, .end = curr - expr, .err = "unmatched ')'"};
-			}
 			paren_depth--;
 		}
 
@@ -498,6 +5084,7 @@ static ExprError tokenize(Expr *e, const char *expr) {
 		case '(':
 		case ')':
 		case ',':
+		case '=':
 		case '+':
 		case '-':
 		case '*':
@@ -509,19 +5096,23 @@ static ExprError tokenize(Expr *e, const char *expr) {
 			break;
 		}
 		default:
-			free(h_parens);
 			return (ExprError){.start = curr - expr, .end = curr - expr, .err = "unrecognized symbol"};
 		}
 	}
 
 	if (paren_depth > 0) {
-		size_t p = parens[paren_depth-1];
-		free(h_parens);
-		return (ExprError){.start = p, .end = p, .err = "unmatched '('"};
+		size_t depth = 0;
+		size_t i = e->toks_len - 1;
+		for (;; i--) {
+			if (e->toks[i].kind == TokOp && e->toks[i].Char == ')')
+				depth++;
+			else if (e->toks[i].kind == TokOp && e->toks[i].Char == '(' && depth-- == 0)
+				break;
+		}
+		return (ExprError){.start = e->toks[i].start, .end = e->toks[i].end, .err = "unmatched '('"};
 	}
 
 	push_tok(e, (Tok){.start = curr - expr, .end = curr - expr, .kind = TokOp, .Char = ')'});
 
-	free(h_parens);
 	return (ExprError){0};
 }
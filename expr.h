@@ -6,6 +6,10 @@
 #include <stdint.h>
 
 typedef struct _Expr Expr;
+typedef struct _ExprVar ExprVar;
+typedef struct _ExprEnv ExprEnv;
+typedef struct _ExprFile ExprFile;
+typedef struct _ExprFileWriter ExprFileWriter;
 
 typedef struct {
 	size_t start, end;
@@ -22,6 +26,20 @@ typedef union {
 	double Num;
 } ExprArg;
 
+/* The numbers from lo to hi. Bounds are NaN if there are none, e.g. for the
+ * values of sqrt(x) with x from -2 to -1. */
+typedef struct {
+	double lo, hi;
+} ExprInterval;
+
+/* The variable name taking the n values from, from + step, ...,
+ * from + (n - 1)*step in expr_sweep(). */
+typedef struct {
+	const char *name;
+	double from, step;
+	size_t n;
+} ExprSweepAxis;
+
 typedef struct {
 	const char *name;
 	const char *description;
@@ -29,6 +47,21 @@ typedef struct {
 	const char **arg_names;
 	ExprArgType *arg_types;
 	size_t n_args;
+	/* Optional batch variant of func: res[i] = func(args[0][i], ...) for i < n. */
+	void (*vfunc)(double *res, const double **args, size_t n);
+	/* Has side effects, so calls are never evaluated at compile time. */
+	bool impure;
+	/* Takes any number of arguments, combined pairwise by func from left to
+	 * right. Also works as a range reduction: f(i = from, to, body) combines
+	 * body for i = from, from + 1, ..., to. */
+	bool variadic;
+	/* Optional partial derivatives of func, for expr_eval_grad():
+	 * res[i] = d func / d args[i], where val = func(e, args). Functions
+	 * without one can't be differentiated. */
+	void (*dfunc)(double *res, ExprArg *args, double val);
+	/* Optional interval version of func, for expr_eval_interval(): res is to
+	 * contain func(e, x) for all x within args, none of which are empty. */
+	void (*ifunc)(ExprInterval *res, const ExprInterval *args);
 } ExprBuiltinFunc;
 
 typedef struct {
@@ -37,18 +70,169 @@ typedef struct {
 	double val;
 } ExprBuiltinVar;
 
+/* Counters of the work done by the calling thread, across all Exprs. */
+typedef struct {
+	size_t toks;    /* Tokens produced by the tokenizer */
+	size_t ops;     /* Instructions emitted by the compiler */
+	size_t folds;   /* Operations evaluated at compile time */
+	size_t moved;   /* Bytes of instructions moved to drop neutral operands */
+	size_t probes;  /* Hash table slots looked at */
+	size_t resizes; /* Hash tables grown */
+	size_t allocs;  /* Memory allocations */
+	size_t evals;   /* Evaluations; each row of a batch counts as one */
+	uint64_t tokenize_ns, compile_ns, eval_ns;
+	/* Calls of each builtin, indexed like expr_builtin_funcs. Calls made by
+	 * native code (see expr_jit) aren't counted. */
+	const size_t *builtin_calls;
+} ExprStats;
+
 extern ExprBuiltinFunc *expr_builtin_funcs;
 extern const size_t     expr_n_builtin_funcs;
 extern ExprBuiltinVar  *expr_builtin_vars;
 extern const size_t     expr_n_builtin_vars;
 
+/* An environment holds the builtins and global variables, which are shared by
+ * the Exprs created with it. It is reference counted and may be used from
+ * many threads at once: lookups and reads don't take locks, and variables are
+ * updated atomically. */
+ExprEnv *expr_env_new();
+ExprEnv *expr_env_ref(ExprEnv *env);
+void expr_env_unref(ExprEnv *env);
+void expr_env_set_var(ExprEnv *env, const char *name, double val);
+bool expr_env_get_var(ExprEnv *env, const char *name, double *out); /* Returns false if not set */
+/* Uses a default environment shared by the whole process. */
 Expr *expr_new();
+/* Expressions see the variables of env unless the Expr has its own by that
+ * name. Setting one through the Expr (including by getting a handle to it)
+ * gives the Expr its own copy, so it never changes env. */
+Expr *expr_new_with_env(ExprEnv *env);
+ExprEnv *expr_get_env(Expr *e);
+/* Returns an independent copy of e, with the same expression, variables and
+ * functions, without parsing or compiling anything again. The cache of
+ * compiled expressions starts out empty. */
+Expr *expr_clone(Expr *e);
 void expr_destroy(Expr *e);
 ExprError expr_set(Expr *e, const char *expr) __attribute__((warn_unused_result));
+/* Like expr_set, but expr is len bytes long and needn't be NUL-terminated. */
+ExprError expr_set_n(Expr *e, const char *expr, size_t len) __attribute__((warn_unused_result));
 ExprError expr_eval(Expr *e, double *out_res) __attribute__((warn_unused_result));
+/* Like expr_eval, but also sets grad[i] to the derivative of the result with
+ * respect to the input expr_input_name(e, i), for all expr_n_inputs(e) inputs
+ * at once. Works in reverse mode: the operations are recorded, then walked
+ * backwards once. Variables assigned by set() still count as inputs when read
+ * afterwards. Fails for expressions calling functions without derivatives,
+ * such as those set with expr_set_func(). */
+ExprError expr_eval_grad(Expr *e, double *out_res, double *grad) __attribute__((warn_unused_result));
+/* Same as expr_eval_grad, in forward mode: the derivatives with respect to
+ * every input are carried along with each value. Needs no record, but the
+ * memory and work per operation grow with the number of inputs. */
+ExprError expr_eval_grad_forward(Expr *e, double *out_res, double *grad) __attribute__((warn_unused_result));
+/* Sets out to bounds of the values the expression takes when each input
+ * expr_input_name(e, i) is anywhere within var_ranges[i] (or has its current
+ * value, for all of them, if var_ranges is NULL). Results are rounded
+ * outwards, so the bounds are guaranteed but may be wider than necessary.
+ * Points at which a function isn't defined, like 1/0, are left out, also where
+ * max() or min() would take the other operand in their place. Fails for
+ * expressions calling functions without interval versions, such as set(), and
+ * for range reductions whose bounds vary. */
+ExprError expr_eval_interval(Expr *e, const ExprInterval *var_ranges, ExprInterval *out) __attribute__((warn_unused_result));
+/* Caches up to n compiled expressions, so setting one of them again needn't
+ * parse it. 0 (the default) disables the cache. */
+void expr_set_cache_size(Expr *e, size_t n);
+void expr_get_cache_stats(Expr *e, size_t *hits, size_t *misses);
+/* From now on, compile expressions to native code when they are first
+ * evaluated by expr_eval. Returns false if that isn't supported on this
+ * platform, in which case the interpreter keeps being used. */
+bool expr_jit(Expr *e);
+/* Evaluates the expression for n rows of inputs, where var_columns[i] holds the
+ * values of the input expr_input_name(e, i). A NULL column (or var_columns
+ * being NULL) means the variable's current value is used for every row.
+ * Builtins use vectorized math routines here, whose results may differ from
+ * expr_eval() in the last bits. */
+ExprError expr_eval_batch(Expr *e, size_t n, const double **var_columns, double *out) __attribute__((warn_unused_result));
+/* Like expr_eval_batch, but spreads the rows across n_threads threads (0 means
+ * one per CPU). Falls back to a single thread for expressions calling
+ * functions registered with expr_set_func, which may not be thread-safe. */
+ExprError expr_eval_batch_parallel(Expr *e, size_t n, const double **var_columns, double *out, size_t n_threads) __attribute__((warn_unused_result));
+/* Evaluates the expression at each point of the grid spanned by n_axes axes,
+ * like a loop nest over them with the last axis innermost. The points are made
+ * up and evaluated as by expr_eval_batch() a chunk at a time, so no memory
+ * grows with the size of the grid: out is called with the n results res of
+ * each chunk, and coords[k][i] being the value of axis k for res[i]. Inputs
+ * not on an axis keep their current value; an axis whose variable the
+ * expression doesn't read is an error. */
+ExprError expr_sweep(Expr *e, const ExprSweepAxis *axes, size_t n_axes, void (*out)(void *userdata, const double **coords, const double *res, size_t n), void *userdata) __attribute__((warn_unused_result));
+/* Counting costs time, so it is only done if expr.c is compiled with
+ * EXPR_STATS defined; expr_get_stats returns false otherwise. */
+bool expr_get_stats(ExprStats *out);
+/* Adds counters got with expr_get_stats() on another thread to those of the
+ * calling thread, such as those of worker threads before they exit. */
+void expr_add_stats(const ExprStats *s);
+void expr_reset_stats();
+size_t expr_n_inputs(Expr *e); /* Number of variables the expression reads */
+const char *expr_input_name(Expr *e, size_t i);
+/* Whether evaluating the expression may change e or call out of it: it calls
+ * set() or a function set with expr_set_func(), directly or through the user
+ * functions it calls. */
+bool expr_has_side_effects(Expr *e);
 void expr_set_var(Expr *e, const char *name, double val);
 bool expr_get_var(Expr *e, const char *name, double *out); /* Returns false if not present */
+/* Removes the variable name of e, after which name refers to the variable of
+ * the environment again, if there is one, and its memory is reused. A variable
+ * still read by a compiled expression, user function or formula, or which a
+ * handle was got for, is only left unset. Returns false if e has no variable
+ * of its own by that name. */
+bool expr_unset_var(Expr *e, const char *name);
+/* Variable handles skip the name lookup and stay valid for the lifetime of e,
+ * even if the variable is unset with expr_unset_var(). Getting a handle creates
+ * the variable if necessary, but leaves it unset. */
+ExprVar *expr_var_handle(Expr *e, const char *name);
+void expr_set_var_by_handle(Expr *e, ExprVar *var, double val);
+bool expr_get_var_by_handle(Expr *e, ExprVar *var, double *out); /* Returns false if not set */
 void expr_set_func(Expr *e, const char *name, double (*func)(Expr *e, ExprArg *args), ExprArgType *arg_types, size_t n_args);
+/* Removes a function set with expr_set_func() or defined with
+ * expr_define_func(), after which name refers to the builtin by that name
+ * again, if there is one. User functions calling it keep calling it, as they
+ * do when it is redefined. Returns false if e has no such function. */
+bool expr_unset_func(Expr *e, const char *name);
+/* Defines a function in the expression language, like "f(x, y) = x^2 + y".
+ * Small functions are inlined into the expressions calling them. */
+ExprError expr_define_func(Expr *e, const char *def) __attribute__((warn_unused_result));
+/* Defines a variable computed from others, like "y := a*x + b". Setting one of
+ * them recomputes the formulas depending on it, directly or through other
+ * formulas, each once; their values are kept in between. Formulas read this
+ * Expr's own copies of the variables of the environment and can't call
+ * functions with side effects. Setting y directly overrides its value until
+ * one of its inputs changes, and unsetting it with expr_unset_var() removes
+ * its formula. Formulas follow the functions they call when those are
+ * redefined or removed, and are recomputed then. */
+ExprError expr_define_var(Expr *e, const char *def) __attribute__((warn_unused_result));
+/* Collects compiled expressions, with the user functions they call, into a
+ * file from which expr_set_from_file() sets them again without parsing or
+ * compiling. Names are looked up when loading, so variables are those of the
+ * Expr loading the file. */
+ExprFileWriter *expr_file_writer_new();
+/* Adds the current expression of e, which must not be destroyed before w.
+ * Returns false with errno set on failure: EINVAL if e has no valid
+ * expression, ENOTSUP if it calls a function set with expr_set_func(). */
+bool expr_file_writer_add(ExprFileWriter *w, Expr *e);
+/* Writes the expressions added so far to the file at path. Returns false with
+ * errno set on failure. */
+bool expr_file_writer_save(ExprFileWriter *w, const char *path);
+void expr_file_writer_free(ExprFileWriter *w);
+/* Maps a file written by expr_file_writer_save() into memory, where the instructions are
+ * run from, so they are neither read nor copied up front and processes
+ * loading the same file share them. Files are checked when opened; returns
+ * NULL with errno set on failure, EINVAL if the file is invalid or was
+ * written by a different build. */
+ExprFile *expr_file_open(const char *path);
+/* Expressions set from f must not be evaluated anymore after this. */
+void expr_file_close(ExprFile *f);
+size_t expr_file_len(ExprFile *f); /* Number of expressions */
+const char *expr_file_src(ExprFile *f, size_t i);
+/* Sets the expression of e to expression i of f, which is like setting
+ * expr_file_src(f, i) but only binds the names. */
+ExprError expr_set_from_file(Expr *e, ExprFile *f, size_t i) __attribute__((warn_unused_result));
 void expr_set_userdata(Expr *e, void *userdata);
 void *expr_get_userdata(Expr *e);
 
@@ -29,15 +29,345 @@ static double fn_hypot(Expr *e, ExprArg *args) {return hypot(args[0].Num, args[1
 static double fn_polar(Expr *e, ExprArg *args) {return atan2(args[1].Num, args[0].Num);    }
 static double fn_max(Expr *e, ExprArg *args)   {return fmax(args[0].Num, args[1].Num);     }
 static double fn_min(Expr *e, ExprArg *args)   {return fmin(args[0].Num, args[1].Num);     }
+static double fn_sum(Expr *e, ExprArg *args)   {return args[0].Num + args[1].Num;          }
+static double fn_prod(Expr *e, ExprArg *args)  {return args[0].Num * args[1].Num;          }
+static double fn_mean(Expr *e, ExprArg *args)  {return (args[0].Num + args[1].Num) / 2.0;  }
 static double fn_rad(Expr *e, ExprArg *args)   {return args[0].Num / M_PI * 180.0;         }
 static double fn_deg(Expr *e, ExprArg *args)   {return args[0].Num / 180.0 * M_PI;         }
 
+/* Batch variants of the above, see ExprBuiltinFunc.vfunc. Written as plain
+ * loops so the compiler can vectorize them (using libmvec for the libm calls). */
+static void vfn_sqrt(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = sqrt(a[0][i]);               }
+static void vfn_cbrt(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = cbrt(a[0][i]);               }
+static void vfn_pow(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = pow(a[0][i], a[1][i]);       }
+static void vfn_exp(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = exp(a[0][i]);                }
+static void vfn_ln(double *r, const double **a, size_t n)    {for (size_t i = 0; i < n; i++) r[i] = log(a[0][i]);                }
+static void vfn_log(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = log(a[1][i]) / log(a[0][i]); }
+static void vfn_mod(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = fmod(a[0][i], a[1][i]);      }
+static void vfn_round(double *r, const double **a, size_t n) {for (size_t i = 0; i < n; i++) r[i] = round(a[0][i]);              }
+static void vfn_floor(double *r, const double **a, size_t n) {for (size_t i = 0; i < n; i++) r[i] = floor(a[0][i]);              }
+static void vfn_ceil(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = ceil(a[0][i]);               }
+static void vfn_sin(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = sin(a[0][i]);                }
+static void vfn_cos(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = cos(a[0][i]);                }
+static void vfn_tan(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = tan(a[0][i]);                }
+static void vfn_asin(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = asin(a[0][i]);               }
+static void vfn_acos(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = acos(a[0][i]);               }
+static void vfn_atan(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = atan(a[0][i]);               }
+static void vfn_sinh(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = sinh(a[0][i]);               }
+static void vfn_cosh(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = cosh(a[0][i]);               }
+static void vfn_tanh(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = tanh(a[0][i]);               }
+static void vfn_asinh(double *r, const double **a, size_t n) {for (size_t i = 0; i < n; i++) r[i] = asinh(a[0][i]);              }
+static void vfn_acosh(double *r, const double **a, size_t n) {for (size_t i = 0; i < n; i++) r[i] = acosh(a[0][i]);              }
+static void vfn_atanh(double *r, const double **a, size_t n) {for (size_t i = 0; i < n; i++) r[i] = atanh(a[0][i]);              }
+static void vfn_abs(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = fabs(a[0][i]);               }
+static void vfn_hypot(double *r, const double **a, size_t n) {for (size_t i = 0; i < n; i++) r[i] = hypot(a[0][i], a[1][i]);     }
+static void vfn_polar(double *r, const double **a, size_t n) {for (size_t i = 0; i < n; i++) r[i] = atan2(a[1][i], a[0][i]);     }
+static void vfn_max(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = fmax(a[0][i], a[1][i]);      }
+static void vfn_min(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = fmin(a[0][i], a[1][i]);      }
+static void vfn_sum(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = a[0][i] + a[1][i];           }
+static void vfn_prod(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = a[0][i] * a[1][i];           }
+static void vfn_mean(double *r, const double **a, size_t n)  {for (size_t i = 0; i < n; i++) r[i] = (a[0][i] + a[1][i]) / 2.0;   }
+static void vfn_rad(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = a[0][i] / M_PI * 180.0;      }
+static void vfn_deg(double *r, const double **a, size_t n)   {for (size_t i = 0; i < n; i++) r[i] = a[0][i] / 180.0 * M_PI;      }
+
+/* Partial derivatives of the above, see ExprBuiltinFunc.dfunc; v is the result.
+ * At kinks the derivative of one side is taken, and 0 at the steps of the
+ * rounding functions. max and min follow the operand they returned, which for
+ * NaN need not be the greater or lesser one. */
+static void dfn_sqrt(double *d, ExprArg *a, double v)  {d[0] = 0.5 / v;                                                                            }
+static void dfn_cbrt(double *d, ExprArg *a, double v)  {d[0] = 1.0 / (3.0 * v * v);                                                                }
+static void dfn_pow(double *d, ExprArg *a, double v)   {d[0] = a[1].Num == 0.0 ? 0.0 : a[1].Num * pow(a[0].Num, a[1].Num - 1.0); d[1] = v == 0.0 ? 0.0 : v * log(a[0].Num);}
+static void dfn_exp(double *d, ExprArg *a, double v)   {d[0] = v;                                                                                  }
+static void dfn_ln(double *d, ExprArg *a, double v)    {d[0] = 1.0 / a[0].Num;                                                                     }
+static void dfn_log(double *d, ExprArg *a, double v)   {d[0] = -v / (a[0].Num * log(a[0].Num)); d[1] = 1.0 / (a[1].Num * log(a[0].Num));           }
+static void dfn_mod(double *d, ExprArg *a, double v)   {d[0] = 1.0; d[1] = -trunc(a[0].Num / a[1].Num);                                            }
+static void dfn_round(double *d, ExprArg *a, double v) {d[0] = 0.0;                                                                                }
+static void dfn_floor(double *d, ExprArg *a, double v) {d[0] = 0.0;                                                                                }
+static void dfn_ceil(double *d, ExprArg *a, double v)  {d[0] = 0.0;                                                                                }
+static void dfn_sin(double *d, ExprArg *a, double v)   {d[0] = cos(a[0].Num);                                                                      }
+static void dfn_cos(double *d, ExprArg *a, double v)   {d[0] = -sin(a[0].Num);                                                                     }
+static void dfn_tan(double *d, ExprArg *a, double v)   {d[0] = 1.0 + v * v;                                                                        }
+static void dfn_asin(double *d, ExprArg *a, double v)  {d[0] = 1.0 / sqrt(1.0 - a[0].Num * a[0].Num);                                              }
+static void dfn_acos(double *d, ExprArg *a, double v)  {d[0] = -1.0 / sqrt(1.0 - a[0].Num * a[0].Num);                                             }
+static void dfn_atan(double *d, ExprArg *a, double v)  {d[0] = 1.0 / (1.0 + a[0].Num * a[0].Num);                                                  }
+static void dfn_sinh(double *d, ExprArg *a, double v)  {d[0] = cosh(a[0].Num);                                                                     }
+static void dfn_cosh(double *d, ExprArg *a, double v)  {d[0] = sinh(a[0].Num);                                                                     }
+static void dfn_tanh(double *d, ExprArg *a, double v)  {d[0] = 1.0 - v * v;                                                                        }
+static void dfn_asinh(double *d, ExprArg *a, double v) {d[0] = 1.0 / sqrt(a[0].Num * a[0].Num + 1.0);                                              }
+static void dfn_acosh(double *d, ExprArg *a, double v) {d[0] = 1.0 / sqrt(a[0].Num * a[0].Num - 1.0);                                              }
+static void dfn_atanh(double *d, ExprArg *a, double v) {d[0] = 1.0 / (1.0 - a[0].Num * a[0].Num);                                                  }
+static void dfn_abs(double *d, ExprArg *a, double v)   {d[0] = (a[0].Num > 0.0) - (a[0].Num < 0.0);                                                }
+static void dfn_hypot(double *d, ExprArg *a, double v) {d[0] = v == 0.0 ? 0.0 : a[0].Num / v; d[1] = v == 0.0 ? 0.0 : a[1].Num / v;                }
+static void dfn_polar(double *d, ExprArg *a, double v) {double r = hypot(a[0].Num, a[1].Num); d[0] = -sin(v) / r; d[1] = cos(v) / r;               }
+static void dfn_max(double *d, ExprArg *a, double v)   {d[0] = memcmp(&v, &a[0].Num, sizeof(v)) == 0; d[1] = 1.0 - d[0];                          }
+static void dfn_min(double *d, ExprArg *a, double v)   {d[0] = memcmp(&v, &a[0].Num, sizeof(v)) == 0; d[1] = 1.0 - d[0];                          }
+static void dfn_sum(double *d, ExprArg *a, double v)   {d[0] = 1.0; d[1] = 1.0;                                                                    }
+static void dfn_prod(double *d, ExprArg *a, double v)  {d[0] = a[1].Num; d[1] = a[0].Num;                                                          }
+static void dfn_mean(double *d, ExprArg *a, double v)  {d[0] = 0.5; d[1] = 0.5;                                                                    }
+static void dfn_rad(double *d, ExprArg *a, double v)   {d[0] = 180.0 / M_PI;                                                                       }
+static void dfn_deg(double *d, ExprArg *a, double v)   {d[0] = M_PI / 180.0;                                                                       }
+
+/* Interval arithmetic for the interval versions below, see
+ * ExprBuiltinFunc.ifunc. Bounds are rounded outwards by stepping them to the
+ * next representable numbers: once for the basic operations, which are
+ * rounded correctly, and IV_LIBM_ULPS times for libm results. */
+#define IV_LIBM_ULPS 4
+#define IV_EMPTY ((ExprInterval){NAN, NAN})
+
+/* Checked on the bits, as -ffinite-math-only makes isnan() always false and
+ * lets NaN compare equal to anything. */
+static bool iv_nan(double x) {
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return (bits >> 52 & 0x7ff) == 0x7ff && (bits & 0xfffffffffffffull) != 0;
+}
+
+static bool iv_empty(ExprInterval x) {return iv_nan(x.lo) || iv_nan(x.hi);}
+
+/* 0 or -0, which a NaN would compare equal to. */
+static bool iv_zero(double x) {
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return (bits << 1) == 0;
+}
+
+static ExprInterval iv_out(double lo, double hi, int ulps) {
+	for (int i = 0; i < ulps; i++) {
+		lo = nextafter(lo, -HUGE_VAL);
+		hi = nextafter(hi, HUGE_VAL);
+	}
+	return (ExprInterval){lo, hi};
+}
+
+/* For monotonically increasing and decreasing functions. */
+static ExprInterval iv_inc(double (*f)(double), ExprInterval x) {return iv_out(f(x.lo), f(x.hi), IV_LIBM_ULPS);}
+static ExprInterval iv_dec(double (*f)(double), ExprInterval x) {return iv_out(f(x.hi), f(x.lo), IV_LIBM_ULPS);}
+
+/* The same, for functions only defined from lo to hi. */
+static ExprInterval iv_inc_on(double (*f)(double), ExprInterval x, double lo, double hi) {
+	if (x.hi < lo || x.lo > hi)
+		return IV_EMPTY;
+	return iv_inc(f, (ExprInterval){fmax(x.lo, lo), fmin(x.hi, hi)});
+}
+
+static ExprInterval iv_dec_on(double (*f)(double), ExprInterval x, double lo, double hi) {
+	if (x.hi < lo || x.lo > hi)
+		return IV_EMPTY;
+	return iv_dec(f, (ExprInterval){fmax(x.lo, lo), fmin(x.hi, hi)});
+}
+
+/* |x| */
+static ExprInterval iv_abs(ExprInterval x) {
+	if (x.lo >= 0.0)
+		return x;
+	if (x.hi <= 0.0)
+		return (ExprInterval){-x.hi, -x.lo};
+	return (ExprInterval){0.0, fmax(-x.lo, x.hi)};
+}
+
+/* Whether x contains at + k * period for some integer k. Errs on the side of
+ * true, so callers only ever overestimate. */
+static bool iv_hits(ExprInterval x, double at, double period) {
+	if (x.hi - x.lo >= period)
+		return true;
+	double t = at + ceil((x.lo - at) / period) * period;
+	double slack = 1e-9 * (1.0 + fabs(t));
+	return t <= x.hi + slack || t - period >= x.lo - slack;
+}
+
+/* Functions with period 2π, taking their maximum 1 at peak and minimum -1 at
+ * trough, and monotonic in between. */
+static ExprInterval iv_wave(double (*f)(double), ExprInterval x, double peak, double trough) {
+	ExprInterval r = iv_out(fmin(f(x.lo), f(x.hi)), fmax(f(x.lo), f(x.hi)), IV_LIBM_ULPS);
+	if (iv_hits(x, peak, 2.0 * M_PI))
+		r.hi = 1.0;
+	if (iv_hits(x, trough, 2.0 * M_PI))
+		r.lo = -1.0;
+	return r;
+}
+
+static ExprInterval iv_add(ExprInterval a, ExprInterval b) {return iv_out(a.lo + b.lo, a.hi + b.hi, 1);}
+static ExprInterval iv_sub(ExprInterval a, ExprInterval b) {return iv_out(a.lo - b.hi, a.hi - b.lo, 1);}
+static ExprInterval iv_neg(ExprInterval a)                 {return (ExprInterval){-a.hi, -a.lo};    }
+
+/* a * b, where 0 * ∞ is 0, as ∞ only stands for large finite numbers. */
+static double iv_mul0(double a, double b) {
+	return iv_zero(a) || iv_zero(b) ? 0.0 : a * b;
+}
+
+/* Intervals computed on the way, like the logarithms in log(b, x), may be
+ * empty. */
+static ExprInterval iv_mul(ExprInterval a, ExprInterval b) {
+	if (iv_empty(a) || iv_empty(b))
+		return IV_EMPTY;
+	double p[4] = {iv_mul0(a.lo, b.lo), iv_mul0(a.lo, b.hi), iv_mul0(a.hi, b.lo), iv_mul0(a.hi, b.hi)};
+	return iv_out(fmin(fmin(p[0], p[1]), fmin(p[2], p[3])), fmax(fmax(p[0], p[1]), fmax(p[2], p[3])), 1);
+}
+
+static ExprInterval iv_div(ExprInterval a, ExprInterval b) {
+	ExprInterval inv;
+	if (iv_empty(a) || iv_empty(b) || (iv_zero(b.lo) && iv_zero(b.hi)))
+		return IV_EMPTY;
+	else if (b.lo > 0.0 || b.hi < 0.0)
+		inv = iv_out(1.0 / b.hi, 1.0 / b.lo, 1);
+	else if (iv_zero(b.lo))
+		inv = (ExprInterval){nextafter(1.0 / b.hi, 0.0), HUGE_VAL};
+	else if (iv_zero(b.hi))
+		inv = (ExprInterval){-HUGE_VAL, nextafter(1.0 / b.lo, 0.0)};
+	else
+		return (ExprInterval){-HUGE_VAL, HUGE_VAL};
+	return iv_mul(a, inv);
+}
+
+static ExprInterval iv_sqr(ExprInterval x) {
+	x = iv_abs(x);
+	return iv_out(x.lo * x.lo, x.hi * x.hi, 1);
+}
+
+static ExprInterval iv_pow(ExprInterval x, ExprInterval y) {
+	double n = y.lo;
+	if (n == y.hi && n == trunc(n) && fabs(n) < 0x1p53) {
+		/* Integer powers are defined for negative x as well. */
+		if (n == 0.0)
+			return (ExprInterval){1.0, 1.0};
+		if (fmod(n, 2.0) == 0.0) {
+			x = iv_abs(x);
+			return n > 0.0 ? iv_out(pow(x.lo, n), pow(x.hi, n), IV_LIBM_ULPS) : iv_out(pow(x.hi, n), pow(x.lo, n), IV_LIBM_ULPS);
+		}
+		if (n > 0.0)
+			return iv_out(pow(x.lo, n), pow(x.hi, n), IV_LIBM_ULPS);
+		if (x.lo >= 0.0)
+			return iv_out(pow(x.hi, n), pow(x.lo, n), IV_LIBM_ULPS);
+		if (x.hi <= 0.0)
+			return iv_out(x.hi == 0.0 ? -HUGE_VAL : pow(x.hi, n), pow(x.lo, n), IV_LIBM_ULPS);
+		return (ExprInterval){-HUGE_VAL, HUGE_VAL};
+	}
+	/* Otherwise x^y = e^(y ln x) for x >= 0, where y ln x is bilinear in y
+	 * and ln x, so the extremes are at the corners. */
+	double lo = HUGE_VAL, hi = -HUGE_VAL;
+	if (x.hi >= 0.0) {
+		double a = fmax(x.lo, 0.0);
+		double p[4] = {pow(a, y.lo), pow(a, y.hi), pow(x.hi, y.lo), pow(x.hi, y.hi)};
+		ExprInterval r = iv_out(fmin(fmin(p[0], p[1]), fmin(p[2], p[3])), fmax(fmax(p[0], p[1]), fmax(p[2], p[3])), IV_LIBM_ULPS);
+		lo = r.lo;
+		hi = r.hi;
+	}
+	/* Negative x only have the powers x^n for the integers n within y. For
+	 * each x, x^n is monotonic among the even and among the odd n, so the
+	 * extremes are at the first or last of either. */
+	if (x.lo < 0.0) {
+		double first = ceil(y.lo), last = floor(y.hi);
+		if (fmax(fabs(first), fabs(last)) >= 0x1p53)
+			return (ExprInterval){-HUGE_VAL, HUGE_VAL};
+		ExprInterval neg = {x.lo, fmin(x.hi, 0.0)};
+		double n[4] = {first, first + 1.0, last - 1.0, last};
+		for (size_t i = 0; i < 4; i++) {
+			if (n[i] < first || n[i] > last)
+				continue;
+			ExprInterval r = iv_pow(neg, (ExprInterval){n[i], n[i]});
+			lo = fmin(lo, r.lo);
+			hi = fmax(hi, r.hi);
+		}
+	}
+	if (lo > hi)
+		return IV_EMPTY;
+	return (ExprInterval){lo, hi};
+}
+
+static ExprInterval iv_mod(ExprInterval x, ExprInterval y) {
+	double m = fmax(fabs(y.lo), fabs(y.hi));
+	if (m == 0.0)
+		return IV_EMPTY;
+	/* Within one period, fmod(x, y) = x - k*y for a fixed k. */
+	if (y.lo == y.hi && (x.lo >= 0.0 || x.hi <= 0.0) && trunc(x.lo / y.lo) == trunc(x.hi / y.lo)) {
+		ExprInterval r = {fmod(x.lo, y.lo), fmod(x.hi, y.lo)};
+		if (r.lo <= r.hi)
+			return r;
+	}
+	return (ExprInterval){x.lo >= 0.0 ? 0.0 : fmax(x.lo, -m), x.hi <= 0.0 ? 0.0 : fmin(x.hi, m)};
+}
+
+static ExprInterval iv_polar(ExprInterval x, ExprInterval y) {
+	/* Away from the origin and the cut along the negative x axis, atan2 is
+	 * continuous and takes its extremes over a box at the corners. */
+	if (x.lo <= 0.0 && y.lo <= 0.0 && y.hi >= 0.0)
+		return iv_out(-M_PI, M_PI, IV_LIBM_ULPS);
+	double p[4] = {atan2(y.lo, x.lo), atan2(y.lo, x.hi), atan2(y.hi, x.lo), atan2(y.hi, x.hi)};
+	return iv_out(fmin(fmin(p[0], p[1]), fmin(p[2], p[3])), fmax(fmax(p[0], p[1]), fmax(p[2], p[3])), IV_LIBM_ULPS);
+}
+
+static ExprInterval iv_tan(ExprInterval x) {
+	if (iv_hits(x, M_PI / 2.0, M_PI))
+		return (ExprInterval){-HUGE_VAL, HUGE_VAL};
+	return iv_inc(tan, x);
+}
+
+static ExprInterval iv_ln(ExprInterval x) {return iv_inc_on(log, x, 0.0, HUGE_VAL);}
+
+static ExprInterval iv_hypot(ExprInterval x, ExprInterval y) {
+	x = iv_abs(x);
+	y = iv_abs(y);
+	return iv_out(hypot(x.lo, y.lo), hypot(x.hi, y.hi), IV_LIBM_ULPS);
+}
+
+/* fmax and fmin take the other operand for NaN, so an empty one is left
+ * out. */
+static ExprInterval iv_max(ExprInterval a, ExprInterval b) {
+	if (iv_empty(a) || iv_empty(b))
+		return iv_empty(a) ? b : a;
+	return (ExprInterval){fmax(a.lo, b.lo), fmax(a.hi, b.hi)};
+}
+
+static ExprInterval iv_min(ExprInterval a, ExprInterval b) {
+	if (iv_empty(a) || iv_empty(b))
+		return iv_empty(a) ? b : a;
+	return (ExprInterval){fmin(a.lo, b.lo), fmin(a.hi, b.hi)};
+}
+
+static void ifn_sqrt(ExprInterval *r, const ExprInterval *a)  {*r = iv_inc_on(sqrt, a[0], 0.0, HUGE_VAL);                          }
+static void ifn_cbrt(ExprInterval *r, const ExprInterval *a)  {*r = iv_inc(cbrt, a[0]);                                            }
+static void ifn_pow(ExprInterval *r, const ExprInterval *a)   {*r = iv_pow(a[0], a[1]);                                            }
+static void ifn_exp(ExprInterval *r, const ExprInterval *a)   {*r = iv_inc(exp, a[0]);                                             }
+static void ifn_ln(ExprInterval *r, const ExprInterval *a)    {*r = iv_ln(a[0]);                                                   }
+static void ifn_log(ExprInterval *r, const ExprInterval *a)   {*r = iv_div(iv_ln(a[1]), iv_ln(a[0]));                              }
+static void ifn_mod(ExprInterval *r, const ExprInterval *a)   {*r = iv_mod(a[0], a[1]);                                            }
+static void ifn_round(ExprInterval *r, const ExprInterval *a) {*r = iv_inc(round, a[0]);                                           }
+static void ifn_floor(ExprInterval *r, const ExprInterval *a) {*r = iv_inc(floor, a[0]);                                           }
+static void ifn_ceil(ExprInterval *r, const ExprInterval *a)  {*r = iv_inc(ceil, a[0]);                                            }
+static void ifn_sin(ExprInterval *r, const ExprInterval *a)   {*r = iv_wave(sin, a[0], M_PI / 2.0, -M_PI / 2.0);                   }
+static void ifn_cos(ExprInterval *r, const ExprInterval *a)   {*r = iv_wave(cos, a[0], 0.0, M_PI);                                 }
+static void ifn_tan(ExprInterval *r, const ExprInterval *a)   {*r = iv_tan(a[0]);                                                  }
+static void ifn_asin(ExprInterval *r, const ExprInterval *a)  {*r = iv_inc_on(asin, a[0], -1.0, 1.0);                              }
+static void ifn_acos(ExprInterval *r, const ExprInterval *a)  {*r = iv_dec_on(acos, a[0], -1.0, 1.0);                              }
+static void ifn_atan(ExprInterval *r, const ExprInterval *a)  {*r = iv_inc(atan, a[0]);                                            }
+static void ifn_sinh(ExprInterval *r, const ExprInterval *a)  {*r = iv_inc(sinh, a[0]);                                            }
+static void ifn_cosh(ExprInterval *r, const ExprInterval *a)  {*r = iv_inc(cosh, iv_abs(a[0]));                                    }
+static void ifn_tanh(ExprInterval *r, const ExprInterval *a)  {*r = iv_inc(tanh, a[0]);                                            }
+static void ifn_asinh(ExprInterval *r, const ExprInterval *a) {*r = iv_inc(asinh, a[0]);                                           }
+static void ifn_acosh(ExprInterval *r, const ExprInterval *a) {*r = iv_inc_on(acosh, a[0], 1.0, HUGE_VAL);                         }
+static void ifn_atanh(ExprInterval *r, const ExprInterval *a) {*r = iv_inc_on(atanh, a[0], -1.0, 1.0);                             }
+static void ifn_abs(ExprInterval *r, const ExprInterval *a)   {*r = iv_abs(a[0]);                                                  }
+static void ifn_hypot(ExprInterval *r, const ExprInterval *a) {*r = iv_hypot(a[0], a[1]);                                          }
+static void ifn_polar(ExprInterval *r, const ExprInterval *a) {*r = iv_polar(a[0], a[1]);                                          }
+static void ifn_max(ExprInterval *r, const ExprInterval *a)   {*r = iv_max(a[0], a[1]);                                            }
+static void ifn_min(ExprInterval *r, const ExprInterval *a)   {*r = iv_min(a[0], a[1]);                                            }
+static void ifn_sum(ExprInterval *r, const ExprInterval *a)   {*r = iv_add(a[0], a[1]);                                            }
+static void ifn_prod(ExprInterval *r, const ExprInterval *a)  {*r = iv_mul(a[0], a[1]);                                            }
+static void ifn_mean(ExprInterval *r, const ExprInterval *a)  {*r = iv_mul(iv_add(a[0], a[1]), (ExprInterval){0.5, 0.5});          }
+static void ifn_rad(ExprInterval *r, const ExprInterval *a)   {*r = iv_mul(a[0], iv_out(180.0 / M_PI, 180.0 / M_PI, IV_LIBM_ULPS));}
+static void ifn_deg(ExprInterval *r, const ExprInterval *a)   {*r = iv_mul(a[0], iv_out(M_PI / 180.0, M_PI / 180.0, IV_LIBM_ULPS));}
+
 static double fn_set(Expr *e, ExprArg *args)   {
 	expr_set_var(e, args[0].Str, args[1].Num);
 	return args[1].Num;
 }
+static void dfn_set(double *d, ExprArg *a, double v) {d[0] = 0.0; d[1] = 1.0;}
+static double fn_unset(Expr *e, ExprArg *args) {
+	return expr_unset_var(e, args[0].Str);
+}
 
 static ExprArgType arg_types_n[]  = {ExprArgTypeNum                };
+static ExprArgType arg_types_s[]  = {ExprArgTypeStr                };
 static ExprArgType arg_types_nn[] = {ExprArgTypeNum, ExprArgTypeNum};
 static ExprArgType arg_types_sn[] = {ExprArgTypeStr, ExprArgTypeNum};
 
@@ -45,39 +375,44 @@ static const char *arg_names_x[]        = {"x"            };
 static const char *arg_names_xy[]       = {"x",    "y"    };
 static const char *arg_names_nx[]       = {"n",    "x"    };
 static const char *arg_names_name_val[] = {"name", "value"};
+static const char *arg_names_name[]     = {"name"         };
 
 static ExprBuiltinFunc _builtin_funcs[] = {
-	{"sqrt",  "square root of x",                 fn_sqrt,  arg_names_x,         arg_types_n,  1},
-	{"cbrt",  "cube root of x",                   fn_cbrt,  arg_names_x,         arg_types_n,  1},
-	{"pow",   "x^y",                              fn_pow,   arg_names_xy,        arg_types_nn, 2},
-	{"exp",   "e^x",                              fn_exp,   arg_names_x,         arg_types_n,  1},
-	{"ln",    "natural log (base e) of x",        fn_ln,    arg_names_x,         arg_types_n,  1},
-	{"log",   "log (base n) of x",                fn_log,   arg_names_nx,        arg_types_nn, 2},
-	{"mod",   "x%y",                              fn_mod,   arg_names_xy,        arg_types_nn, 2},
-	{"round", "closest integer to x",             fn_round, arg_names_x,         arg_types_n,  1},
-	{"floor", "greatest integer less than x",     fn_floor, arg_names_x,         arg_types_n,  1},
-	{"ceil",  "smallest integer grater than x",   fn_ceil,  arg_names_x,         arg_types_n,  1},
-	{"sin",   "sine of x",                        fn_sin,   arg_names_x,         arg_types_n,  1},
-	{"cos",   "cosine of x",                      fn_cos,   arg_names_x,         arg_types_n,  1},
-	{"tan",   "tangent of x",                     fn_tan,   arg_names_x,         arg_types_n,  1},
-	{"asin",  "inverse sine of x",                fn_asin,  arg_names_x,         arg_types_n,  1},
-	{"acos",  "inverse cosine of x",              fn_acos,  arg_names_x,         arg_types_n,  1},
-	{"atan",  "inverse tangent of x",             fn_atan,  arg_names_x,         arg_types_n,  1},
-	{"sinh",  "hyperbolic sine of x",             fn_sinh,  arg_names_x,         arg_types_n,  1},
-	{"cosh",  "hyperbolic cosine of x",           fn_cosh,  arg_names_x,         arg_types_n,  1},
-	{"tanh",  "hyperbolic tangent of x",          fn_tanh,  arg_names_x,         arg_types_n,  1},
-	{"asinh", "inverse hyperbolic sine of x",     fn_asinh, arg_names_x,         arg_types_n,  1},
-	{"acosh", "inverse hyperbolic cosine of x",   fn_acosh, arg_names_x,         arg_types_n,  1},
-	{"atanh", "inverse hyperbolic tangent of x",  fn_atanh, arg_names_x,         arg_types_n,  1},
-	{"abs",   "absolute value of x",              fn_abs,   arg_names_x,         arg_types_n,  1},
-	{"hypot", "sqrt(x^2+y^2)",                    fn_hypot, arg_names_xy,        arg_types_nn, 2},
-	{"polar", "polar coordinates to radians",     fn_polar, arg_names_xy,        arg_types_nn, 2},
-	{"max",   "the greater value of x and y",     fn_max,   arg_names_xy,        arg_types_nn, 2},
-	{"min",   "the smaller value of x and y",     fn_min,   arg_names_xy,        arg_types_nn, 2},
-	{"rad",   "x (radians) to degrees",           fn_rad,   arg_names_x,         arg_types_n,  1},
-	{"deg",   "x (degrees) to radians",           fn_deg,   arg_names_x,         arg_types_n,  1},
-
-	{"set",   "(re-)set the value of a variable", fn_set,   arg_names_name_val,  arg_types_sn, 2},
+	{"sqrt",  "square root of x",                 fn_sqrt,  arg_names_x,         arg_types_n,  1, vfn_sqrt,  false, false, dfn_sqrt,  ifn_sqrt },
+	{"cbrt",  "cube root of x",                   fn_cbrt,  arg_names_x,         arg_types_n,  1, vfn_cbrt,  false, false, dfn_cbrt,  ifn_cbrt },
+	{"pow",   "x^y",                              fn_pow,   arg_names_xy,        arg_types_nn, 2, vfn_pow,   false, false, dfn_pow,   ifn_pow  },
+	{"exp",   "e^x",                              fn_exp,   arg_names_x,         arg_types_n,  1, vfn_exp,   false, false, dfn_exp,   ifn_exp  },
+	{"ln",    "natural log (base e) of x",        fn_ln,    arg_names_x,         arg_types_n,  1, vfn_ln,    false, false, dfn_ln,    ifn_ln   },
+	{"log",   "log (base n) of x",                fn_log,   arg_names_nx,        arg_types_nn, 2, vfn_log,   false, false, dfn_log,   ifn_log  },
+	{"mod",   "x%y",                              fn_mod,   arg_names_xy,        arg_types_nn, 2, vfn_mod,   false, false, dfn_mod,   ifn_mod  },
+	{"round", "closest integer to x",             fn_round, arg_names_x,         arg_types_n,  1, vfn_round, false, false, dfn_round, ifn_round},
+	{"floor", "greatest integer less than x",     fn_floor, arg_names_x,         arg_types_n,  1, vfn_floor, false, false, dfn_floor, ifn_floor},
+	{"ceil",  "smallest integer grater than x",   fn_ceil,  arg_names_x,         arg_types_n,  1, vfn_ceil,  false, false, dfn_ceil,  ifn_ceil },
+	{"sin",   "sine of x",                        fn_sin,   arg_names_x,         arg_types_n,  1, vfn_sin,   false, false, dfn_sin,   ifn_sin  },
+	{"cos",   "cosine of x",                      fn_cos,   arg_names_x,         arg_types_n,  1, vfn_cos,   false, false, dfn_cos,   ifn_cos  },
+	{"tan",   "tangent of x",                     fn_tan,   arg_names_x,         arg_types_n,  1, vfn_tan,   false, false, dfn_tan,   ifn_tan  },
+	{"asin",  "inverse sine of x",                fn_asin,  arg_names_x,         arg_types_n,  1, vfn_asin,  false, false, dfn_asin,  ifn_asin },
+	{"acos",  "inverse cosine of x",              fn_acos,  arg_names_x,         arg_types_n,  1, vfn_acos,  false, false, dfn_acos,  ifn_acos },
+	{"atan",  "inverse tangent of x",             fn_atan,  arg_names_x,         arg_types_n,  1, vfn_atan,  false, false, dfn_atan,  ifn_atan },
+	{"sinh",  "hyperbolic sine of x",             fn_sinh,  arg_names_x,         arg_types_n,  1, vfn_sinh,  false, false, dfn_sinh,  ifn_sinh },
+	{"cosh",  "hyperbolic cosine of x",           fn_cosh,  arg_names_x,         arg_types_n,  1, vfn_cosh,  false, false, dfn_cosh,  ifn_cosh },
+	{"tanh",  "hyperbolic tangent of x",          fn_tanh,  arg_names_x,         arg_types_n,  1, vfn_tanh,  false, false, dfn_tanh,  ifn_tanh },
+	{"asinh", "inverse hyperbolic sine of x",     fn_asinh, arg_names_x,         arg_types_n,  1, vfn_asinh, false, false, dfn_asinh, ifn_asinh},
+	{"acosh", "inverse hyperbolic cosine of x",   fn_acosh, arg_names_x,         arg_types_n,  1, vfn_acosh, false, false, dfn_acosh, ifn_acosh},
+	{"atanh", "inverse hyperbolic tangent of x",  fn_atanh, arg_names_x,         arg_types_n,  1, vfn_atanh, false, false, dfn_atanh, ifn_atanh},
+	{"abs",   "absolute value of x",              fn_abs,   arg_names_x,         arg_types_n,  1, vfn_abs,   false, false, dfn_abs,   ifn_abs  },
+	{"hypot", "sqrt(x^2+y^2+...)",                fn_hypot, arg_names_xy,        arg_types_nn, 2, vfn_hypot, false, true,  dfn_hypot, ifn_hypot},
+	{"polar", "polar coordinates to radians",     fn_polar, arg_names_xy,        arg_types_nn, 2, vfn_polar, false, false, dfn_polar, ifn_polar},
+	{"max",   "the greatest of x, y, ...",        fn_max,   arg_names_xy,        arg_types_nn, 2, vfn_max,   false, true,  dfn_max,   ifn_max  },
+	{"min",   "the smallest of x, y, ...",        fn_min,   arg_names_xy,        arg_types_nn, 2, vfn_min,   false, true,  dfn_min,   ifn_min  },
+	{"sum",   "sum of x, y, ...",                 fn_sum,   arg_names_xy,        arg_types_nn, 2, vfn_sum,   false, true,  dfn_sum,   ifn_sum  },
+	{"prod",  "product of x, y, ...",             fn_prod,  arg_names_xy,        arg_types_nn, 2, vfn_prod,  false, true,  dfn_prod,  ifn_prod },
+	{"mean",  "arithmetic mean of x, y, ...",     fn_mean,  arg_names_xy,        arg_types_nn, 2, vfn_mean,  false, true,  dfn_mean,  ifn_mean },
+	{"rad",   "x (radians) to degrees",           fn_rad,   arg_names_x,         arg_types_n,  1, vfn_rad,   false, false, dfn_rad,   ifn_rad  },
+	{"deg",   "x (degrees) to radians",           fn_deg,   arg_names_x,         arg_types_n,  1, vfn_deg,   false, false, dfn_deg,   ifn_deg  },
+
+	{"set",   "(re-)set the value of a variable", fn_set,   arg_names_name_val,  arg_types_sn, 2, NULL,      true,  false, dfn_set,   NULL     },
+	{"unset", "remove a variable",                fn_unset, arg_names_name,      arg_types_s,  1, NULL,      true,  false, NULL,      NULL     },
 };
 
 static ExprBuiltinVar _builtin_vars[] = {
@@ -0,0 +1,83 @@
+/* Generates builtins_hash.h, perfect hash tables of the names of the builtin
+ * functions and variables in expr_config.h, so expr.c finds a builtin with a
+ * single probe. Run by the Makefile. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+
+#define EXPR_INCLUDE_CONFIG
+#include "expr_config.h"
+
+#define MAX_TABLE 4096
+
+/* Referenced by the builtins, which are never called here. */
+void expr_set_var(Expr *e, const char *name, double val) {
+}
+bool expr_unset_var(Expr *e, const char *name) {
+	return false;
+}
+
+/* Must match builtin_hash() in expr.c. */
+static uint32_t builtin_hash(const char *s, size_t n, uint32_t seed) {
+	uint32_t res = seed;
+	for (size_t i = 0; i < n; i++) {
+		res ^= (uint8_t)s[i];
+		res *= 16777619u;
+	}
+	/* The low bits of FNV-1a only depend on the low bits of the seed. */
+	return res ^ res >> 16;
+}
+
+/* Finds the smallest table, and a seed for it, in which no two of the n names
+ * collide, and prints it as name_SEED, name_MASK and name_table, which maps
+ * each slot to the index of its name or -1. */
+static void gen_table(const char *name, const char **names, size_t n) {
+	static int table[MAX_TABLE];
+	for (size_t size = 1; size <= MAX_TABLE; size *= 2) {
+		if (size < n)
+			continue;
+		for (uint32_t seed = 2166136261u; seed != 2166136261u + 100000; seed++) {
+			for (size_t i = 0; i < size; i++)
+				table[i] = -1;
+			size_t i = 0;
+			for (; i < n; i++) {
+				size_t slot = builtin_hash(names[i], strlen(names[i]), seed) & (size - 1);
+				if (table[slot] != -1)
+					break;
+				table[slot] = i;
+			}
+			if (i < n)
+				continue;
+
+			printf("#define %s_SEED %uu\n", name, seed);
+			printf("#define %s_MASK %zu\n", name, size - 1);
+			printf("static const int16_t %s_table[%zu] = {", name, size);
+			for (i = 0; i < size; i++)
+				printf("%s%d,", i % 16 == 0 ? "\n\t" : " ", table[i]);
+			printf("\n};\n\n");
+			return;
+		}
+	}
+	fprintf(stderr, "gen_builtins: no perfect hash found for %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main() {
+	size_t n_funcs = sizeof(_builtin_funcs) / sizeof(_builtin_funcs[0]);
+	size_t n_vars = sizeof(_builtin_vars) / sizeof(_builtin_vars[0]);
+	const char **names = malloc(sizeof(char*) * (n_funcs > n_vars ? n_funcs : n_vars));
+
+	printf("/* Generated by gen_builtins from expr_config.h; do not edit. */\n\n");
+	for (size_t i = 0; i < n_funcs; i++)
+		names[i] = _builtin_funcs[i].name;
+	gen_table("BUILTIN_FUNCS", names, n_funcs);
+	for (size_t i = 0; i < n_vars; i++)
+		names[i] = _builtin_vars[i].name;
+	gen_table("BUILTIN_VARS", names, n_vars);
+	free(names);
+	return 0;
+}
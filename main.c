@@ -1,11 +1,15 @@
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #ifdef ENABLE_READLINE
-#include <stdlib.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #endif
@@ -15,6 +19,43 @@
 #define ssub(_x, _y) ((_x) >= (_y) ? (_x) - (_y) : 0)
 #define bufprint(_buf, _n, ...) _n += snprintf(_buf + _n, ssub(sizeof(buf), _n), __VA_ARGS__)
 
+/* Rows evaluated at once in --map mode. */
+#define MAP_BLOCK 4096
+/* Lines read at once by -f with -j; runs of independent lines among them are
+ * spread across the threads if they are at least PARALLEL_MIN_LINES long per
+ * thread. */
+#define LINES_BLOCK 16384
+#define PARALLEL_MIN_LINES 64
+/* Axes taken by --sweep. */
+#define SWEEP_MAX_AXES 8
+
+typedef struct {
+	FILE *f;
+	char *buf;
+	size_t cap, len, pos;
+	bool eof;
+} LineReader;
+
+typedef struct {
+	size_t n_axes;
+	bool binary;
+} SweepOutput;
+
+/* Evaluates a slice of a run of independent lines on its own Expr. */
+typedef struct {
+	Expr *e;
+	char **lines;
+	size_t n;
+	ExprError *errs;
+	char *out;
+	size_t out_len, out_cap;
+	pthread_t thread;
+	bool started;
+	/* The counters of the thread, with a copy of its builtin calls. */
+	ExprStats stats;
+	size_t *builtin_calls;
+} LineWorker;
+
 static Expr *e;
 static bool running = true;
 static bool last_status_ok = true;
@@ -29,6 +70,26 @@ static void print_help() {
 		"Usage:\n"
 		"  qc \"<expression>\"  --  evaluate expression\n"
 		"  qc                 --  run in REPL mode\n"
+		"  qc --map \"<expr>\"  --  evaluate expression for each row of CSV data on\n"
+		"                         stdin, taking variables from the columns named\n"
+		"                         by the header line\n"
+		"  qc -f <file>       --  evaluate each line of file as in REPL mode; with\n"
+		"                         -j <n> behind the file, independent lines are\n"
+		"                         spread across n threads (0: one per CPU), their\n"
+		"                         results still printed in order\n"
+		"  qc - [-j <n>]      --  the same for the lines on stdin\n"
+		"  qc --sweep <x>=<from>:<step>:<to> [--sweep ...] [--binary] \"<expr>\"\n"
+		"                     --  evaluate expression on a grid, x taking the\n"
+		"                         values from, from + step, ... up to to, the last\n"
+		"                         axis innermost; prints lines of the coordinates\n"
+		"                         and the result, or with --binary the same as\n"
+		"                         native doubles\n"
+		"  qc --compile <file> -o <out>\n"
+		"                     --  compile the expressions in file, with the\n"
+		"                         functions defined before them, into out, which\n"
+		"                         -f evaluates without parsing them again\n"
+		"  qc --stats ...     --  any of the above, printing where the time went\n"
+		"                         on exit\n"
 		"  qc --help          --  show this page\n"
 		"Syntax:\n"
 		"  Numbers: 123.45 or 1.2345e2 or 1.2345E2\n"
@@ -37,13 +98,18 @@ static void print_help() {
 		"    1 (LtR)  | +, -\n"
 		"    2 (LtR)  | *, /\n"
 		"    3 (RtL)  | ^\n"
-		"  Other symbols: (, ), - (prefix)\n");
-	char buf[32][128];
+		"  Other symbols: (, ), - (prefix)\n"
+		"  Functions: f(x, y) = x^2 + y  defines f for the following expressions\n"
+		"  Formulas: y := a*x + b  defines y, which is updated whenever a, x or\n"
+		"            b changes\n"
+		"  Ranges: sum(i = 1, 10, i^2)  sums i^2 for i = 1, 2, ..., 10; works\n"
+		"          with any function taking x, y, ...\n");
+	char buf[64][128];
 	size_t maxw[2];
 	maxw[0] = 0;
 	fprintf(stderr, "Builtin functions:\n");
 	for (size_t i = 0; i < expr_n_builtin_funcs; i++) {
-		assert(i < 32);
+		assert(i < 64);
 		size_t n = 0;
 		bufprint(buf[i], n, "%s(", expr_builtin_funcs[i].name);
 		for (size_t j = 0; j < expr_builtin_funcs[i].n_args; j++) {
@@ -51,6 +117,8 @@ static void print_help() {
 				bufprint(buf[i], n, ", ");
 			bufprint(buf[i], n, "%s", expr_builtin_funcs[i].arg_names[j]);
 		}
+		if (expr_builtin_funcs[i].variadic)
+			bufprint(buf[i], n, ", ...");
 		bufprint(buf[i], n, ")");
 		if (n > maxw[0])
 			maxw[0] = n;
@@ -74,11 +142,67 @@ static void print_help() {
 	}
 }
 
+static void print_stats() {
+	ExprStats s;
+	if (!expr_get_stats(&s)) {
+		fprintf(stderr, "Statistics are not available; build with make stats\n");
+		return;
+	}
+	fprintf(stderr,
+		"Statistics:\n"
+		"  Tokens:             %zu\n"
+		"  Instructions:       %zu\n"
+		"  Folded operations:  %zu\n"
+		"  Bytes moved:        %zu\n"
+		"  Hash table probes:  %zu\n"
+		"  Hash table resizes: %zu\n"
+		"  Allocations:        %zu\n"
+		"  Evaluations:        %zu\n"
+		"  Tokenizing:         %.3f ms\n"
+		"  Compiling:          %.3f ms\n"
+		"  Evaluating:         %.3f ms\n",
+		s.toks, s.ops, s.folds, s.moved, s.probes, s.resizes, s.allocs, s.evals,
+		s.tokenize_ns / 1e6, s.compile_ns / 1e6, s.eval_ns / 1e6);
+	bool any = false;
+	for (size_t i = 0; i < expr_n_builtin_funcs; i++) {
+		if (s.builtin_calls[i] == 0)
+			continue;
+		if (!any)
+			fprintf(stderr, "  Builtin calls:\n");
+		any = true;
+		fprintf(stderr, "    %-8s %zu\n", expr_builtin_funcs[i].name, s.builtin_calls[i]);
+	}
+}
+
 static void sig_handler(int signum) {
 	running = false;
 	fprintf(stderr, "\nExiting\n");
 }
 
+static void print_error(const char *line, ExprError err) {
+	fprintf(stderr, "Error parsing expression:\n");
+	fprintf(stderr, "%s\n", line);
+	fprintf(stderr, "%*s", (int)err.start, "");
+	for (size_t i = err.start; i <= err.end; i++)
+		fprintf(stderr, "^");
+	fprintf(stderr, "\n%s\n", err.err);
+}
+
+/* Whether the line defines a function, like "f(x) = x^2"; the '=' of a range
+ * like sum(i = 1, 10, i^2) is within parentheses. */
+static bool is_func_def(const char *line) {
+	size_t depth = 0;
+	for (const char *c = line; *c != 0; c++) {
+		if (*c == '(')
+			depth++;
+		else if (*c == ')' && depth > 0)
+			depth--;
+		else if (*c == '=' && depth == 0)
+			return true;
+	}
+	return false;
+}
+
 static bool run(const char *line) {
 	if (line == NULL || line[0] == 0)
 		return line != NULL;
@@ -88,22 +212,517 @@ static bool run(const char *line) {
 	}
 	double res;
 	ExprError err;
+	if (strstr(line, ":=") != NULL) {
+		err = expr_define_var(e, line);
+		if (err.err != NULL)
+			print_error(line, err);
+		return err.err == NULL;
+	}
+	if (is_func_def(line)) {
+		err = expr_define_func(e, line);
+		if (err.err != NULL)
+			print_error(line, err);
+		return err.err == NULL;
+	}
 	err = expr_set(e, line);
 	if (err.err == NULL)
 		err = expr_eval(e, &res);
-	if (err.err == NULL) {
+	if (err.err == NULL)
 		printf("%.*g\n", 15, res);
-	} else {
-		fprintf(stderr, "Error parsing expression:\n");
-		fprintf(stderr, "%s\n", line);
-		fprintf(stderr, "%*s", (int)err.start, "");
-		for (size_t i = err.start; i <= err.end; i++)
-			fprintf(stderr, "^");
-		fprintf(stderr, "\n%s\n", err.err);
-	}
+	else
+		print_error(line, err);
 	return err.err == NULL;
 }
 
+static void line_reader_init(LineReader *r, FILE *f) {
+	*r = (LineReader){.f = f, .cap = 1 << 20};
+	r->buf = malloc(r->cap + 1);
+}
+
+/* Returns the next line of input, or NULL at the end of it. The line is not
+ * copied out of the read buffer, so it stays valid only until the next call;
+ * it is not NUL-terminated, but always followed by a '\n'. */
+static char *read_line(LineReader *r, size_t *out_len) {
+	while (1) {
+		char *start = r->buf + r->pos;
+		char *nl = memchr(start, '\n', r->len - r->pos);
+		if (nl != NULL) {
+			r->pos = nl + 1 - r->buf;
+			*out_len = nl - start;
+			return start;
+		}
+		if (r->eof) {
+			if (r->pos == r->len)
+				return NULL;
+			/* Terminate the last line; the buffer has room for one more byte. */
+			r->buf[r->len++] = '\n';
+			continue;
+		}
+		/* Move the incomplete line to the front and read more, growing the
+		 * buffer if the line doesn't fit into it. */
+		memmove(r->buf, start, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+		if (r->len == r->cap) {
+			r->cap *= 2;
+			r->buf = realloc(r->buf, r->cap + 1);
+		}
+		size_t n = fread(r->buf + r->len, 1, r->cap - r->len, r->f);
+		if (n == 0)
+			r->eof = true;
+		r->len += n;
+	}
+}
+
+static bool map_csv(const char *expr) {
+	ExprError err = expr_set(e, expr);
+	if (err.err != NULL) {
+		print_error(expr, err);
+		return false;
+	}
+
+	LineReader r;
+	line_reader_init(&r, stdin);
+	static char out_buf[1 << 20];
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+	size_t n_inputs = expr_n_inputs(e);
+	double **cols = calloc(n_inputs, sizeof(double*));
+	double *res = malloc(sizeof(double) * MAP_BLOCK);
+	/* Input index for each CSV column, or -1 if it isn't used. */
+	long *col_input = NULL;
+	size_t n_cols = 0;
+	bool ok = false;
+
+	size_t len;
+	char *line = read_line(&r, &len);
+	if (line == NULL) {
+		fprintf(stderr, "Error: missing CSV header line\n");
+		goto done;
+	}
+	for (char *p = line, *end = line + len; p <= end; n_cols++) {
+		char *sep = memchr(p, ',', end - p);
+		if (sep == NULL)
+			sep = end;
+		char *name_end = sep;
+		while (p < name_end && (*p == ' ' || *p == '\t'))
+			p++;
+		while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t' || name_end[-1] == '\r'))
+			name_end--;
+		col_input = realloc(col_input, sizeof(long) * (n_cols + 1));
+		col_input[n_cols] = -1;
+		for (size_t i = 0; i < n_inputs; i++) {
+			const char *name = expr_input_name(e, i);
+			if (cols[i] == NULL && strlen(name) == (size_t)(name_end - p) && strncmp(name, p, name_end - p) == 0) {
+				cols[i] = malloc(sizeof(double) * MAP_BLOCK);
+				col_input[n_cols] = i;
+				break;
+			}
+		}
+		p = sep + 1;
+	}
+	for (size_t i = 0; i < n_inputs; i++) {
+		double val;
+		if (cols[i] == NULL && !expr_get_var(e, expr_input_name(e, i), &val)) {
+			fprintf(stderr, "Error: no CSV column named '%s'\n", expr_input_name(e, i));
+			goto done;
+		}
+	}
+
+	size_t line_no = 1, n_rows = 0;
+	while (1) {
+		line = read_line(&r, &len);
+		line_no++;
+		if (line != NULL) {
+			if (len == 0 || (len == 1 && line[0] == '\r'))
+				continue;
+			/* Numbers are parsed right out of the read buffer; strtod stops at
+			 * the next ',' or the '\n' behind the line. */
+			char *p = line, *end = line + len;
+			for (size_t j = 0; j < n_cols; j++) {
+				if (p > end) {
+					fprintf(stderr, "Error: line %zu: expected %zu fields\n", line_no, n_cols);
+					goto done;
+				}
+				char *sep = memchr(p, ',', end - p);
+				if (sep == NULL)
+					sep = end;
+				if (col_input[j] >= 0) {
+					char *num_end;
+					cols[col_input[j]][n_rows] = strtod(p, &num_end);
+					while (num_end < sep && (*num_end == ' ' || *num_end == '\t' || *num_end == '\r'))
+						num_end++;
+					if (num_end == p || num_end != sep) {
+						fprintf(stderr, "Error: line %zu, field %zu: invalid number\n", line_no, j + 1);
+						goto done;
+					}
+				}
+				p = sep + 1;
+			}
+			n_rows++;
+		}
+		if (n_rows == MAP_BLOCK || (line == NULL && n_rows > 0)) {
+			err = expr_eval_batch(e, n_rows, (const double**)cols, res);
+			if (err.err != NULL) {
+				print_error(expr, err);
+				goto done;
+			}
+			for (size_t i = 0; i < n_rows; i++)
+				printf("%.*g\n", 15, res[i]);
+			n_rows = 0;
+		}
+		if (line == NULL)
+			break;
+	}
+	ok = true;
+
+done:
+	fflush(stdout);
+	for (size_t i = 0; i < n_inputs; i++)
+		free(cols[i]);
+	free(cols);
+	free(res);
+	free(col_input);
+	free(r.buf);
+	return ok;
+}
+
+/* Checks via the bits, as the compiler may assume there are no NaNs. */
+static bool is_finite(double x) {
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return (bits >> 52 & 0x7ff) != 0x7ff;
+}
+
+/* Parses an axis like "x=0:0.1:10"; the bounds and the step may be
+ * expressions, like "t=0:pi/100:2*pi". */
+static bool parse_axis(const char *spec, ExprSweepAxis *out) {
+	const char *eq = strchr(spec, '=');
+	if (eq == NULL || eq == spec) {
+		fprintf(stderr, "Error: expected <variable>=<from>:<step>:<to>, got '%s'\n", spec);
+		return false;
+	}
+	double vals[3];
+	const char *p = eq + 1;
+	for (size_t i = 0; i < 3; i++) {
+		const char *end = i < 2 ? strchr(p, ':') : p + strlen(p);
+		if (end == NULL) {
+			fprintf(stderr, "Error: expected <variable>=<from>:<step>:<to>, got '%s'\n", spec);
+			return false;
+		}
+		ExprError err = expr_set_n(e, p, end - p);
+		if (err.err == NULL)
+			err = expr_eval(e, &vals[i]);
+		if (err.err != NULL) {
+			err.start += p - spec;
+			err.end += p - spec;
+			print_error(spec, err);
+			return false;
+		}
+		p = end + 1;
+	}
+	double from = vals[0], step = vals[1], to = vals[2];
+	/* Steps like 0.1 rarely divide the span exactly. */
+	double q = (to - from) / step, r = round(q);
+	if (fabs(q - r) <= 1e-9 * fabs(r))
+		q = r;
+	if (!is_finite(from) || !is_finite(to) || step == 0 || !is_finite(q) || q < 0) {
+		fprintf(stderr, "Error: '%s' has no points\n", spec);
+		return false;
+	}
+	if (q >= 1e15) {
+		fprintf(stderr, "Error: '%s' has too many points\n", spec);
+		return false;
+	}
+	*out = (ExprSweepAxis){.name = strndup(spec, eq - spec), .from = from, .step = step, .n = (size_t)q + 1};
+	return true;
+}
+
+static void sweep_output(void *userdata, const double **coords, const double *res, size_t n) {
+	SweepOutput *o = userdata;
+	double point[SWEEP_MAX_AXES + 1];
+	for (size_t i = 0; i < n; i++) {
+		if (o->binary) {
+			for (size_t k = 0; k < o->n_axes; k++)
+				point[k] = coords[k][i];
+			point[o->n_axes] = res[i];
+			fwrite(point, sizeof(double), o->n_axes + 1, stdout);
+		} else {
+			for (size_t k = 0; k < o->n_axes; k++)
+				printf("%.*g ", 15, coords[k][i]);
+			printf("%.*g\n", 15, res[i]);
+		}
+	}
+}
+
+static bool sweep(const char **args, size_t n_args) {
+	ExprSweepAxis axes[SWEEP_MAX_AXES];
+	SweepOutput o = {0};
+	bool ok = false;
+	size_t i = 0;
+	for (; i + 1 < n_args; i++) {
+		if (strcmp(args[i], "--binary") == 0) {
+			o.binary = true;
+		} else if (strcmp(args[i], "--sweep") == 0 && i + 2 < n_args && o.n_axes < SWEEP_MAX_AXES) {
+			if (!parse_axis(args[++i], &axes[o.n_axes]))
+				goto done;
+			o.n_axes++;
+		} else {
+			print_help();
+			goto done;
+		}
+	}
+	const char *expr = args[n_args - 1];
+	ExprError err = expr_set(e, expr);
+	if (err.err != NULL) {
+		print_error(expr, err);
+		goto done;
+	}
+
+	static char out_buf[1 << 20];
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+	err = expr_sweep(e, axes, o.n_axes, sweep_output, &o);
+	fflush(stdout);
+	if (err.err != NULL) {
+		print_error(expr, err);
+		goto done;
+	}
+	if (ferror(stdout)) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		goto done;
+	}
+	ok = true;
+
+done:
+	for (size_t k = 0; k < o.n_axes; k++)
+		free((char*)axes[k].name);
+	return ok;
+}
+
+/* Whether the line can be evaluated on a copy of e, in any order with other
+ * such lines. Definitions change e, and so may expressions with side effects,
+ * which takes compiling them to tell. Lines which don't compile are left for
+ * the workers to report. */
+static bool line_independent(const char *line) {
+	if (strstr(line, ":=") != NULL || is_func_def(line) || strcmp(line, "help") == 0)
+		return false;
+	return expr_set(e, line).err != NULL || !expr_has_side_effects(e);
+}
+
+static void *eval_lines(void *arg) {
+	LineWorker *w = arg;
+	for (size_t i = 0; i < w->n; i++) {
+		w->errs[i] = (ExprError){0};
+		if (w->lines[i][0] == 0)
+			continue;
+		double res;
+		ExprError err = expr_set(w->e, w->lines[i]);
+		if (err.err == NULL)
+			err = expr_eval(w->e, &res);
+		if (err.err != NULL) {
+			w->errs[i] = err;
+			continue;
+		}
+		if (w->out_len + 32 > w->out_cap) {
+			w->out_cap = w->out_cap == 0 ? 1 << 16 : w->out_cap * 2;
+			w->out = realloc(w->out, w->out_cap);
+		}
+		w->out_len += snprintf(w->out + w->out_len, 32, "%.*g\n", 15, res);
+	}
+	return NULL;
+}
+
+/* Runs eval_lines() on a thread of its own, keeping its counters for the main
+ * thread to add to its own; they go away with the thread. */
+static void *eval_lines_thread(void *arg) {
+	LineWorker *w = arg;
+	eval_lines(w);
+	if (expr_get_stats(&w->stats)) {
+		w->builtin_calls = realloc(w->builtin_calls, sizeof(size_t) * expr_n_builtin_funcs);
+		memcpy(w->builtin_calls, w->stats.builtin_calls, sizeof(size_t) * expr_n_builtin_funcs);
+		w->stats.builtin_calls = w->builtin_calls;
+	}
+	return NULL;
+}
+
+/* Evaluates the n independent lines on n_workers copies of e, and prints the
+ * results in order. */
+static bool eval_lines_parallel(char **lines, size_t n, LineWorker *workers, size_t n_workers) {
+	for (size_t i = 0; i < n_workers; i++) {
+		LineWorker *w = &workers[i];
+		size_t lo = n * i / n_workers, hi = n * (i + 1) / n_workers;
+		w->e = expr_clone(e);
+		w->lines = lines + lo;
+		w->n = hi - lo;
+		w->errs = realloc(w->errs, sizeof(ExprError) * w->n);
+		w->out_len = 0;
+		w->started = pthread_create(&w->thread, NULL, eval_lines_thread, w) == 0;
+		if (!w->started)
+			eval_lines(w);
+	}
+	bool ok = true;
+	for (size_t i = 0; i < n_workers; i++) {
+		LineWorker *w = &workers[i];
+		if (w->started) {
+			pthread_join(w->thread, NULL);
+			expr_add_stats(&w->stats);
+		}
+		fwrite(w->out, 1, w->out_len, stdout);
+		for (size_t j = 0; j < w->n; j++) {
+			if (w->errs[j].err != NULL) {
+				print_error(w->lines[j], w->errs[j]);
+				ok = false;
+			}
+		}
+		expr_destroy(w->e);
+	}
+	return ok;
+}
+
+/* Compiles the expressions in the file at in_path into one at out_path, which
+ * -f evaluates without parsing. Function definitions are applied as they come
+ * and compiled into the expressions after them. */
+static bool compile_lines(const char *in_path, const char *out_path) {
+	FILE *f = fopen(in_path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Error opening %s: %s\n", in_path, strerror(errno));
+		return false;
+	}
+	LineReader r;
+	line_reader_init(&r, f);
+	ExprFileWriter *w = expr_file_writer_new();
+	bool ok = true;
+
+	size_t len;
+	char *line;
+	while ((line = read_line(&r, &len)) != NULL) {
+		if (len > 0 && line[len - 1] == '\r')
+			len--;
+		line[len] = 0;
+		if (len == 0 || strcmp(line, "help") == 0)
+			continue;
+		if (strstr(line, ":=") != NULL) {
+			fprintf(stderr, "Error: formulas can't be compiled:\n%s\n", line);
+			ok = false;
+			continue;
+		}
+		if (is_func_def(line)) {
+			ok &= run(line);
+			continue;
+		}
+		ExprError err = expr_set(e, line);
+		if (err.err != NULL) {
+			print_error(line, err);
+			ok = false;
+		} else if (!expr_file_writer_add(w, e)) {
+			fprintf(stderr, "Error compiling:\n%s\n%s\n", line, strerror(errno));
+			ok = false;
+		}
+	}
+	if (ok && !expr_file_writer_save(w, out_path)) {
+		fprintf(stderr, "Error writing %s: %s\n", out_path, strerror(errno));
+		ok = false;
+	}
+	expr_file_writer_free(w);
+	free(r.buf);
+	fclose(f);
+	return ok;
+}
+
+/* Evaluates each expression of a file written by compile_lines(). */
+static bool run_compiled(ExprFile *f) {
+	static char out_buf[1 << 20];
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+	bool ok = true;
+	for (size_t i = 0; i < expr_file_len(f); i++) {
+		double res;
+		ExprError err = expr_set_from_file(e, f, i);
+		if (err.err == NULL)
+			err = expr_eval(e, &res);
+		if (err.err == NULL)
+			printf("%.*g\n", 15, res);
+		else {
+			print_error(expr_file_src(f, i), err);
+			ok = false;
+		}
+	}
+	fflush(stdout);
+	return ok;
+}
+
+/* Evaluates each line of f. With more than one thread, lines are read a block
+ * at a time, and the runs of independent lines in each block spread across
+ * the threads. */
+static bool run_lines(FILE *f, size_t n_threads) {
+	LineReader r;
+	line_reader_init(&r, f);
+	static char out_buf[1 << 20];
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+	/* The lines of a block are copied out of the read buffer. */
+	char **lines = malloc(sizeof(char*) * LINES_BLOCK);
+	size_t *offsets = malloc(sizeof(size_t) * LINES_BLOCK);
+	char *block = NULL;
+	size_t block_len = 0, block_cap = 0;
+	LineWorker *workers = calloc(n_threads, sizeof(LineWorker));
+	bool ok = true;
+
+	while (1) {
+		size_t len, n = 0;
+		char *line;
+		block_len = 0;
+		while (n < LINES_BLOCK && (line = read_line(&r, &len)) != NULL) {
+			if (len > 0 && line[len - 1] == '\r')
+				len--;
+			line[len] = 0;
+			if (n_threads <= 1) {
+				ok &= run(line);
+				continue;
+			}
+			if (block_len + len + 1 > block_cap) {
+				block_cap = block_cap == 0 ? 1 << 20 : block_cap * 2;
+				while (block_len + len + 1 > block_cap)
+					block_cap *= 2;
+				block = realloc(block, block_cap);
+			}
+			memcpy(block + block_len, line, len + 1);
+			offsets[n++] = block_len;
+			block_len += len + 1;
+		}
+		if (n == 0)
+			break;
+		for (size_t i = 0; i < n; i++)
+			lines[i] = block + offsets[i];
+
+		for (size_t i = 0; i < n;) {
+			size_t j = i;
+			while (j < n && line_independent(lines[j]))
+				j++;
+			if (j - i >= PARALLEL_MIN_LINES * n_threads) {
+				ok &= eval_lines_parallel(lines + i, j - i, workers, n_threads);
+				i = j;
+			} else {
+				/* Too short to be worth it, or not independent. */
+				for (size_t end = j > i ? j : i + 1; i < end; i++)
+					ok &= run(lines[i]);
+			}
+		}
+	}
+
+	fflush(stdout);
+	for (size_t i = 0; i < n_threads; i++) {
+		free(workers[i].errs);
+		free(workers[i].out);
+		free(workers[i].builtin_calls);
+	}
+	free(workers);
+	free(block);
+	free(offsets);
+	free(lines);
+	free(r.buf);
+	return ok;
+}
+
 #if ENABLE_READLINE
 static void winch_handler(int signum) {
 	sigwinch_received = true;
@@ -178,11 +797,66 @@ int main(int argc, const char **argv) {
 
 	e = expr_new();
 
+	if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+		atexit(print_stats);
+		argc--;
+		argv++;
+	}
 	if (argc == 1) {
 		printf("Running in REPL (read-evaluate-print loop) mode. Type `help` for more information.\n");
 		printf("Hit Ctrl+C to exit.\n");
+	} else if (((argc == 2 || argc == 4) && strcmp(argv[1], "-") == 0) || ((argc == 3 || argc == 5) && strcmp(argv[1], "-f") == 0)) {
+		bool from_stdin = argv[1][1] == 0;
+		const char **opts = argv + (from_stdin ? 2 : 3);
+		long n_threads = 1;
+		if (argc == (from_stdin ? 4 : 5)) {
+			char *end;
+			n_threads = strtol(opts[1], &end, 10);
+			if (strcmp(opts[0], "-j") != 0 || *end != 0 || end == opts[1] || n_threads < 0) {
+				print_help();
+				return 1;
+			}
+			if (n_threads == 0) {
+				long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+				n_threads = n_cpus > 0 ? n_cpus : 1;
+			}
+		}
+		/* Files written by --compile are recognized by their contents. */
+		ExprFile *compiled = from_stdin ? NULL : expr_file_open(argv[2]);
+		if (compiled != NULL) {
+			bool ok = run_compiled(compiled);
+			expr_destroy(e);
+			expr_file_close(compiled);
+			return !ok;
+		}
+		FILE *f = NULL;
+		if (from_stdin)
+			f = stdin;
+		else if (errno == EINVAL)
+			f = fopen(argv[2], "r");
+		if (f == NULL) {
+			fprintf(stderr, "Error opening %s: %s\n", argv[2], strerror(errno));
+			return 1;
+		}
+		bool ok = run_lines(f, n_threads);
+		if (!from_stdin)
+			fclose(f);
+		expr_destroy(e);
+		return !ok;
 	} else if (argc == 2 && strcmp(argv[1], "-h") != 0 && strcmp(argv[1], "--help") != 0) {
 		return !run(argv[1]);
+	} else if (argc == 5 && strcmp(argv[1], "--compile") == 0 && strcmp(argv[3], "-o") == 0) {
+		bool ok = compile_lines(argv[2], argv[4]);
+		expr_destroy(e);
+		return !ok;
+	} else if (argc >= 4 && strcmp(argv[1], "--sweep") == 0) {
+		bool ok = sweep(argv + 1, argc - 1);
+		expr_destroy(e);
+		return !ok;
+	} else if (argc == 3 && strcmp(argv[1], "--map") == 0) {
+		bool ok = map_csv(argv[2]);
+		expr_destroy(e);
+		return !ok;
 	} else {
 		print_help();
 		return 1;